@@ -0,0 +1,786 @@
+#ifndef __LINUX_KERNEL__
+#define __LINUX_KERNEL__
+#endif
+
+#include <linux/bitmap.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/list_sort.h>
+#include <linux/log2.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include "fs.h"
+#include "disk.h"
+
+#define MAP_ENTRIES (sizeof(struct bbfs_bmap_block) / sizeof(uint32_t))
+
+static unsigned long bbfs_map_entries(struct bbfs_sb_info *sbi) {
+    return sbi->disk_sb.features & BBFS_FEAT_PACKED_BITMAP ? PAGE_SIZE * BITS_PER_BYTE : MAP_ENTRIES;
+}
+
+/*
+ * The buddy tree and free_blocks are what the allocator sees, d_map is what goes to disk. They only disagree for
+ * blocks that are free on disk but still busy: freed by a transaction that has not committed, waiting for a discard,
+ * being trimmed, or held for a level that is being zeroed before it is mapped.
+ */
+static void bbfs_mark_buddy(struct bbfs_group *grp, unsigned long blk_start, unsigned long blk_num, bool free) {
+    bbfs_buddy_update(grp->buddy, blk_start - grp->blk_start, blk_start - grp->blk_start + blk_num, free);
+    if (free) {
+        grp->free_blocks += blk_num;
+    } else {
+        grp->free_blocks -= blk_num;
+    }
+}
+
+static void bbfs_mark_map(struct bbfs_sb_info *sbi, unsigned long blk_start, unsigned long blk_num, bool free) {
+    if (free) {
+        bitmap_clear(sbi->d_map, blk_start, blk_num);
+    } else {
+        bitmap_set(sbi->d_map, blk_start, blk_num);
+    }
+    unsigned long entries = bbfs_map_entries(sbi);
+    for (unsigned long i = blk_start / entries; i <= (blk_start + blk_num - 1) / entries; i++) {
+        set_bit(i, sbi->d_dirty);
+    }
+    bbfs_journal_log(sbi, BBFS_JOP_BLOCKS | (free ? 0 : BBFS_JOP_SET), blk_start, blk_num);
+}
+
+static void bbfs_mark_blocks(struct bbfs_sb_info *sbi, struct bbfs_group *grp, unsigned long blk_start,
+                             unsigned long blk_num, bool free) {
+    bbfs_mark_buddy(grp, blk_start, blk_num, free);
+    bbfs_mark_map(sbi, blk_start, blk_num, free);
+}
+
+/* Give busy blocks back to the allocator. */
+static void bbfs_unbusy_blocks(struct bbfs_sb_info *sbi, unsigned long blk_start, unsigned long nr) {
+    unsigned long blk_end = blk_start + nr;
+
+    while (blk_start < blk_end) {
+        struct bbfs_group *grp = &sbi->groups[blk_start / sbi->group_blocks];
+        unsigned long blk_num = min(blk_end, grp->blk_start + grp->nr_blocks) - blk_start;
+        spin_lock(&grp->lock);
+        bbfs_mark_buddy(grp, blk_start, blk_num, true);
+        spin_unlock(&grp->lock);
+        blk_start += blk_num;
+    }
+}
+
+static sector_t bbfs_blk_sector(struct bbfs_sb_info *sbi, unsigned long blk) {
+    return (sbi->block_begin + blk) << (PAGE_SHIFT - SECTOR_SHIFT);
+}
+
+struct bbfs_discard {
+    struct list_head list;
+    unsigned long start, nr;
+};
+
+static int bbfs_discard_cmp(void *priv, const struct list_head *a, const struct list_head *b) {
+    return list_entry(a, struct bbfs_discard, list)->start > list_entry(b, struct bbfs_discard, list)->start;
+}
+
+/* Discard everything that is ready in one batch: sorted, merged, and chained so there is a single wait. */
+static void bbfs_discard_work(struct work_struct *work) {
+    struct bbfs_sb_info *sbi = container_of(work, struct bbfs_sb_info, discard_work);
+    struct bbfs_discard *d, *next;
+    struct bio *bio = NULL;
+    LIST_HEAD(list);
+
+    spin_lock(&sbi->discard_lock);
+    list_splice_init(&sbi->discard_ready, &list);
+    spin_unlock(&sbi->discard_lock);
+    if (list_empty(&list)) {
+        return;
+    }
+
+    list_sort(NULL, &list, bbfs_discard_cmp);
+    list_for_each_entry_safe(d, next, &list, list) {
+        while (&next->list != &list && d->start + d->nr == next->start) {
+            d->nr += next->nr;
+            list_del(&next->list);
+            kfree(next);
+            next = list_next_entry(d, list);
+        }
+        __blkdev_issue_discard(sbi->sb->s_bdev, bbfs_blk_sector(sbi, d->start),
+                               (sector_t)d->nr << (PAGE_SHIFT - SECTOR_SHIFT), GFP_NOFS, &bio);
+    }
+    if (bio) {
+        submit_bio_wait(bio);
+        bio_put(bio);
+    }
+    list_for_each_entry_safe(d, next, &list, list) {
+        bbfs_unbusy_blocks(sbi, d->start, d->nr);
+        list_del(&d->list);
+        kfree(d);
+    }
+}
+
+void bbfs_init_discard(struct bbfs_sb_info *sbi) {
+    spin_lock_init(&sbi->discard_lock);
+    INIT_LIST_HEAD(&sbi->discard_running);
+    INIT_LIST_HEAD(&sbi->discard_ready);
+    INIT_WORK(&sbi->discard_work, bbfs_discard_work);
+}
+
+/*
+ * Remember busy freed blocks. With a journal they wait for the transaction that freed them to commit, since until
+ * then a crash brings the old owner back, so this must not fail; without one only discard keeps them busy, and they
+ * go out at once.
+ */
+static bool bbfs_add_discard(struct bbfs_sb_info *sbi, unsigned long blk_start, unsigned long nr) {
+    bool ready = !sbi->journal;
+    struct list_head *head = ready ? &sbi->discard_ready : &sbi->discard_running;
+
+    spin_lock(&sbi->discard_lock);
+    if (!list_empty(head)) {
+        struct bbfs_discard *last = list_last_entry(head, struct bbfs_discard, list);
+        if (last->start + last->nr == blk_start) {
+            last->nr += nr;
+            spin_unlock(&sbi->discard_lock);
+            return true;
+        }
+    }
+    spin_unlock(&sbi->discard_lock);
+
+    struct bbfs_discard *d = kmalloc(sizeof(*d), ready ? GFP_NOFS : GFP_NOFS | __GFP_NOFAIL);
+    if (!d) {
+        return false;
+    }
+    d->start = blk_start;
+    d->nr = nr;
+    spin_lock(&sbi->discard_lock);
+    list_add_tail(&d->list, head);
+    spin_unlock(&sbi->discard_lock);
+    if (ready) {
+        queue_work(system_unbound_wq, &sbi->discard_work);
+    }
+    return true;
+}
+
+/*
+ * Called by the journal with the extents its commit freed, which may be reused from now on. They are discarded
+ * first if the option is set and the commit made it to disk.
+ */
+void bbfs_queue_discards(struct super_block *sb, struct list_head *list, bool committed) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+
+    if (list_empty(list)) {
+        return;
+    }
+    if (committed && (sbi->mount_opts & BBFS_MOUNT_DISCARD)) {
+        spin_lock(&sbi->discard_lock);
+        list_splice_tail_init(list, &sbi->discard_ready);
+        spin_unlock(&sbi->discard_lock);
+        queue_work(system_unbound_wq, &sbi->discard_work);
+        return;
+    }
+    struct bbfs_discard *d, *next;
+    list_for_each_entry_safe(d, next, list, list) {
+        bbfs_unbusy_blocks(sbi, d->start, d->nr);
+        list_del(&d->list);
+        kfree(d);
+    }
+}
+
+/* Wait for queued discards at unmount, and drop whatever an aborted journal left uncommitted. */
+void bbfs_flush_discards(struct bbfs_sb_info *sbi) {
+    struct bbfs_discard *d, *next;
+
+    flush_work(&sbi->discard_work);
+    list_for_each_entry_safe(d, next, &sbi->discard_running, list) {
+        list_del(&d->list);
+        kfree(d);
+    }
+}
+
+/* Take blocks from the allocator, or give them back; held blocks are only taken from the buddy tree. */
+static void bbfs_take_blocks(struct bbfs_sb_info *sbi, struct bbfs_group *grp, unsigned long blk_start,
+                             unsigned long blk_num, bool free, bool hold) {
+    if (hold) {
+        bbfs_mark_buddy(grp, blk_start, blk_num, free);
+    } else {
+        bbfs_mark_blocks(sbi, grp, blk_start, blk_num, free);
+    }
+}
+
+static unsigned long bbfs_alloc_span(struct bbfs_sb_info *sbi, int level, bool hold) {
+    unsigned long blk_num = 1ul << level;
+    unsigned long span = DIV_ROUND_UP(blk_num, sbi->group_blocks);
+
+    for (unsigned long first = 0; first + span <= sbi->nr_groups; first++) {
+        unsigned long taken = 0;
+        while (taken < span) {
+            struct bbfs_group *grp = &sbi->groups[first + taken];
+            spin_lock(&grp->lock);
+            if (grp->nr_blocks != sbi->group_blocks || grp->free_blocks != grp->nr_blocks) {
+                spin_unlock(&grp->lock);
+                break;
+            }
+            bbfs_take_blocks(sbi, grp, grp->blk_start, min(grp->nr_blocks, blk_num - taken * sbi->group_blocks),
+                             false, hold);
+            spin_unlock(&grp->lock);
+            taken++;
+        }
+        if (taken == span) {
+            return first * sbi->group_blocks;
+        }
+        while (taken--) {
+            struct bbfs_group *grp = &sbi->groups[first + taken];
+            spin_lock(&grp->lock);
+            bbfs_take_blocks(sbi, grp, grp->blk_start, min(grp->nr_blocks, blk_num - taken * sbi->group_blocks),
+                             true, hold);
+            spin_unlock(&grp->lock);
+        }
+    }
+    return LONG_MAX;
+}
+
+static unsigned long bbfs_find_free_block(struct inode *inode, int level, bool hold) {
+    struct bbfs_sb_info *sbi = BBFS_SB(inode->i_sb);
+    unsigned long start = inode->i_ino / sbi->group_inodes;
+
+    if (level >= BITS_PER_LONG) {
+        return LONG_MAX;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        for (unsigned long n = 0; n < sbi->nr_groups; n++) {
+            struct bbfs_group *grp = &sbi->groups[(start + n) % sbi->nr_groups];
+            if (READ_ONCE(grp->buddy->tree[1]) <= level) {
+                continue;
+            }
+            if (!pass) {
+                if (!spin_trylock(&grp->lock)) {
+                    continue;
+                }
+            } else {
+                spin_lock(&grp->lock);
+            }
+            long blk_start = bbfs_buddy_find(grp->buddy, level);
+            if (blk_start >= 0) {
+                bbfs_take_blocks(sbi, grp, grp->blk_start + blk_start, 1ul << level, false, hold);
+                spin_unlock(&grp->lock);
+                return grp->blk_start + blk_start;
+            }
+            spin_unlock(&grp->lock);
+        }
+    }
+    if ((1ul << level) > sbi->group_blocks) {
+        return bbfs_alloc_span(sbi, level, hold);
+    }
+    return LONG_MAX;
+}
+
+unsigned long bbfs_find_and_mark_free_block(struct inode *inode, int level) {
+    return bbfs_find_free_block(inode, level, false);
+}
+
+/*
+ * Like bbfs_find_and_mark_free_block, but the blocks stay free in the bitmap and nothing is logged, so they can be
+ * zeroed without a handle open. bbfs_mark_held_blocks then allocates them for real, in a handle, and
+ * bbfs_put_held_blocks hands them back.
+ */
+unsigned long bbfs_hold_free_block(struct inode *inode, int level) {
+    return bbfs_find_free_block(inode, level, true);
+}
+
+void bbfs_mark_held_blocks(struct super_block *sb, unsigned long blk_start, unsigned long nr) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    unsigned long blk_end = blk_start + nr;
+
+    while (blk_start < blk_end) {
+        struct bbfs_group *grp = &sbi->groups[blk_start / sbi->group_blocks];
+        unsigned long blk_num = min(blk_end, grp->blk_start + grp->nr_blocks) - blk_start;
+        spin_lock(&grp->lock);
+        bbfs_mark_map(sbi, blk_start, blk_num, false);
+        spin_unlock(&grp->lock);
+        blk_start += blk_num;
+    }
+}
+
+void bbfs_put_held_blocks(struct super_block *sb, unsigned long blk_start, unsigned long nr) {
+    bbfs_unbusy_blocks(BBFS_SB(sb), blk_start, nr);
+}
+
+static void bbfs_put_blocks(struct bbfs_sb_info *sbi, unsigned long blk_start, unsigned long nr, bool busy) {
+    unsigned long blk = blk_start, blk_end = blk_start + nr;
+
+    while (blk < blk_end) {
+        struct bbfs_group *grp = &sbi->groups[blk / sbi->group_blocks];
+        unsigned long blk_num = min(blk_end, grp->blk_start + grp->nr_blocks) - blk;
+        spin_lock(&grp->lock);
+        if (busy) {
+            bbfs_mark_map(sbi, blk, blk_num, true);
+        } else {
+            bbfs_mark_blocks(sbi, grp, blk, blk_num, true);
+        }
+        spin_unlock(&grp->lock);
+        blk += blk_num;
+    }
+    if (busy && !bbfs_add_discard(sbi, blk_start, nr)) {
+        bbfs_unbusy_blocks(sbi, blk_start, nr);
+    }
+}
+
+/*
+ * The blocks are freed on disk here but stay busy until the transaction freeing them commits, and with discard until
+ * the worker has been through them.
+ */
+void bbfs_free_blocks(struct super_block *sb, unsigned long blk_start, unsigned long nr) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    bbfs_put_blocks(sbi, blk_start, nr, sbi->journal || (sbi->mount_opts & BBFS_MOUNT_DISCARD));
+}
+
+void bbfs_free_block(struct super_block *sb, unsigned long blk_start, int level) {
+    bbfs_free_blocks(sb, blk_start, 1ul << level);
+}
+
+/*
+ * Take [blk_start, blk_start + nr) only if all of it is free, so that a trimmed level can grow back in place. Busy
+ * blocks count as taken.
+ */
+bool bbfs_claim_blocks(struct super_block *sb, unsigned long blk_start, unsigned long nr) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    unsigned long blk = blk_start, blk_end = blk_start + nr;
+
+    if (blk_end > sbi->nr_blocks) {
+        return false;
+    }
+    while (blk < blk_end) {
+        struct bbfs_group *grp = &sbi->groups[blk / sbi->group_blocks];
+        unsigned long blk_num = min(blk_end, grp->blk_start + grp->nr_blocks) - blk;
+        spin_lock(&grp->lock);
+        bool free = bbfs_buddy_free(grp->buddy, blk - grp->blk_start, blk - grp->blk_start + blk_num);
+        if (free) {
+            bbfs_mark_blocks(sbi, grp, blk, blk_num, false);
+        }
+        spin_unlock(&grp->lock);
+        if (!free) {
+            bbfs_put_blocks(sbi, blk_start, blk - blk_start, false);
+            return false;
+        }
+        blk += blk_num;
+    }
+    return true;
+}
+
+/* Discard the free runs of at least minlen blocks in [start, end) of one group, keeping them busy meanwhile. */
+static unsigned long bbfs_trim_group(struct super_block *sb, struct bbfs_group *grp, unsigned long start,
+                                     unsigned long end, unsigned long minlen) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    unsigned long trimmed = 0;
+
+    while (start < end && !fatal_signal_pending(current)) {
+        spin_lock(&grp->lock);
+        start = find_next_zero_bit(sbi->d_map, end, start);
+        unsigned long run_end = find_next_bit(sbi->d_map, end, start), next = run_end;
+        /*
+         * Busy blocks are free on disk but not in the buddy tree. Those freed by a transaction that has not committed
+         * may still come back after a crash, so the run stops at the first of them and resumes after the last.
+         */
+        if (start < end) {
+            unsigned long base = grp->blk_start;
+            run_end = min(run_end, base + bbfs_buddy_run_end(grp->buddy, start - base, true));
+            if (run_end < next) {
+                next = min(next, base + bbfs_buddy_run_end(grp->buddy, run_end - base, false));
+            }
+        }
+        bool trim = run_end - start >= minlen;
+        if (trim) {
+            bbfs_mark_buddy(grp, start, run_end - start, false);
+        }
+        spin_unlock(&grp->lock);
+        if (trim) {
+            blkdev_issue_discard(sb->s_bdev, bbfs_blk_sector(sbi, start),
+                                 (sector_t)(run_end - start) << (PAGE_SHIFT - SECTOR_SHIFT), GFP_NOFS);
+            spin_lock(&grp->lock);
+            bbfs_mark_buddy(grp, start, run_end - start, true);
+            spin_unlock(&grp->lock);
+            trimmed += run_end - start;
+        }
+        start = next;
+        cond_resched();
+    }
+    return trimmed;
+}
+
+/* FITRIM: range is in bytes of the device, and on return its len is what was trimmed. */
+int bbfs_trim_fs(struct super_block *sb, struct fstrim_range *range) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    uint64_t start = range->start >> PAGE_SHIFT;
+    uint64_t end = start + (range->len >> PAGE_SHIFT);
+    uint64_t minlen = DIV_ROUND_UP(max_t(uint64_t, range->minlen, bdev_discard_granularity(sb->s_bdev)), PAGE_SIZE);
+    minlen = max_t(uint64_t, minlen, 1);
+    unsigned long trimmed = 0;
+
+    if (start >= sbi->block_end || minlen > sbi->group_blocks) {
+        return -EINVAL;
+    }
+    start = max(start, sbi->block_begin) - sbi->block_begin;
+    end = min(end, sbi->block_end);
+    end = end > sbi->block_begin ? end - sbi->block_begin : 0;
+    for (unsigned long g = start / sbi->group_blocks; g < sbi->nr_groups && g * sbi->group_blocks < end; g++) {
+        struct bbfs_group *grp = &sbi->groups[g];
+        trimmed += bbfs_trim_group(sb, grp, max(start, (uint64_t)grp->blk_start),
+                                   min(end, (uint64_t)(grp->blk_start + grp->nr_blocks)), minlen);
+        if (fatal_signal_pending(current)) {
+            return -ERESTARTSYS;
+        }
+    }
+    range->len = (uint64_t)trimmed << PAGE_SHIFT;
+    return 0;
+}
+
+/*
+ * Buffered writes reserve their levels here and only allocate them at writeback. The check is against the sum of the
+ * group counters, so allocations made without a reservation can still overcommit slightly.
+ */
+int bbfs_reserve_blocks(struct super_block *sb, unsigned long nr) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    unsigned long free = 0;
+    int ret = 0;
+
+    spin_lock(&sbi->resv_lock);
+    for (unsigned long g = 0; g < sbi->nr_groups; g++) {
+        free += READ_ONCE(sbi->groups[g].free_blocks);
+    }
+    if (free < sbi->resv_blocks + nr) {
+        ret = -ENOSPC;
+    } else {
+        sbi->resv_blocks += nr;
+    }
+    spin_unlock(&sbi->resv_lock);
+    return ret;
+}
+
+void bbfs_release_blocks(struct super_block *sb, unsigned long nr) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+
+    spin_lock(&sbi->resv_lock);
+    sbi->resv_blocks -= min(nr, sbi->resv_blocks);
+    spin_unlock(&sbi->resv_lock);
+}
+
+/*
+ * Blocks freed by the running transaction only come back once it commits. Commit it so that a reservation that ran
+ * out of space can retry, and say whether that is worth doing. Called without a handle or inode locks.
+ */
+bool bbfs_commit_busy(struct super_block *sb) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+
+    if (!sbi->journal || current->journal_info) {
+        return false;
+    }
+    spin_lock(&sbi->discard_lock);
+    bool busy = !list_empty(&sbi->discard_running);
+    spin_unlock(&sbi->discard_lock);
+    if (!busy || bbfs_journal_commit(sb)) {
+        return false;
+    }
+    flush_work(&sbi->discard_work);
+    return true;
+}
+
+/* The first free inode in [ino, ino_end) outside the uninitialized regions of the inode table. */
+static unsigned long bbfs_next_free_ino(struct bbfs_sb_info *sbi, unsigned long ino, unsigned long ino_end) {
+    for (;;) {
+        ino = find_next_zero_bit(sbi->i_map, ino_end, ino);
+        if (ino >= ino_end || !bbfs_ino_uninit(sbi, ino)) {
+            return ino;
+        }
+        ino = (ino / sbi->itable_region_inodes + 1) * sbi->itable_region_inodes;
+    }
+}
+
+static unsigned long bbfs_alloc_ino(struct inode *dir, umode_t mode) {
+    struct bbfs_sb_info *sbi = BBFS_SB(dir->i_sb);
+    unsigned long start = S_ISDIR(mode) ? raw_smp_processor_id() : dir->i_ino / sbi->group_inodes;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (unsigned long n = 0; n < sbi->nr_groups; n++) {
+            struct bbfs_group *grp = &sbi->groups[(start + n) % sbi->nr_groups];
+            if (!READ_ONCE(grp->free_inodes)) {
+                continue;
+            }
+            if (!pass) {
+                if (!spin_trylock(&grp->lock)) {
+                    continue;
+                }
+            } else {
+                spin_lock(&grp->lock);
+            }
+            unsigned long ino_end = grp->ino_start + grp->nr_inodes;
+            unsigned long ino = bbfs_next_free_ino(sbi, grp->i_next, ino_end);
+            if (ino >= ino_end) {
+                ino = bbfs_next_free_ino(sbi, grp->ino_start, ino_end);
+            }
+            if (ino < ino_end) {
+                __set_bit(ino, sbi->i_map);
+                set_bit(ino / bbfs_map_entries(sbi), sbi->i_dirty);
+                bbfs_journal_log(sbi, BBFS_JOP_SET, ino, 1);
+                grp->free_inodes--;
+                grp->i_next = ino + 1;
+                spin_unlock(&grp->lock);
+                return ino;
+            }
+            spin_unlock(&grp->lock);
+        }
+    }
+    return LONG_MAX;
+}
+
+/* Inodes in uninitialized regions are only handed out once such a region has been zeroed for them. */
+unsigned long bbfs_find_and_mark_free_inode(struct inode *dir, umode_t mode) {
+    for (;;) {
+        unsigned long ino = bbfs_alloc_ino(dir, mode);
+        if (ino != LONG_MAX || bbfs_itable_init_any(dir->i_sb)) {
+            return ino;
+        }
+    }
+}
+
+void bbfs_free_ino(struct super_block *sb, unsigned long ino) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    struct bbfs_group *grp = &sbi->groups[ino / sbi->group_inodes];
+
+    spin_lock(&grp->lock);
+    __clear_bit(ino, sbi->i_map);
+    set_bit(ino / bbfs_map_entries(sbi), sbi->i_dirty);
+    bbfs_journal_log(sbi, 0, ino, 1);
+    grp->free_inodes++;
+    if (ino < grp->i_next) {
+        grp->i_next = ino;
+    }
+    spin_unlock(&grp->lock);
+}
+
+static int bbfs_load_map(struct super_block *sb, uint64_t begin, unsigned long nr_map, unsigned long nr_objs,
+                         unsigned long *map) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    unsigned long entries = bbfs_map_entries(sbi);
+
+    for (unsigned long i = 0; i < nr_map && i * entries < nr_objs; i++) {
+        struct buffer_head *bh = sb_bread(sb, begin + i);
+        if (!bh) {
+            return -EIO;
+        }
+        if (sbi->disk_sb.features & BBFS_FEAT_PACKED_BITMAP) {
+            unsigned long nbits = min(entries, nr_objs - i * entries);
+            bitmap_copy_clear_tail(map + i * entries / BITS_PER_LONG, (unsigned long *)bh->b_data, nbits);
+        } else {
+            struct bbfs_bmap_block *map_blk = (struct bbfs_bmap_block *)bh->b_data;
+            for (unsigned long j = 0; j < entries && i * entries + j < nr_objs; j++) {
+                if (map_blk->blocks[j]) {
+                    __set_bit(i * entries + j, map);
+                }
+            }
+        }
+        brelse(bh);
+    }
+    return 0;
+}
+
+/*
+ * A map block can cover several groups, so each group copies only its own range into the buffer under its own
+ * lock. Group boundaries are multiples of BITS_PER_LONG, which keeps the packed copy word-aligned.
+ */
+static int bbfs_sync_map_block(struct super_block *sb, uint64_t begin, unsigned long i, unsigned long nr_objs,
+                               unsigned long *map, unsigned long *dirty, unsigned long group_objs, int wait) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    unsigned long entries = bbfs_map_entries(sbi);
+
+    struct buffer_head *bh = sb_bread(sb, begin + i);
+    if (!bh) {
+        return -EIO;
+    }
+    unsigned long first = i * entries;
+    unsigned long last = min((i + 1) * entries, nr_objs);
+    clear_bit(i, dirty);
+    lock_buffer(bh);
+    for (unsigned long g = first / group_objs; g < sbi->nr_groups && g * group_objs < last; g++) {
+        unsigned long start = max(first, g * group_objs);
+        unsigned long end = min(last, (g + 1) * group_objs);
+        spin_lock(&sbi->groups[g].lock);
+        if (sbi->disk_sb.features & BBFS_FEAT_PACKED_BITMAP) {
+            memcpy(bh->b_data + (start - first) / BITS_PER_BYTE, map + start / BITS_PER_LONG,
+                   BITS_TO_LONGS(end - start) * sizeof(unsigned long));
+        } else {
+            struct bbfs_bmap_block *map_blk = (struct bbfs_bmap_block *)bh->b_data;
+            for (unsigned long j = start; j < end; j++) {
+                map_blk->blocks[j - first] = test_bit(j, map);
+            }
+        }
+        spin_unlock(&sbi->groups[g].lock);
+    }
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    int ret = 0;
+    if (wait) {
+        ret = sync_dirty_buffer(bh);
+    }
+    brelse(bh);
+    return ret;
+}
+
+static int bbfs_sync_map(struct super_block *sb, uint64_t begin, unsigned long nr_map, unsigned long nr_objs,
+                         unsigned long *map, unsigned long *dirty, unsigned long group_objs, int wait) {
+    unsigned long i;
+
+    for_each_set_bit(i, dirty, nr_map) {
+        int ret = bbfs_sync_map_block(sb, begin, i, nr_objs, map, dirty, group_objs, wait);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* Synchronously write whichever dirty map blocks cover objects [start, start + nr) of the block or inode map. */
+int bbfs_sync_bitmap_range(struct super_block *sb, bool blocks, unsigned long start, unsigned long nr) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    unsigned long entries = bbfs_map_entries(sbi);
+    unsigned long *dirty = blocks ? sbi->d_dirty : sbi->i_dirty;
+
+    for (unsigned long i = start / entries; i <= (start + nr - 1) / entries; i++) {
+        if (!test_bit(i, dirty)) {
+            continue;
+        }
+        int ret = blocks ? bbfs_sync_map_block(sb, sbi->bmap_begin, i, sbi->nr_blocks, sbi->d_map, dirty,
+                                               sbi->group_blocks, 1)
+                         : bbfs_sync_map_block(sb, sbi->imap_begin, i, sbi->nr_inodes, sbi->i_map, dirty,
+                                               sbi->group_inodes, 1);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* Redo one journaled bitmap update. Runs at mount, before the groups are set up from the maps. */
+int bbfs_replay_map(struct super_block *sb, const struct bbfs_journal_op *op) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    bool blocks = op->type & BBFS_JOP_BLOCKS;
+    unsigned long *map = blocks ? sbi->d_map : sbi->i_map;
+    unsigned long *dirty = blocks ? sbi->d_dirty : sbi->i_dirty;
+    uint64_t nr_objs = blocks ? sbi->nr_blocks : sbi->nr_inodes;
+    unsigned long entries = bbfs_map_entries(sbi);
+
+    if (!op->count || op->start >= nr_objs || op->count > nr_objs - op->start) {
+        return -EIO;
+    }
+    if (op->type & BBFS_JOP_SET) {
+        bitmap_set(map, op->start, op->count);
+    } else {
+        bitmap_clear(map, op->start, op->count);
+    }
+    for (unsigned long i = op->start / entries; i <= (op->start + op->count - 1) / entries; i++) {
+        set_bit(i, dirty);
+    }
+    return 0;
+}
+
+static int bbfs_init_group(struct bbfs_sb_info *sbi, unsigned long g) {
+    struct bbfs_group *grp = &sbi->groups[g];
+
+    spin_lock_init(&grp->lock);
+    grp->ino_start = grp->i_next = g * sbi->group_inodes;
+    grp->nr_inodes = sbi->group_inodes;
+    grp->free_inodes = grp->nr_inodes - bitmap_weight(sbi->i_map + grp->ino_start / BITS_PER_LONG, grp->nr_inodes);
+    grp->blk_start = g * sbi->group_blocks;
+    grp->nr_blocks = min(sbi->group_blocks, sbi->nr_blocks - grp->blk_start);
+    grp->free_blocks = grp->nr_blocks - bitmap_weight(sbi->d_map + grp->blk_start / BITS_PER_LONG, grp->nr_blocks);
+    unsigned int order = bbfs_buddy_order(order_base_2(grp->nr_blocks));
+    grp->buddy = kvzalloc(bbfs_buddy_size(order), GFP_KERNEL);
+    if (!grp->buddy) {
+        return -ENOMEM;
+    }
+    bbfs_buddy_init(grp->buddy, order);
+
+    unsigned long end = grp->blk_start + grp->nr_blocks;
+    for (unsigned long blk = find_next_zero_bit(sbi->d_map, end, grp->blk_start); blk < end;) {
+        unsigned long run_end = find_next_bit(sbi->d_map, end, blk);
+        bbfs_buddy_set(grp->buddy, blk - grp->blk_start, run_end - grp->blk_start, true);
+        blk = find_next_zero_bit(sbi->d_map, end, run_end);
+    }
+    bbfs_buddy_build(grp->buddy);
+    return 0;
+}
+
+int bbfs_load_bitmaps(struct super_block *sb) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    unsigned long nr_inodes = sbi->nr_inodes;
+    unsigned long nr_blocks = sbi->nr_blocks;
+
+    if (sbi->disk_sb.nr_groups) {
+        sbi->nr_groups = sbi->disk_sb.nr_groups;
+        sbi->group_inodes = sbi->disk_sb.group_inodes;
+        sbi->group_blocks = sbi->disk_sb.group_blocks;
+        if (sbi->nr_groups > 1 && (sbi->group_inodes % BITS_PER_LONG || sbi->group_blocks % BITS_PER_LONG)) {
+            return -EINVAL;
+        }
+    } else {
+        sbi->nr_groups = 1;
+        sbi->group_inodes = nr_inodes;
+        sbi->group_blocks = nr_blocks;
+    }
+    if (!sbi->group_inodes || !sbi->group_blocks || sbi->nr_groups * sbi->group_inodes > nr_inodes ||
+        (sbi->nr_groups - 1) * sbi->group_blocks >= nr_blocks || sbi->nr_groups * sbi->group_blocks < nr_blocks) {
+        return -EINVAL;
+    }
+
+    spin_lock_init(&sbi->resv_lock);
+    sbi->resv_blocks = 0;
+    sbi->i_map = kvcalloc(BITS_TO_LONGS(nr_inodes), sizeof(unsigned long), GFP_KERNEL);
+    sbi->i_dirty = kvcalloc(BITS_TO_LONGS(sbi->disk_sb.nr_imap), sizeof(unsigned long), GFP_KERNEL);
+    sbi->d_map = kvcalloc(BITS_TO_LONGS(nr_blocks), sizeof(unsigned long), GFP_KERNEL);
+    sbi->d_dirty = kvcalloc(BITS_TO_LONGS(sbi->disk_sb.nr_bmap), sizeof(unsigned long), GFP_KERNEL);
+    sbi->groups = kvcalloc(sbi->nr_groups, sizeof(struct bbfs_group), GFP_KERNEL);
+    if (!sbi->i_map || !sbi->i_dirty || !sbi->d_map || !sbi->d_dirty || !sbi->groups) {
+        bbfs_destroy_bitmaps(sbi);
+        return -ENOMEM;
+    }
+
+    int ret = bbfs_load_map(sb, sbi->imap_begin, sbi->disk_sb.nr_imap, nr_inodes, sbi->i_map);
+    if (!ret) {
+        ret = bbfs_load_map(sb, sbi->bmap_begin, sbi->disk_sb.nr_bmap, nr_blocks, sbi->d_map);
+    }
+    if (!ret) {
+        ret = bbfs_journal_replay_maps(sb);
+    }
+    for (unsigned long g = 0; !ret && g < sbi->nr_groups; g++) {
+        ret = bbfs_init_group(sbi, g);
+    }
+    if (ret) {
+        bbfs_destroy_bitmaps(sbi);
+        return ret;
+    }
+    return 0;
+}
+
+int bbfs_sync_bitmaps(struct super_block *sb, int wait) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    int ret = bbfs_sync_map(sb, sbi->imap_begin, sbi->disk_sb.nr_imap, sbi->nr_inodes, sbi->i_map,
+                            sbi->i_dirty, sbi->group_inodes, wait);
+    if (ret) {
+        return ret;
+    }
+    return bbfs_sync_map(sb, sbi->bmap_begin, sbi->disk_sb.nr_bmap, sbi->nr_blocks, sbi->d_map,
+                         sbi->d_dirty, sbi->group_blocks, wait);
+}
+
+void bbfs_destroy_bitmaps(struct bbfs_sb_info *sbi) {
+    for (unsigned long g = 0; sbi->groups && g < sbi->nr_groups; g++) {
+        kvfree(sbi->groups[g].buddy);
+    }
+    kvfree(sbi->groups);
+    kvfree(sbi->i_map);
+    kvfree(sbi->i_dirty);
+    kvfree(sbi->d_map);
+    kvfree(sbi->d_dirty);
+    sbi->groups = NULL;
+    sbi->i_map = sbi->i_dirty = sbi->d_map = sbi->d_dirty = NULL;
+}
@@ -0,0 +1,407 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Runs a fixed set of workloads in a directory on a mounted bbfs and prints one JSON object with the latency
+ * percentiles and throughput of each. Offsets, sizes and names come from a fixed seed, so two runs on the same image
+ * geometry do the same operations in the same order.
+ */
+
+#define MAX_COUNTS 8
+#define SEED 0x62626673u
+#define DATA_OPS 4096
+#define APPEND_OPS 1000
+#define CHURN_FILES 1000
+#define CHURN_OPS 20000
+#define CHURN_MAX (16 << 10)
+
+static struct {
+    const char *dir;
+    unsigned long counts[MAX_COUNTS];
+    int nr_counts;
+    uint64_t file_size;
+    int direct;
+    FILE *out;
+    int nr_results;
+    uint64_t *lat;
+    uint64_t rng;
+    char *buf;
+} bench = {.counts = {1000, 100000, 1000000}, .nr_counts = 3, .file_size = 1ull << 30};
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d] [-e counts] [-s size] [-o file] dir\n", prog);
+    fprintf(stderr, "  -d: use O_DIRECT for the read and write workloads\n");
+    fprintf(stderr, "  -e: comma separated entry counts per directory (default 1000,100000,1000000)\n");
+    fprintf(stderr, "  -s: size in MiB of the file for the read and write workloads (default 1024)\n");
+    fprintf(stderr, "  -o: write the results to file instead of stdout\n");
+}
+
+static void die(const char *what) {
+    fprintf(stderr, "%s: %s\n", what, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* xorshift64, so the sequence does not depend on the libc. */
+static uint64_t next_rand(void) {
+    bench.rng ^= bench.rng << 13;
+    bench.rng ^= bench.rng >> 7;
+    bench.rng ^= bench.rng << 17;
+    return bench.rng;
+}
+
+/* Flush and forget cached dentries and inodes, so that lookups reach bbfs_lookup. Needs root; skipped otherwise. */
+static int drop_caches(void) {
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+
+    sync();
+    if (fd == -1) {
+        return 0;
+    }
+    int ok = write(fd, "3", 1) == 1;
+    close(fd);
+    return ok;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(uint64_t *lat, unsigned long nr, double p) {
+    unsigned long i = (unsigned long)(p / 100 * nr);
+    return lat[i < nr ? i : nr - 1];
+}
+
+/*
+ * One result object, with percentiles over the nr latencies in bench.lat. elapsed covers the whole workload, including
+ * any final fsync, and the throughput is ops and bytes over it.
+ */
+static void report(const char *name, unsigned long nr, unsigned long ops, uint64_t bytes, uint64_t elapsed, int cold) {
+    uint64_t sum = 0;
+
+    qsort(bench.lat, nr, sizeof(*bench.lat), cmp_u64);
+    for (unsigned long i = 0; i < nr; i++) {
+        sum += bench.lat[i];
+    }
+    double secs = elapsed / 1e9;
+    fprintf(bench.out,
+            "%s\n    {\"name\": \"%s\", \"ops\": %lu, \"samples\": %lu, \"bytes\": %llu, \"seconds\": %.6f, "
+            "\"cold_cache\": %s, \"ops_per_sec\": %.1f, \"mib_per_sec\": %.2f,\n     \"latency_ns\": {\"mean\": %llu, "
+            "\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p99_9\": %llu, \"max\": %llu}}",
+            bench.nr_results++ ? "," : "", name, ops, nr, (unsigned long long)bytes, secs,
+            cold ? "true" : "false", ops / secs, bytes / secs / (1 << 20), (unsigned long long)(nr ? sum / nr : 0),
+            (unsigned long long)percentile(bench.lat, nr, 50), (unsigned long long)percentile(bench.lat, nr, 90),
+            (unsigned long long)percentile(bench.lat, nr, 99), (unsigned long long)percentile(bench.lat, nr, 99.9),
+            (unsigned long long)bench.lat[nr - 1]);
+    fflush(bench.out);
+}
+
+static void entry_name(char *name, size_t size, const char *dir, unsigned long i) {
+    snprintf(name, size, "%s/f%08lu", dir, i);
+}
+
+/* Each getdents64 call is timed, and the ops are the entries it returned, "." and ".." included. */
+static void run_readdir(const char *dir, unsigned long count, char *label, int cold) {
+    static char dents[1 << 16];
+    unsigned long calls = 0, entries = 0;
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        die(dir);
+    }
+    uint64_t start = now_ns();
+    for (;;) {
+        uint64_t t = now_ns();
+        long n = syscall(SYS_getdents64, fd, dents, sizeof(dents));
+        if (n < 0) {
+            die("getdents64");
+        }
+        bench.lat[calls++] = now_ns() - t;
+        if (!n) {
+            break;
+        }
+        for (long off = 0; off < n; off += ((struct dirent64 *)(dents + off))->d_reclen) {
+            entries++;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    close(fd);
+    if (entries != count + 2) {
+        fprintf(stderr, "%s: %lu entries instead of %lu\n", dir, entries, count + 2);
+        exit(EXIT_FAILURE);
+    }
+    report(label, calls, entries, 0, elapsed, cold);
+}
+
+static void run_metadata(unsigned long count) {
+    char dir[PATH_MAX], name[PATH_MAX + 32], label[64];
+    struct stat st;
+
+    snprintf(dir, sizeof(dir), "%s/meta-%lu", bench.dir, count);
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        die(dir);
+    }
+
+    uint64_t start = now_ns();
+    for (unsigned long i = 0; i < count; i++) {
+        entry_name(name, sizeof(name), dir, i);
+        uint64_t t = now_ns();
+        int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd == -1) {
+            die(name);
+        }
+        close(fd);
+        bench.lat[i] = now_ns() - t;
+    }
+    snprintf(label, sizeof(label), "create-%lu", count);
+    report(label, count, count, 0, now_ns() - start, 0);
+
+    int cold = drop_caches();
+    start = now_ns();
+    for (unsigned long i = 0; i < count; i++) {
+        entry_name(name, sizeof(name), dir, next_rand() % count);
+        uint64_t t = now_ns();
+        if (stat(name, &st)) {
+            die(name);
+        }
+        bench.lat[i] = now_ns() - t;
+    }
+    snprintf(label, sizeof(label), "stat-%lu", count);
+    report(label, count, count, 0, now_ns() - start, cold);
+
+    cold = drop_caches();
+    snprintf(label, sizeof(label), "readdir-%lu", count);
+    run_readdir(dir, count, label, cold);
+
+    cold = drop_caches();
+    start = now_ns();
+    for (unsigned long i = 0; i < count; i++) {
+        entry_name(name, sizeof(name), dir, i);
+        uint64_t t = now_ns();
+        if (unlink(name)) {
+            die(name);
+        }
+        bench.lat[i] = now_ns() - t;
+    }
+    snprintf(label, sizeof(label), "unlink-%lu", count);
+    report(label, count, count, 0, now_ns() - start, cold);
+
+    if (rmdir(dir)) {
+        die(dir);
+    }
+}
+
+/* The whole file in order, or DATA_OPS requests at random aligned offsets, of io_size each. Writes end with fsync. */
+static void run_data(int fd, int write, int random, size_t io_size) {
+    char label[64];
+    unsigned long slots = bench.file_size / io_size;
+    unsigned long nr = random ? DATA_OPS : slots;
+    int cold = 0;
+
+    if (!write) {
+        cold = !fdatasync(fd) && !posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    uint64_t start = now_ns();
+    for (unsigned long i = 0; i < nr; i++) {
+        off_t off = (off_t)(random ? next_rand() % slots : i) * io_size;
+        uint64_t t = now_ns();
+        ssize_t n = write ? pwrite(fd, bench.buf, io_size, off) : pread(fd, bench.buf, io_size, off);
+        if (n != (ssize_t)io_size) {
+            die(write ? "pwrite" : "pread");
+        }
+        bench.lat[i] = now_ns() - t;
+    }
+    if (write && fsync(fd)) {
+        die("fsync");
+    }
+    snprintf(label, sizeof(label), "%s-%s-%s", random ? "rand" : "seq", write ? "write" : "read",
+             io_size >= 1 << 20 ? "1m" : "4k");
+    report(label, nr, nr, (uint64_t)nr * io_size, now_ns() - start, cold);
+}
+
+static void run_file_io(void) {
+    static const size_t sizes[] = {4096, 1 << 20};
+    char name[PATH_MAX + 32];
+
+    snprintf(name, sizeof(name), "%s/data", bench.dir);
+    int fd = open(name, O_RDWR | O_CREAT | O_TRUNC | (bench.direct ? O_DIRECT : 0), 0644);
+    if (fd == -1) {
+        die(name);
+    }
+    /* The sequential writes lay the file out first, so every later request hits allocated blocks. */
+    for (int s = 0; s < 2; s++) {
+        run_data(fd, 1, 0, sizes[s]);
+        run_data(fd, 0, 0, sizes[s]);
+        run_data(fd, 1, 1, sizes[s]);
+        run_data(fd, 0, 1, sizes[s]);
+    }
+    close(fd);
+    if (unlink(name)) {
+        die(name);
+    }
+}
+
+static void run_append_fsync(void) {
+    char name[PATH_MAX + 32];
+
+    snprintf(name, sizeof(name), "%s/log", bench.dir);
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd == -1) {
+        die(name);
+    }
+    uint64_t start = now_ns();
+    for (unsigned long i = 0; i < APPEND_OPS; i++) {
+        uint64_t t = now_ns();
+        if (write(fd, bench.buf, 4096) != 4096 || fsync(fd)) {
+            die(name);
+        }
+        bench.lat[i] = now_ns() - t;
+    }
+    report("append-fsync", APPEND_OPS, APPEND_OPS, APPEND_OPS * 4096ull, now_ns() - start, 0);
+    close(fd);
+    if (unlink(name)) {
+        die(name);
+    }
+}
+
+/* Replace random files of a working set with new ones of random size up to CHURN_MAX, like a mail spool or cache. */
+static void run_churn(void) {
+    char dir[PATH_MAX], name[PATH_MAX + 32];
+    uint64_t bytes = 0;
+
+    snprintf(dir, sizeof(dir), "%s/churn", bench.dir);
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        die(dir);
+    }
+    uint8_t *present = calloc(CHURN_FILES, 1);
+    if (!present) {
+        die("calloc");
+    }
+    uint64_t start = now_ns();
+    for (unsigned long i = 0; i < CHURN_OPS; i++) {
+        unsigned long slot = next_rand() % CHURN_FILES;
+        size_t size = 1 + next_rand() % CHURN_MAX;
+        entry_name(name, sizeof(name), dir, slot);
+        uint64_t t = now_ns();
+        if (present[slot] && unlink(name)) {
+            die(name);
+        }
+        int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd == -1 || write(fd, bench.buf, size) != (ssize_t)size) {
+            die(name);
+        }
+        close(fd);
+        bench.lat[i] = now_ns() - t;
+        present[slot] = 1;
+        bytes += size;
+    }
+    sync();
+    report("small-file-churn", CHURN_OPS, CHURN_OPS, bytes, now_ns() - start, 0);
+
+    for (unsigned long slot = 0; slot < CHURN_FILES; slot++) {
+        entry_name(name, sizeof(name), dir, slot);
+        if (present[slot] && unlink(name)) {
+            die(name);
+        }
+    }
+    free(present);
+    if (rmdir(dir)) {
+        die(dir);
+    }
+}
+
+static int parse_counts(char *list) {
+    bench.nr_counts = 0;
+    for (char *s = strtok(list, ","); s; s = strtok(NULL, ",")) {
+        if (bench.nr_counts == MAX_COUNTS) {
+            return -1;
+        }
+        char *end;
+        bench.counts[bench.nr_counts] = strtoul(s, &end, 0);
+        if (*end || !bench.counts[bench.nr_counts++]) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct utsname uts;
+    int opt;
+
+    bench.out = stdout;
+    while ((opt = getopt(argc, argv, "de:s:o:")) != -1) {
+        switch (opt) {
+        case 'd':
+            bench.direct = 1;
+            break;
+        case 'e':
+            if (parse_counts(optarg)) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            bench.file_size = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'o':
+            bench.out = fopen(optarg, "w");
+            if (!bench.out) {
+                die(optarg);
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 1 || bench.file_size < 1 << 20) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    bench.dir = argv[optind];
+
+    unsigned long max_ops = CHURN_OPS;
+    for (int i = 0; i < bench.nr_counts; i++) {
+        max_ops = bench.counts[i] + 2 > max_ops ? bench.counts[i] + 2 : max_ops;
+    }
+    max_ops = bench.file_size / 4096 > max_ops ? bench.file_size / 4096 : max_ops;
+    bench.lat = malloc(max_ops * sizeof(*bench.lat));
+    bench.buf = aligned_alloc(4096, 1 << 20);
+    if (!bench.lat || !bench.buf) {
+        die("malloc");
+    }
+    bench.rng = SEED;
+    for (int i = 0; i < 1 << 20; i++) {
+        bench.buf[i] = next_rand();
+    }
+
+    uname(&uts);
+    fprintf(bench.out, "{\"kernel\": \"%s\", \"seed\": %u, \"file_size\": %llu, \"direct\": %s, \"results\": [",
+            uts.release, SEED, (unsigned long long)bench.file_size, bench.direct ? "true" : "false");
+    for (int i = 0; i < bench.nr_counts; i++) {
+        run_metadata(bench.counts[i]);
+    }
+    run_file_io();
+    run_append_fsync();
+    run_churn();
+    fprintf(bench.out, "\n]}\n");
+    return fclose(bench.out) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
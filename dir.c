@@ -5,15 +5,634 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/log2.h>
 #include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 
 #include "fs.h"
+#include "disk.h"
 
+#define BBFS_DIR_RA 16
+
+struct bbfs_dx_path {
+    int depth;
+    struct buffer_head *bh[BBFS_DX_MAX_DEPTH + 1];
+    int pos[BBFS_DX_MAX_DEPTH + 1];
+};
+
+static unsigned long bbfs_dir_nblocks(struct inode *dir) { return (1ul << BBFS_INODE(dir)->l_num) - 1; }
+
+static struct buffer_head *bbfs_dir_bread(struct inode *dir, unsigned long n) {
+    struct bbfs_sb_info *sbi = BBFS_SB(dir->i_sb);
+    struct bbfs_inode_info *ci = BBFS_INODE(dir);
+    int level = ilog2(n + 1);
+    return sb_bread(dir->i_sb, sbi->block_begin + ci->levels[level] + n + 1 - (1ul << level));
+}
+
+static bool bbfs_dx_block(struct buffer_head *bh) {
+    return ((struct bbfs_dx_node *)bh->b_data)->magic == BBFS_DX_MAGIC;
+}
+
+static bool bbfs_dir_packed(struct inode *dir) {
+    struct bbfs_sb_info *sbi = BBFS_SB(dir->i_sb);
+    return sbi->disk_sb.features & BBFS_FEAT_PACKED_DIRENT;
+}
+
+static int bbfs_dir_grow(struct inode *dir) {
+    struct super_block *sb = dir->i_sb;
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    int level = BBFS_INODE(dir)->l_num;
+
+    unsigned long blk_start = bbfs_find_and_mark_free_block(dir, level);
+    if (blk_start == LONG_MAX) {
+        return -ENOSPC;
+    }
+    for (unsigned long j = blk_start; j < blk_start + (1ul << level); j++) {
+        struct buffer_head *bh = sb_getblk(sb, sbi->block_begin + j);
+        if (!bh) {
+            bbfs_free_block(sb, blk_start, level);
+            return -EIO;
+        }
+        lock_buffer(bh);
+        bbfs_dir_init_block(bbfs_dir_packed(dir), bh->b_data);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty_inode(bh, dir);
+        brelse(bh);
+    }
+    /*
+     * A new level can be far larger than a transaction, so with a journal its blocks are written in place before the
+     * level is logged, and they are clean by the time the running transaction starts modifying them.
+     */
+    int ret = sbi->journal ? sync_mapping_buffers(dir->i_mapping) : 0;
+    if (ret) {
+        bbfs_free_block(sb, blk_start, level);
+        return ret;
+    }
+    ret = bbfs_add_level(dir, level, blk_start);
+    if (ret) {
+        bbfs_free_block(sb, blk_start, level);
+    }
+    return ret;
+}
+
+static void bbfs_dx_release(struct bbfs_dx_path *path) {
+    for (int i = 0; i <= path->depth; i++) {
+        brelse(path->bh[i]);
+    }
+}
+
+static int bbfs_dx_descend(struct inode *dir, uint32_t hash, struct bbfs_dx_path *path) {
+    path->depth = 0;
+    path->bh[0] = bbfs_dir_bread(dir, 0);
+    if (!path->bh[0]) {
+        return -EIO;
+    }
+    struct bbfs_dx_node *root = (struct bbfs_dx_node *)path->bh[0]->b_data;
+    path->pos[0] = bbfs_dx_search(root, hash);
+    if (root->depth) {
+        path->bh[1] = bbfs_dir_bread(dir, root->entries[path->pos[0]].block);
+        if (!path->bh[1]) {
+            brelse(path->bh[0]);
+            return -EIO;
+        }
+        path->depth = 1;
+        path->pos[1] = bbfs_dx_search((struct bbfs_dx_node *)path->bh[1]->b_data, hash);
+    }
+    return 0;
+}
+
+/* Move path to the next leaf in hash order. Returns 1 if there is one, 0 past the last, or -EIO. */
+static int bbfs_dx_next(struct inode *dir, struct bbfs_dx_path *path) {
+    struct bbfs_dx_node *root = (struct bbfs_dx_node *)path->bh[0]->b_data;
+    struct bbfs_dx_node *node = (struct bbfs_dx_node *)path->bh[path->depth]->b_data;
+
+    if (path->pos[path->depth] + 1 < node->count) {
+        path->pos[path->depth]++;
+        return 1;
+    }
+    if (!path->depth || path->pos[0] + 1 >= root->count) {
+        return 0;
+    }
+    brelse(path->bh[1]);
+    path->bh[1] = bbfs_dir_bread(dir, root->entries[++path->pos[0]].block);
+    if (!path->bh[1]) {
+        path->depth = 0;
+        return -EIO;
+    }
+    path->pos[1] = 0;
+    return 1;
+}
+
+static struct bbfs_dx_entry *bbfs_dx_leaf(struct bbfs_dx_path *path) {
+    return &((struct bbfs_dx_node *)path->bh[path->depth]->b_data)->entries[path->pos[path->depth]];
+}
+
+static bool bbfs_dir_indexed(struct inode *dir) {
+    struct bbfs_sb_info *sbi = BBFS_SB(dir->i_sb);
+    if (!(sbi->disk_sb.features & BBFS_FEAT_DIR_INDEX) || !BBFS_INODE(dir)->l_num) {
+        return false;
+    }
+    struct buffer_head *bh = bbfs_dir_bread(dir, 0);
+    if (!bh) {
+        return false;
+    }
+    bool indexed = bbfs_dx_block(bh);
+    brelse(bh);
+    return indexed;
+}
+
+static int bbfs_dir_find(struct inode *dir, const struct qstr *name, struct buffer_head **bhp,
+                         struct bbfs_dir_rec *rec) {
+    bool packed = bbfs_dir_packed(dir);
+
+    if (!bbfs_dir_indexed(dir)) {
+        for (unsigned long n = 0; n < bbfs_dir_nblocks(dir); n++) {
+            struct buffer_head *bh = bbfs_dir_bread(dir, n);
+            if (!bh) {
+                return -EIO;
+            }
+            if (bbfs_search_block(packed, bh->b_data, name->name, name->len, rec)) {
+                *bhp = bh;
+                return 0;
+            }
+            brelse(bh);
+        }
+        return -ENOENT;
+    }
+
+    uint32_t hash = bbfs_name_hash(name->name, name->len);
+    struct bbfs_dx_path path;
+    int ret = bbfs_dx_descend(dir, hash, &path);
+    if (ret) {
+        return ret;
+    }
+    for (;;) {
+        struct buffer_head *bh = bbfs_dir_bread(dir, bbfs_dx_leaf(&path)->block);
+        if (!bh) {
+            ret = -EIO;
+            break;
+        }
+        if (bbfs_search_block(packed, bh->b_data, name->name, name->len, rec)) {
+            *bhp = bh;
+            ret = 0;
+            break;
+        }
+        brelse(bh);
+
+        ret = bbfs_dx_next(dir, &path);
+        if (ret <= 0 || bbfs_dx_leaf(&path)->hash != hash) {
+            ret = ret < 0 ? ret : -ENOENT;
+            break;
+        }
+    }
+    bbfs_dx_release(&path);
+    return ret;
+}
+
+int bbfs_find_entry(struct inode *dir, const struct qstr *name, unsigned long *ino) {
+    struct buffer_head *bh;
+    struct bbfs_dir_rec rec;
+    int ret = bbfs_dir_find(dir, name, &bh, &rec);
+    if (!ret) {
+        *ino = rec.ino;
+        brelse(bh);
+    }
+    return ret;
+}
+
+static unsigned long bbfs_dx_new_block(struct inode *dir, struct buffer_head *root_bh) {
+    struct bbfs_dx_node *root = (struct bbfs_dx_node *)root_bh->b_data;
+    if (root->next_block >= bbfs_dir_nblocks(dir) && bbfs_dir_grow(dir)) {
+        return 0;
+    }
+    bbfs_journal_dirty(dir->i_sb, root_bh, dir);
+    return root->next_block++;
+}
+
+static void bbfs_dx_insert(struct inode *dir, struct buffer_head *bh, int pos, uint32_t hash, uint32_t block) {
+    struct bbfs_dx_node *node = (struct bbfs_dx_node *)bh->b_data;
+    memmove(&node->entries[pos + 1], &node->entries[pos], (node->count - pos) * sizeof(struct bbfs_dx_entry));
+    node->entries[pos].hash = hash;
+    node->entries[pos].block = block;
+    node->count++;
+    bbfs_journal_dirty(dir->i_sb, bh, dir);
+}
+
+static int bbfs_dx_split_leaf(struct inode *dir, struct bbfs_dx_path *path, struct buffer_head *leaf_bh) {
+    bool packed = bbfs_dir_packed(dir);
+    char *buf = kmalloc(PAGE_SIZE, GFP_NOFS);
+    struct bbfs_dx_hash *map = kmalloc_array(PAGE_SIZE / BBFS_DIRENT_LEN(1), sizeof(*map), GFP_NOFS);
+    struct bbfs_dir_rec rec;
+    int count = 0, ret = -ENOMEM;
+
+    if (!buf || !map) {
+        goto out;
+    }
+    memcpy(buf, leaf_bh->b_data, PAGE_SIZE);
+    for (int off = 0; bbfs_dir_rec(packed, buf, off, &rec); off = rec.next) {
+        if (rec.len) {
+            map[count].hash = bbfs_name_hash(rec.name, rec.len);
+            map[count++].off = off;
+        }
+    }
+    if (count < 2) {
+        ret = -EIO;
+        goto out;
+    }
+    sort(map, count, sizeof(map[0]), bbfs_dx_cmp, NULL);
+
+    int split = bbfs_dx_split_point(map, count);
+
+    unsigned long n = bbfs_dx_new_block(dir, path->bh[0]);
+    if (!n) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    struct buffer_head *new_bh = bbfs_dir_bread(dir, n);
+    if (!new_bh) {
+        ret = -EIO;
+        goto out;
+    }
+    bbfs_dir_init_block(packed, leaf_bh->b_data);
+    bbfs_dir_init_block(packed, new_bh->b_data);
+    for (int i = 0; i < count; i++) {
+        bbfs_dir_rec(packed, buf, map[i].off, &rec);
+        bbfs_insert_block(packed, i < split ? leaf_bh->b_data : new_bh->b_data, rec.name, rec.len, rec.ino, rec.type);
+    }
+    bbfs_journal_dirty(dir->i_sb, new_bh, dir);
+    bbfs_journal_dirty(dir->i_sb, leaf_bh, dir);
+    brelse(new_bh);
+    bbfs_dx_insert(dir, path->bh[path->depth], path->pos[path->depth] + 1, map[split].hash, n);
+    ret = 0;
+out:
+    kfree(map);
+    kfree(buf);
+    return ret;
+}
+
+static int bbfs_dx_split_node(struct inode *dir, struct bbfs_dx_path *path) {
+    struct bbfs_dx_node *node = (struct bbfs_dx_node *)path->bh[1]->b_data;
+    int split = node->count / 2;
+    while (split > 1 && node->entries[split].hash == node->entries[split - 1].hash) {
+        split--;
+    }
+
+    unsigned long n = bbfs_dx_new_block(dir, path->bh[0]);
+    if (!n) {
+        return -ENOSPC;
+    }
+    struct buffer_head *new_bh = bbfs_dir_bread(dir, n);
+    if (!new_bh) {
+        return -EIO;
+    }
+    struct bbfs_dx_node *new_node = (struct bbfs_dx_node *)new_bh->b_data;
+    new_node->magic = BBFS_DX_MAGIC;
+    new_node->count = node->count - split;
+    memcpy(new_node->entries, &node->entries[split], new_node->count * sizeof(struct bbfs_dx_entry));
+    node->count = split;
+    bbfs_journal_dirty(dir->i_sb, new_bh, dir);
+    bbfs_journal_dirty(dir->i_sb, path->bh[1], dir);
+    brelse(new_bh);
+    bbfs_dx_insert(dir, path->bh[0], path->pos[0] + 1, new_node->entries[0].hash, n);
+    return 0;
+}
+
+static int bbfs_dx_deepen(struct inode *dir, struct bbfs_dx_path *path) {
+    struct bbfs_dx_node *root = (struct bbfs_dx_node *)path->bh[0]->b_data;
+    unsigned long n = bbfs_dx_new_block(dir, path->bh[0]);
+    if (!n) {
+        return -ENOSPC;
+    }
+    struct buffer_head *new_bh = bbfs_dir_bread(dir, n);
+    if (!new_bh) {
+        return -EIO;
+    }
+    struct bbfs_dx_node *node = (struct bbfs_dx_node *)new_bh->b_data;
+    node->magic = BBFS_DX_MAGIC;
+    node->count = root->count;
+    memcpy(node->entries, root->entries, root->count * sizeof(struct bbfs_dx_entry));
+    bbfs_journal_dirty(dir->i_sb, new_bh, dir);
+    brelse(new_bh);
+    root->depth = 1;
+    root->count = 1;
+    root->entries[0].hash = 0;
+    root->entries[0].block = n;
+    bbfs_journal_dirty(dir->i_sb, path->bh[0], dir);
+    return 0;
+}
+
+static int bbfs_dx_add_entry(struct inode *dir, const struct qstr *name, struct inode *inode) {
+    uint32_t hash = bbfs_name_hash(name->name, name->len);
+
+    for (;;) {
+        struct bbfs_dx_path path;
+        int ret = bbfs_dx_descend(dir, hash, &path);
+        if (ret) {
+            return ret;
+        }
+        struct bbfs_dx_node *root = (struct bbfs_dx_node *)path.bh[0]->b_data;
+        struct bbfs_dx_node *node = (struct bbfs_dx_node *)path.bh[path.depth]->b_data;
+        struct buffer_head *leaf_bh = bbfs_dir_bread(dir, node->entries[path.pos[path.depth]].block);
+        if (!leaf_bh) {
+            bbfs_dx_release(&path);
+            return -EIO;
+        }
+        if (bbfs_insert_block(bbfs_dir_packed(dir), leaf_bh->b_data, name->name, name->len, inode->i_ino,
+                              fs_umode_to_dtype(inode->i_mode))) {
+            bbfs_journal_dirty(dir->i_sb, leaf_bh, dir);
+            BBFS_INODE(inode)->i_dirent = leaf_bh->b_blocknr;
+            brelse(leaf_bh);
+            bbfs_dx_release(&path);
+            return 0;
+        }
+
+        if (node->count < DX_LIMIT) {
+            ret = bbfs_dx_split_leaf(dir, &path, leaf_bh);
+        } else if (!path.depth) {
+            ret = bbfs_dx_deepen(dir, &path);
+        } else if (root->count < DX_LIMIT) {
+            ret = bbfs_dx_split_node(dir, &path);
+        } else {
+            ret = -ENOSPC;
+        }
+        brelse(leaf_bh);
+        bbfs_dx_release(&path);
+        if (ret) {
+            return ret;
+        }
+    }
+}
+
+static int bbfs_dx_convert(struct inode *dir) {
+    int ret = bbfs_dir_grow(dir);
+    if (ret) {
+        return ret;
+    }
+    struct buffer_head *root_bh = bbfs_dir_bread(dir, 0);
+    if (!root_bh) {
+        return -EIO;
+    }
+    struct buffer_head *leaf_bh = bbfs_dir_bread(dir, 1);
+    if (!leaf_bh) {
+        brelse(root_bh);
+        return -EIO;
+    }
+    memcpy(leaf_bh->b_data, root_bh->b_data, PAGE_SIZE);
+    bbfs_journal_dirty(dir->i_sb, leaf_bh, dir);
+    brelse(leaf_bh);
+
+    struct bbfs_dx_node *root = (struct bbfs_dx_node *)root_bh->b_data;
+    memset(root, 0, PAGE_SIZE);
+    root->magic = BBFS_DX_MAGIC;
+    root->count = 1;
+    root->next_block = 2;
+    root->entries[0].hash = 0;
+    root->entries[0].block = 1;
+    bbfs_journal_dirty(dir->i_sb, root_bh, dir);
+    brelse(root_bh);
+    return 0;
+}
+
+int bbfs_add_entry(struct inode *dir, const struct qstr *name, struct inode *inode) {
+    struct bbfs_sb_info *sbi = BBFS_SB(dir->i_sb);
+    bool packed = bbfs_dir_packed(dir);
+    unsigned int type = fs_umode_to_dtype(inode->i_mode);
+
+    if (name->len > NAME_MAX) {
+        return -ENAMETOOLONG;
+    }
+    if (bbfs_dir_indexed(dir)) {
+        return bbfs_dx_add_entry(dir, name, inode);
+    }
+
+    for (unsigned long n = 0; n < bbfs_dir_nblocks(dir); n++) {
+        struct buffer_head *bh = bbfs_dir_bread(dir, n);
+        if (!bh) {
+            return -EIO;
+        }
+        bool done = bbfs_insert_block(packed, bh->b_data, name->name, name->len, inode->i_ino, type);
+        if (done) {
+            bbfs_journal_dirty(dir->i_sb, bh, dir);
+            BBFS_INODE(inode)->i_dirent = bh->b_blocknr;
+        }
+        brelse(bh);
+        if (done) {
+            return 0;
+        }
+    }
+
+    if (sbi->disk_sb.features & BBFS_FEAT_DIR_INDEX && BBFS_INODE(dir)->l_num == 1) {
+        int ret = bbfs_dx_convert(dir);
+        if (ret) {
+            return ret;
+        }
+        return bbfs_dx_add_entry(dir, name, inode);
+    }
+
+    unsigned long n = bbfs_dir_nblocks(dir);
+    int ret = bbfs_dir_grow(dir);
+    if (ret) {
+        return ret;
+    }
+    struct buffer_head *bh = bbfs_dir_bread(dir, n);
+    if (!bh) {
+        return -EIO;
+    }
+    bbfs_insert_block(packed, bh->b_data, name->name, name->len, inode->i_ino, type);
+    bbfs_journal_dirty(dir->i_sb, bh, dir);
+    BBFS_INODE(inode)->i_dirent = bh->b_blocknr;
+    brelse(bh);
+    return 0;
+}
+
+int bbfs_delete_entry(struct inode *dir, const struct qstr *name) {
+    struct buffer_head *bh;
+    struct bbfs_dir_rec rec;
+    int ret = bbfs_dir_find(dir, name, &bh, &rec);
+    if (ret) {
+        return ret;
+    }
+    bbfs_remove_block(bbfs_dir_packed(dir), bh->b_data, &rec);
+    bbfs_journal_dirty(dir->i_sb, bh, dir);
+    brelse(bh);
+    return 0;
+}
+
+/* Point an existing entry at inode instead, so that a rename over it never leaves the name missing. */
+int bbfs_replace_entry(struct inode *dir, const struct qstr *name, struct inode *inode) {
+    struct buffer_head *bh;
+    struct bbfs_dir_rec rec;
+    int ret = bbfs_dir_find(dir, name, &bh, &rec);
+    if (ret) {
+        return ret;
+    }
+    bbfs_retarget_block(bbfs_dir_packed(dir), bh->b_data, &rec, inode->i_ino, fs_umode_to_dtype(inode->i_mode));
+    bbfs_journal_dirty(dir->i_sb, bh, dir);
+    BBFS_INODE(inode)->i_dirent = bh->b_blocknr;
+    brelse(bh);
+    return 0;
+}
+
+bool bbfs_empty_dir(struct inode *dir) {
+    bool packed = bbfs_dir_packed(dir);
+    struct bbfs_dir_rec rec;
+
+    for (unsigned long n = 0; n < bbfs_dir_nblocks(dir); n++) {
+        struct buffer_head *bh = bbfs_dir_bread(dir, n);
+        if (!bh) {
+            return false;
+        }
+        if (!bbfs_dx_block(bh)) {
+            for (int off = 0; bbfs_dir_rec(packed, bh->b_data, off, &rec); off = rec.next) {
+                if (rec.len) {
+                    brelse(bh);
+                    return false;
+                }
+            }
+        }
+        brelse(bh);
+    }
+    return true;
+}
+
+/*
+ * A leaf split moves records to other blocks and offsets under an open reader, so indexed directories are read in
+ * hash order instead, with the name hash in the high bits of the position and a second hash below it for names that
+ * share one. Positions start past those of a single linear block, and a reader that began before the directory was
+ * indexed starts over.
+ */
+#define BBFS_DX_POS_MIN (2 * PAGE_SIZE + 1)
+#define BBFS_DX_POS_END LLONG_MAX
+
+struct bbfs_dx_rec {
+    loff_t pos;
+    uint32_t hash;
+    int leaf, off;
+};
+
+static loff_t bbfs_dx_pos(uint32_t hash, uint32_t minor) {
+    return ((loff_t)hash << 31 | minor >> 2) + BBFS_DX_POS_MIN;
+}
+
+static uint32_t bbfs_name_minor(const char *name, unsigned int len) {
+    uint32_t hash = 0;
+    for (unsigned int i = 0; i < len; i++) {
+        hash = hash * 31 + (unsigned char)name[i];
+    }
+    return hash ^ hash >> 15;
+}
+
+static int bbfs_dx_rec_cmp(const void *a, const void *b) {
+    loff_t pa = ((const struct bbfs_dx_rec *)a)->pos, pb = ((const struct bbfs_dx_rec *)b)->pos;
+    return pa < pb ? -1 : pa > pb;
+}
+
+/*
+ * Emit the records from ctx->pos up to the next hash the index splits at, gathered from every leaf that can hold
+ * them: the one the position falls in and those that start at that hash. Returns 1 to go on with the next hash, 0
+ * at the end or once the caller's buffer is full. Only names colliding on both hashes can be returned twice, if a
+ * call stops between them.
+ */
+static int bbfs_dx_iterate_step(struct inode *inode, struct dir_context *ctx) {
+    bool packed = bbfs_dir_packed(inode);
+    int per_leaf = PAGE_SIZE / BBFS_DIRENT_LEN(1);
+    uint32_t hash = (ctx->pos - BBFS_DX_POS_MIN) >> 31, until = U32_MAX;
+    struct buffer_head **leaves = NULL;
+    struct bbfs_dx_rec *recs = NULL;
+    struct bbfs_dir_rec rec;
+    struct bbfs_dx_path path;
+    int nr_leaves = 0, count = 0;
+
+    if (ctx->pos == BBFS_DX_POS_END) {
+        return 0;
+    }
+    int ret = bbfs_dx_descend(inode, hash, &path);
+    if (ret) {
+        return ret;
+    }
+    for (;;) {
+        void *p = krealloc_array(leaves, nr_leaves + 1, sizeof(*leaves), GFP_KERNEL);
+        if (!p) {
+            ret = -ENOMEM;
+            break;
+        }
+        leaves = p;
+        p = krealloc_array(recs, (nr_leaves + 1) * per_leaf, sizeof(*recs), GFP_KERNEL);
+        if (!p) {
+            ret = -ENOMEM;
+            break;
+        }
+        recs = p;
+        struct buffer_head *bh = bbfs_dir_bread(inode, bbfs_dx_leaf(&path)->block);
+        if (!bh) {
+            ret = -EIO;
+            break;
+        }
+        for (int off = 0; bbfs_dir_rec(packed, bh->b_data, off, &rec); off = rec.next) {
+            if (!rec.len) {
+                continue;
+            }
+            uint32_t h = bbfs_name_hash(rec.name, rec.len);
+            loff_t pos = bbfs_dx_pos(h, bbfs_name_minor(rec.name, rec.len));
+            if (pos >= ctx->pos) {
+                recs[count++] = (struct bbfs_dx_rec){.pos = pos, .hash = h, .leaf = nr_leaves, .off = off};
+            }
+        }
+        leaves[nr_leaves++] = bh;
+
+        ret = bbfs_dx_next(inode, &path);
+        if (ret <= 0) {
+            break;
+        }
+        uint32_t next = bbfs_dx_leaf(&path)->hash;
+        if (nr_leaves > 1 && next != until) {
+            break;
+        }
+        until = next;
+    }
+    bbfs_dx_release(&path);
+
+    if (ret >= 0) {
+        bool more = ret;
+        if (!more) {
+            until = U32_MAX;
+        }
+        sort(recs, count, sizeof(*recs), bbfs_dx_rec_cmp, NULL);
+        ret = 1;
+        for (int i = 0; i < count && ret; i++) {
+            if (recs[i].hash > until) {
+                continue;
+            }
+            bbfs_dir_rec(packed, leaves[recs[i].leaf]->b_data, recs[i].off, &rec);
+            ctx->pos = recs[i].pos;
+            ret = dir_emit(ctx, rec.name, rec.len, rec.ino, rec.type);
+        }
+        if (ret) {
+            ctx->pos = more ? bbfs_dx_pos(until + 1, 0) : BBFS_DX_POS_END;
+            ret = more;
+        }
+    }
+    for (int i = 0; i < nr_leaves; i++) {
+        brelse(leaves[i]);
+    }
+    kfree(leaves);
+    kfree(recs);
+    return ret;
+}
+
+/*
+ * Positions in a linear directory are ((logical block + 1) << PAGE_SHIFT) + record offset, so the level and the block
+ * within it fall out of the high bits and a getdents call resumes where the previous one stopped without rescanning.
+ */
 static int bbfs_iterate(struct file *dir, struct dir_context *ctx) {
     struct inode *inode = file_inode(dir);
     struct bbfs_inode_info *ci = BBFS_INODE(inode);
     struct super_block *sb = inode->i_sb;
     struct bbfs_sb_info *sbi = sb->s_fs_info;
+    bool packed = bbfs_dir_packed(inode);
+    struct bbfs_dir_rec rec;
 
     if (!S_ISDIR(inode->i_mode)) {
         return -ENOTDIR;
@@ -22,33 +641,66 @@ static int bbfs_iterate(struct file *dir, struct dir_context *ctx) {
     if (!dir_emit_dots(dir, ctx)) {
         return 0;
     }
+    if (bbfs_dir_indexed(inode)) {
+        if (ctx->pos < BBFS_DX_POS_MIN) {
+            ctx->pos = BBFS_DX_POS_MIN;
+        }
+        int ret;
+        do {
+            ret = bbfs_dx_iterate_step(inode, ctx);
+        } while (ret > 0);
+        return ret;
+    }
+    if (ctx->pos < PAGE_SIZE) {
+        ctx->pos = PAGE_SIZE;
+    }
+
+    unsigned long start = (ctx->pos >> PAGE_SHIFT) - 1;
+    for (unsigned long n = start; n < bbfs_dir_nblocks(inode); n++) {
+        int level = ilog2(n + 1);
+        unsigned long idx = n + 1 - (1ul << level);
+        unsigned long blk = ci->levels[level] + idx;
+        if (n == start || idx % BBFS_DIR_RA == 0) {
+            unsigned long ra = min(1ul << level, idx + BBFS_DIR_RA);
+            for (unsigned long k = idx + 1; k < ra; k++) {
+                sb_breadahead(sb, sbi->block_begin + blk - idx + k);
+            }
+        }
 
-    int pos = ctx->pos - 2;
-    for (int i = 0; i < ci->disk_inode.l_num; i++) {
-        uint32_t blk_start = ci->disk_inode.levels[i];
-        uint32_t blk_num = 1 << i;
-        for (int j = blk_start; j < blk_start + blk_num; j++) {
-            struct buffer_head *bh = sb_bread(sb, sbi->block_begin + j);
-            for (int k = 0; k < PAGE_SIZE; k += sizeof(struct bbfs_entry)) {
-                struct bbfs_entry *ent = (struct bbfs_entry *)(bh->b_data + k);
-                if (ent->valid) {
-                    if (pos > 0) {
-                        pos--;
-                        continue;
-                    }
-                    if (!dir_emit(ctx, ent->name, NAME_MAX, ent->ino, ent->type)) {
-                        break;
-                    }
-                    ctx->pos++;
+        struct buffer_head *bh = sb_bread(sb, sbi->block_begin + blk);
+        if (!bh) {
+            return -EIO;
+        }
+        if (!bbfs_dx_block(bh)) {
+            int skip = ctx->pos & (PAGE_SIZE - 1);
+            for (int off = 0; bbfs_dir_rec(packed, bh->b_data, off, &rec); off = rec.next) {
+                if (rec.off < skip || !rec.len) {
+                    continue;
+                }
+                ctx->pos = ((n + 1) << PAGE_SHIFT) + rec.off;
+                if (!dir_emit(ctx, rec.name, rec.len, rec.ino, rec.type)) {
+                    brelse(bh);
+                    return 0;
                 }
             }
-            brelse(bh);
         }
+        brelse(bh);
+        ctx->pos = (n + 2) << PAGE_SHIFT;
     }
     return 0;
 }
 
+/* Hash positions go far past s_maxbytes. */
+static loff_t bbfs_dir_llseek(struct file *file, loff_t offset, int whence) {
+    return generic_file_llseek_size(file, offset, whence, LLONG_MAX, i_size_read(file_inode(file)));
+}
+
 const struct file_operations bbfs_dir_ops = {
     .owner = THIS_MODULE,
+    .llseek = bbfs_dir_llseek,
+    .read = generic_read_dir,
     .iterate_shared = bbfs_iterate,
+    .fsync = bbfs_fsync,
+    .unlocked_ioctl = bbfs_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
 };
@@ -0,0 +1,303 @@
+#ifndef _DISK_H
+#define _DISK_H
+
+/*
+ * On-disk logic that does no I/O of its own, shared by the kernel module and libbbfs so that both read and write
+ * directory blocks and run the block allocator the same way. Include after fs.h.
+ */
+
+#ifndef __LINUX_KERNEL__
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#endif
+
+#define DX_LIMIT ((BBFS_BLOCK_SIZE - offsetof(struct bbfs_dx_node, entries)) / sizeof(struct bbfs_dx_entry))
+
+/*
+ * The buddy allocator keeps a bit per block, set while the block is free, and a tree over the 64-bit words of those
+ * bits with one byte per node: 0 if the subtree has no free block, otherwise one more than the largest free aligned
+ * order below it, so a node whose value is its own order + 1 is entirely free. With a leaf per word rather than per
+ * block it costs 1/8 + 1/32 of a byte per block. The tree is always up to date; the words and the tree follow the
+ * header in the same allocation, of bbfs_buddy_size bytes.
+ */
+#define BBFS_BUDDY_WORD_ORDER 6
+
+struct bbfs_buddy {
+    unsigned int order;
+    uint8_t *tree;
+    uint64_t words[];
+};
+
+/* Groups smaller than a word still get one, with the blocks past the end never free. */
+static inline unsigned int bbfs_buddy_order(unsigned int order) {
+    return order > BBFS_BUDDY_WORD_ORDER ? order : BBFS_BUDDY_WORD_ORDER;
+}
+
+static inline size_t bbfs_buddy_size(unsigned int order) {
+    return sizeof(struct bbfs_buddy) + ((sizeof(uint64_t) + 2) << (order - BBFS_BUDDY_WORD_ORDER));
+}
+
+/* Set up zeroed memory of bbfs_buddy_size(order) bytes for a tree of 1 << order blocks, all used. */
+static inline void bbfs_buddy_init(struct bbfs_buddy *b, unsigned int order) {
+    b->order = order;
+    b->tree = (uint8_t *)(b->words + (1ul << (order - BBFS_BUDDY_WORD_ORDER)));
+}
+
+/* The bits of w that start an aligned run of 1 << order set bits. */
+static inline uint64_t bbfs_buddy_runs(uint64_t w, unsigned int order) {
+    for (unsigned int k = 0; k < order; k++) {
+        unsigned int step = 1u << k;
+        w &= w >> step & (step == 32 ? 1 : ~0ull / ((1ull << 2 * step) - 1));
+    }
+    return w;
+}
+
+/* Recompute the leaves for words first..last and every node above them. */
+static inline void bbfs_buddy_fix(struct bbfs_buddy *b, unsigned long first, unsigned long last) {
+    unsigned long nodes = 1ul << (b->order - BBFS_BUDDY_WORD_ORDER);
+
+    for (unsigned long w = first; w <= last; w++) {
+        uint8_t v = 0;
+        while (v <= BBFS_BUDDY_WORD_ORDER && bbfs_buddy_runs(b->words[w], v)) {
+            v++;
+        }
+        b->tree[nodes + w] = v;
+    }
+    for (unsigned int order = BBFS_BUDDY_WORD_ORDER + 1; order <= b->order; order++) {
+        nodes /= 2;
+        first /= 2;
+        last /= 2;
+        for (unsigned long node = nodes + first; node <= nodes + last; node++) {
+            uint8_t left = b->tree[2 * node], right = b->tree[2 * node + 1];
+            b->tree[node] = left == order && right == order ? order + 1 : left > right ? left : right;
+        }
+    }
+}
+
+/* Build the tree once the words hold the free blocks. */
+static inline void bbfs_buddy_build(struct bbfs_buddy *b) {
+    bbfs_buddy_fix(b, 0, (1ul << (b->order - BBFS_BUDDY_WORD_ORDER)) - 1);
+}
+
+/* Mark [start, end) free or used in the words only, for a bbfs_buddy_build to follow. */
+static inline void bbfs_buddy_set(struct bbfs_buddy *b, unsigned long start, unsigned long end, bool free) {
+    for (unsigned long blk = start; blk < end;) {
+        unsigned int bit = blk % 64;
+        unsigned long n = end - blk < 64 - bit ? end - blk : 64 - bit;
+        uint64_t mask = (n == 64 ? ~0ull : (1ull << n) - 1) << bit;
+        b->words[blk / 64] = free ? b->words[blk / 64] | mask : b->words[blk / 64] & ~mask;
+        blk += n;
+    }
+}
+
+static inline void bbfs_buddy_update(struct bbfs_buddy *b, unsigned long start, unsigned long end, bool free) {
+    if (start < end) {
+        bbfs_buddy_set(b, start, end, free);
+        bbfs_buddy_fix(b, start / 64, (end - 1) / 64);
+    }
+}
+
+/* The end of the run of blocks from start that are all free, or all used if !free. */
+static inline unsigned long bbfs_buddy_run_end(const struct bbfs_buddy *b, unsigned long start, bool free) {
+    unsigned long end = 1ul << b->order;
+
+    while (start < end) {
+        uint64_t stop = (free ? ~b->words[start / 64] : b->words[start / 64]) >> start % 64;
+        if (stop) {
+            return start + __builtin_ctzll(stop);
+        }
+        start = (start | 63) + 1;
+    }
+    return end;
+}
+
+/* Whether all of [start, end) is free. */
+static inline bool bbfs_buddy_free(const struct bbfs_buddy *b, unsigned long start, unsigned long end) {
+    return bbfs_buddy_run_end(b, start, true) >= end;
+}
+
+/* The first free aligned run of 1 << order blocks, or -1. */
+static inline long bbfs_buddy_find(const struct bbfs_buddy *b, unsigned int order) {
+    unsigned long node = 1;
+    unsigned int cur = b->order;
+
+    if (order > cur || b->tree[1] <= order) {
+        return -1;
+    }
+    while (cur > order && cur > BBFS_BUDDY_WORD_ORDER && b->tree[node] != cur + 1) {
+        node = b->tree[2 * node] > order ? 2 * node : 2 * node + 1;
+        cur--;
+    }
+    unsigned long base = (node - (1ul << (b->order - cur))) << cur;
+    if (cur > order && b->tree[node] != cur + 1) {
+        base += __builtin_ctzll(bbfs_buddy_runs(b->words[base / 64], order));
+    }
+    return base;
+}
+
+struct bbfs_dir_rec {
+    int off, next;
+    const char *name;
+    unsigned int len;
+    uint32_t ino;
+    unsigned int type;
+};
+
+/* Decodes the record at off, either format; a free slot has len 0. Stops at the block end or a corrupt rec_len. */
+static inline bool bbfs_dir_rec(bool packed, char *data, int off, struct bbfs_dir_rec *rec) {
+    if (off >= BBFS_BLOCK_SIZE) {
+        return false;
+    }
+    rec->off = off;
+    if (!packed) {
+        struct bbfs_entry *ent = (struct bbfs_entry *)(data + off);
+        rec->next = off + sizeof(struct bbfs_entry);
+        rec->name = ent->name;
+        rec->len = ent->valid ? strnlen(ent->name, NAME_MAX) : 0;
+        rec->ino = ent->ino;
+        rec->type = ent->type;
+        return true;
+    }
+    struct bbfs_dirent *de = (struct bbfs_dirent *)(data + off);
+    if (off + sizeof(struct bbfs_dirent) > BBFS_BLOCK_SIZE || de->rec_len < sizeof(struct bbfs_dirent) ||
+        de->rec_len % 4 || de->rec_len > BBFS_BLOCK_SIZE - off || BBFS_DIRENT_LEN(de->name_len) > de->rec_len) {
+        return false;
+    }
+    rec->next = off + de->rec_len;
+    rec->name = de->name;
+    rec->len = de->name_len;
+    rec->ino = de->ino;
+    rec->type = de->type;
+    return true;
+}
+
+static inline void bbfs_dir_init_block(bool packed, char *data) {
+    memset(data, 0, BBFS_BLOCK_SIZE);
+    if (packed) {
+        ((struct bbfs_dirent *)data)->rec_len = BBFS_BLOCK_SIZE;
+    }
+}
+
+static inline bool bbfs_search_block(bool packed, char *data, const char *name, unsigned int len,
+                                     struct bbfs_dir_rec *rec) {
+    for (int off = 0; bbfs_dir_rec(packed, data, off, rec); off = rec->next) {
+        if (rec->len == len && !memcmp(rec->name, name, len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline bool bbfs_insert_block(bool packed, char *data, const char *name, unsigned int len, uint32_t ino,
+                                     unsigned int type) {
+    struct bbfs_dir_rec rec;
+
+    for (int off = 0; bbfs_dir_rec(packed, data, off, &rec); off = rec.next) {
+        if (!packed) {
+            struct bbfs_entry *ent = (struct bbfs_entry *)(data + off);
+            if (ent->valid) {
+                continue;
+            }
+            ent->valid = 1;
+            ent->type = type;
+            ent->ino = ino;
+            memcpy(ent->name, name, len);
+            ent->name[len] = '\0';
+            return true;
+        }
+
+        struct bbfs_dirent *de = (struct bbfs_dirent *)(data + off);
+        unsigned int used = rec.len ? BBFS_DIRENT_LEN(rec.len) : 0;
+        if (de->rec_len - used < BBFS_DIRENT_LEN(len)) {
+            continue;
+        }
+        if (used) {
+            struct bbfs_dirent *next = (struct bbfs_dirent *)(data + off + used);
+            next->rec_len = de->rec_len - used;
+            de->rec_len = used;
+            de = next;
+        }
+        de->name_len = len;
+        de->type = type;
+        de->ino = ino;
+        memcpy(de->name, name, len);
+        return true;
+    }
+    return false;
+}
+
+static inline void bbfs_remove_block(bool packed, char *data, struct bbfs_dir_rec *victim) {
+    if (!packed) {
+        memset(data + victim->off, 0, sizeof(struct bbfs_entry));
+        return;
+    }
+    struct bbfs_dirent *de = (struct bbfs_dirent *)(data + victim->off);
+    struct bbfs_dir_rec rec;
+    for (int off = 0; bbfs_dir_rec(packed, data, off, &rec); off = rec.next) {
+        if (rec.next == victim->off) {
+            ((struct bbfs_dirent *)(data + off))->rec_len += de->rec_len;
+            return;
+        }
+    }
+    de->name_len = 0;
+    de->ino = 0;
+}
+
+/* Point the record found by a search at another inode, keeping its name and place. */
+static inline void bbfs_retarget_block(bool packed, char *data, struct bbfs_dir_rec *rec, uint32_t ino,
+                                       unsigned int type) {
+    if (!packed) {
+        struct bbfs_entry *ent = (struct bbfs_entry *)(data + rec->off);
+        ent->ino = ino;
+        ent->type = type;
+        return;
+    }
+    struct bbfs_dirent *de = (struct bbfs_dirent *)(data + rec->off);
+    de->ino = ino;
+    de->type = type;
+}
+
+static inline int bbfs_dx_search(struct bbfs_dx_node *node, uint32_t hash) {
+    int lo = 1, hi = node->count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (node->entries[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo - 1;
+}
+
+struct bbfs_dx_hash {
+    uint32_t hash;
+    int off;
+};
+
+static inline int bbfs_dx_cmp(const void *a, const void *b) {
+    uint32_t ha = ((const struct bbfs_dx_hash *)a)->hash, hb = ((const struct bbfs_dx_hash *)b)->hash;
+    return ha < hb ? -1 : ha > hb;
+}
+
+/*
+ * Where to split a full leaf whose count records are sorted by hash: the middle, moved so that no hash ends up on
+ * both sides if that can be helped.
+ */
+static inline int bbfs_dx_split_point(const struct bbfs_dx_hash *map, int count) {
+    int split = count / 2;
+    while (split < count && map[split].hash == map[split - 1].hash) {
+        split++;
+    }
+    if (split == count) {
+        split = count / 2;
+        while (split > 1 && map[split].hash == map[split - 1].hash) {
+            split--;
+        }
+    }
+    return split;
+}
+
+#endif
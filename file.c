@@ -2,77 +2,1131 @@
 #define __LINUX_KERNEL__
 #endif
 
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
+#include <linux/iomap.h>
 #include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include <linux/module.h>
-#include <linux/mpage.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
 
 #include "fs.h"
 
-static int bbfs_file_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create) {
+static bool bbfs_level_mapped(struct bbfs_inode_info *ci, int level) {
+    return level < ci->l_num && ci->levels[level] != BBFS_LEVEL_HOLE;
+}
+
+static unsigned long bbfs_mapped_levels(struct bbfs_inode_info *ci) {
+    unsigned long mask = 0;
+    for (int l = 0; l < ci->l_num; l++) {
+        if (ci->levels[l] != BBFS_LEVEL_HOLE) {
+            mask |= 1ul << l;
+        }
+    }
+    return mask;
+}
+
+/*
+ * The levels that have to be allocated before level can be mapped: on sparse file systems just that level, otherwise
+ * every missing level up to it. Called with alloc_lock held.
+ */
+static unsigned long bbfs_missing_levels(struct inode *inode, int level) {
+    struct bbfs_sb_info *sbi = BBFS_SB(inode->i_sb);
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+
+    if (bbfs_level_mapped(ci, level)) {
+        return 0;
+    }
+    if (sbi->disk_sb.features & BBFS_FEAT_SPARSE) {
+        return 1ul << level;
+    }
+    return GENMASK(level, ci->l_num);
+}
+
+/*
+ * Buffered writes only reserve the levels they touch; bbfs_map_blocks allocates them once writeback starts. l_resv is
+ * the mask of reserved levels, and since level l holds 2^l blocks it is also the number of blocks reserved. from is
+ * where the data being dirtied starts, or EOF if that is further: anything that moves EOF zeroes the gap, so a level
+ * starting at or past it only has blocks below EOF that the page cache covers. The others are marked in l_resv_zero.
+ * Called with alloc_lock held.
+ */
+static int bbfs_reserve_levels(struct inode *inode, int level, loff_t from) {
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+    unsigned long want = bbfs_missing_levels(inode, level) & ~ci->l_resv;
+
+    if (!want) {
+        return 0;
+    }
+    int ret = bbfs_reserve_blocks(inode->i_sb, want);
+    if (!ret) {
+        ci->l_resv |= want;
+        ci->l_resv_zero &= ~want;
+        if (from) {
+            ci->l_resv_zero |= want & GENMASK(ilog2(((from - 1) >> inode->i_blkbits) + 1), 0);
+        }
+    }
+    return ret;
+}
+
+void bbfs_release_reservation(struct inode *inode) {
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+
+    mutex_lock(&ci->alloc_lock);
+    bbfs_release_blocks(inode->i_sb, ci->l_resv);
+    ci->l_resv = 0;
+    mutex_unlock(&ci->alloc_lock);
+}
+
+/*
+ * Zero the part of a new level below max(EOF, end) that could otherwise be read back, leaving out what the caller is
+ * about to write of [pos, end). Only the part past EOF is left out: a write below EOF that failed half way would
+ * expose whatever the blocks held before.
+ */
+static int bbfs_zero_new_level(struct inode *inode, int level, unsigned long blk, loff_t pos, loff_t end, loff_t size) {
+    struct super_block *sb = inode->i_sb;
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    unsigned int blkbits = inode->i_blkbits;
+    unsigned long lstart = (1ul << level) - 1, lend = lstart + (1ul << level);
+    unsigned long zend = clamp_t(u64, ((u64)max(size, end) + (1 << blkbits) - 1) >> blkbits, lstart, lend);
+    unsigned long wstart = clamp_t(u64, ((u64)max(pos, size) + (1 << blkbits) - 1) >> blkbits, lstart, zend);
+    unsigned long wend = clamp_t(u64, end >> blkbits, wstart, zend);
+    int ret = 0;
+
+    if (wstart > lstart) {
+        ret = sb_issue_zeroout(sb, sbi->block_begin + blk, wstart - lstart, GFP_NOFS);
+    }
+    if (!ret && zend > wend) {
+        ret = sb_issue_zeroout(sb, sbi->block_begin + blk + wend - lstart, zend - wend, GFP_NOFS);
+    }
+    return ret;
+}
+
+/*
+ * Allocate the levels in mask that are not mapped yet, preferring one contiguous run for each stretch of consecutive
+ * levels and falling back to placing each level on its own: levels first..last laid end to end fill an aligned chunk
+ * of order last + 1 apart from its last 2^first blocks. The blocks are held while bbfs_zero_new_level clears what
+ * needs it, which reserved levels the page cache covers do not, so neither alloc_lock nor a handle is held across the
+ * zeroing. With unwritten, levels that had no delalloc data pending are flagged instead of zeroed. Whatever was
+ * reserved for the levels that got mapped is handed back.
+ */
+static int bbfs_alloc_levels(struct inode *inode, unsigned long mask, loff_t pos, loff_t end, bool unwritten) {
     struct super_block *sb = inode->i_sb;
     struct bbfs_sb_info *sbi = BBFS_SB(sb);
     struct bbfs_inode_info *ci = BBFS_INODE(inode);
+    bool sparse = sbi->disk_sb.features & BBFS_FEAT_SPARSE;
+    int ret = 0;
+
+    while (!ret) {
+        mutex_lock(&ci->alloc_lock);
+        mask &= ~bbfs_mapped_levels(ci);
+        if (!mask) {
+            mutex_unlock(&ci->alloc_lock);
+            break;
+        }
+        int first = __ffs(mask), last = first;
+        while (last + 1 < BBFS_MAX_LEVELS && mask & (1ul << (last + 1))) {
+            last++;
+        }
+        unsigned long blk_start = LONG_MAX;
+        if (last > first && last + 1 < BBFS_MAX_LEVELS) {
+            blk_start = bbfs_hold_free_block(inode, last + 1);
+            if (blk_start != LONG_MAX) {
+                bbfs_put_held_blocks(sb, blk_start + (1ul << (last + 1)) - (1ul << first), 1ul << first);
+            }
+        }
+        if (blk_start == LONG_MAX) {
+            last = first;
+            blk_start = bbfs_hold_free_block(inode, first);
+        }
+        unsigned long covered = ci->l_resv & ~ci->l_resv_zero, fresh = unwritten ? ~ci->l_resv : 0;
+        loff_t size = i_size_read(inode);
+        mutex_unlock(&ci->alloc_lock);
+        if (blk_start == LONG_MAX) {
+            ret = -ENOSPC;
+            break;
+        }
 
-    int level = 0;
-    int offset = iblock;
-    while (offset >= (1 << level)) {
-        offset -= 1 << level;
-        level++;
+        unsigned long nr = (1ul << (last + 1)) - (1ul << first);
+        clean_bdev_aliases(sb->s_bdev, sbi->block_begin + blk_start, nr);
+        for (int l = first; l <= last && !ret; l++) {
+            if (!((covered | fresh) & (1ul << l))) {
+                ret = bbfs_zero_new_level(inode, l, blk_start + (1ul << l) - (1ul << first), pos, end, size);
+            }
+        }
+        if (!ret) {
+            ret = bbfs_journal_start(sb);
+        }
+        if (ret) {
+            bbfs_put_held_blocks(sb, blk_start, nr);
+            break;
+        }
+        mutex_lock(&ci->alloc_lock);
+        for (int l = first; l <= last; l++) {
+            unsigned long blk = blk_start + (1ul << l) - (1ul << first);
+            /* The level may have been mapped meanwhile, and without sparse levels only ever go at the end. */
+            if (ret || bbfs_level_mapped(ci, l) || (!sparse && l != ci->l_num)) {
+                bbfs_put_held_blocks(sb, blk, 1ul << l);
+                continue;
+            }
+            ret = bbfs_add_level(inode, l, blk);
+            if (ret) {
+                bbfs_put_held_blocks(sb, blk, 1ul << l);
+            } else {
+                bbfs_mark_held_blocks(sb, blk, 1ul << l);
+                ci->l_unwritten |= fresh & (1ul << l);
+            }
+        }
+        unsigned long mapped = ci->l_resv & bbfs_mapped_levels(ci);
+        ci->l_resv &= ~mapped;
+        bbfs_release_blocks(sb, mapped);
+        mutex_unlock(&ci->alloc_lock);
+        bbfs_journal_stop(sb);
+        mask &= ~GENMASK(last, first);
     }
+    return ret;
+}
 
-    if (!create && ci->disk_inode.l_num < level) {
-        return 0;
+static int bbfs_copy_blocks(struct super_block *sb, unsigned long from, unsigned long to, unsigned long nr) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+
+    for (unsigned long i = 0; i < nr; i++) {
+        struct buffer_head *src = sb_getblk(sb, sbi->block_begin + from + i);
+        if (!src) {
+            return -EIO;
+        }
+        /* File data is written around the block device's cache, so anything cached for these blocks may be stale. */
+        clear_buffer_uptodate(src);
+        struct buffer_head *dst = bh_read(src, 0) < 0 ? NULL : sb_getblk(sb, sbi->block_begin + to + i);
+        if (!dst) {
+            brelse(src);
+            return -EIO;
+        }
+        lock_buffer(dst);
+        memcpy(dst->b_data, src->b_data, dst->b_size);
+        set_buffer_uptodate(dst);
+        unlock_buffer(dst);
+        mark_buffer_dirty(dst);
+        brelse(dst);
+        brelse(src);
+    }
+    return sync_blockdev_range(sb->s_bdev, (loff_t)(sbi->block_begin + to) << sb->s_blocksize_bits,
+                               ((loff_t)(sbi->block_begin + to + nr) << sb->s_blocksize_bits) - 1);
+}
+
+static bool bbfs_past_tail(struct bbfs_inode_info *ci, unsigned long iblock) {
+    return ci->l_tail && iblock + 1 >= (1ul << (ci->l_num - 1)) + ci->l_tail;
+}
+
+/*
+ * Make a trimmed last level whole again before anything is written past l_tail. The blocks after the tail are usually
+ * still free and are simply taken back; otherwise the level moves to a new chunk and the blocks it kept are copied
+ * over, which is why its cached data is written back first.
+ */
+static int bbfs_grow_tail(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+    unsigned int blkbits = inode->i_blkbits;
+
+    mutex_lock(&ci->alloc_lock);
+    loff_t start = ci->l_tail ? (loff_t)((1ul << (ci->l_num - 1)) - 1) << blkbits : 0;
+    loff_t end = start + ((loff_t)ci->l_tail << blkbits) - 1;
+    mutex_unlock(&ci->alloc_lock);
+    int ret = end < start ? 0 : filemap_write_and_wait_range(inode->i_mapping, start, end);
+    if (ret) {
+        return ret;
+    }
+    ret = bbfs_journal_start(sb);
+    if (ret) {
+        return ret;
+    }
+    mutex_lock(&ci->alloc_lock);
+    unsigned int l = ci->l_num - 1;
+    unsigned long tail = ci->l_tail, old = ci->levels[l], blk = old;
+    if (!tail) {
+        goto out;
     }
+    if (!bbfs_claim_blocks(sb, old + tail, (1ul << l) - tail)) {
+        blk = bbfs_find_and_mark_free_block(inode, l);
+        if (blk == LONG_MAX) {
+            ret = -ENOSPC;
+            goto out;
+        }
+    }
+    /* Only what lies below EOF needs zeroing, which is nothing unless EOF moved without growing the tail. */
+    unsigned long eof = (i_size_read(inode) + (1 << blkbits) - 1) >> blkbits;
+    unsigned long zero = clamp(eof + 1, 1ul << l, 2ul << l) - (1ul << l);
+    clean_bdev_aliases(sb->s_bdev, sbi->block_begin + blk + tail, (1ul << l) - tail);
+    if (zero > tail) {
+        ret = sb_issue_zeroout(sb, sbi->block_begin + blk + tail, zero - tail, GFP_NOFS);
+    }
+    if (!ret && blk != old) {
+        ret = bbfs_copy_blocks(sb, old, blk, tail);
+    }
+    if (ret) {
+        if (blk == old) {
+            bbfs_free_blocks(sb, old + tail, (1ul << l) - tail);
+        } else {
+            bbfs_free_block(sb, blk, l);
+        }
+        goto out;
+    }
+    if (blk != old) {
+        bbfs_free_blocks(sb, old, tail);
+        ci->levels[l] = blk;
+    }
+    ci->l_tail = 0;
+    ci->l_synced = min(ci->l_synced, l);
+    mark_inode_dirty(inode);
+out:
+    mutex_unlock(&ci->alloc_lock);
+    bbfs_journal_stop(sb);
+    return ret;
+}
 
-    while (ci->disk_inode.l_num <= level) {
-        unsigned long blk_start = bbfs_find_and_mark_free_block(sb, ci->disk_inode.l_num);
-        ci->disk_inode.levels[ci->disk_inode.l_num] = blk_start;
-        ci->disk_inode.l_num++;
+/*
+ * Level i holds file blocks [2^i - 1, 2^(i+1) - 1) in one physically contiguous run, so every level is reported as a
+ * single extent. Buffered writes into levels that are not mapped yet get a delalloc extent backed by a reservation;
+ * direct writes allocate whatever bbfs_missing_levels says the level containing pos needs, zeroing what they will not
+ * write over. Reads of a level that was never allocated, which on sparse file systems may sit below mapped ones, are
+ * holes and cost no I/O. Any write past a trimmed last level grows it back first, so only reads ever see the part it
+ * gave up, as a hole.
+ */
+static int bbfs_iomap_begin(struct inode *inode, loff_t pos, loff_t length, unsigned int flags, struct iomap *iomap,
+                            struct iomap *srcmap) {
+    struct super_block *sb = inode->i_sb;
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+    unsigned int blkbits = inode->i_blkbits;
+    bool converted = false;
+    int ret = 0;
+
+    sector_t iblock = pos >> blkbits;
+    int level = ilog2(iblock + 1);
+    unsigned long offset = iblock + 1 - (1ul << level);
+
+    if (level >= BBFS_MAX_LEVELS) {
+        return -EFBIG;
     }
+    iomap->bdev = sb->s_bdev;
+    iomap->offset = (loff_t)iblock << blkbits;
+    iomap->flags = 0;
 
-    map_bh(bh_result, sb, sbi->block_begin + ci->disk_inode.levels[level] + offset);
+    if (flags & IOMAP_NOWAIT) {
+        if (!mutex_trylock(&ci->alloc_lock)) {
+            return -EAGAIN;
+        }
+    } else {
+        mutex_lock(&ci->alloc_lock);
+    }
+    if (flags & IOMAP_WRITE && bbfs_past_tail(ci, iblock)) {
+        if (flags & IOMAP_NOWAIT) {
+            ret = -EAGAIN;
+            goto out;
+        }
+        mutex_unlock(&ci->alloc_lock);
+        ret = bbfs_grow_tail(inode);
+        if (ret) {
+            return ret;
+        }
+        mutex_lock(&ci->alloc_lock);
+    }
+    unsigned long blocks = bbfs_level_mapped(ci, level) ? bbfs_level_blocks(ci, level) : 0;
+    if (offset >= blocks) {
+        /* Reserved levels have dirty data in the page cache, which lseek and zeroing must not skip as a hole. */
+        if (flags & (IOMAP_REPORT | IOMAP_ZERO) && ci->l_resv & (1ul << level)) {
+            iomap->type = IOMAP_DELALLOC;
+            iomap->addr = IOMAP_NULL_ADDR;
+            iomap->length = (u64)((1ul << level) - offset) << blkbits;
+            goto out;
+        }
+        if (!(flags & IOMAP_WRITE)) {
+            int next = level + 1;
+            while (next < BBFS_MAX_LEVELS && !bbfs_level_mapped(ci, next) && !(ci->l_resv & (1ul << next))) {
+                next++;
+            }
+            u64 end = round_up(pos + length, 1 << blkbits);
+            if (next < BBFS_MAX_LEVELS) {
+                end = min_t(u64, end, (u64)((1ul << next) - 1) << blkbits);
+            }
+            iomap->type = IOMAP_HOLE;
+            iomap->addr = IOMAP_NULL_ADDR;
+            iomap->length = end - iomap->offset;
+            goto out;
+        }
+        if (!(flags & IOMAP_DIRECT)) {
+            loff_t from = max(pos, i_size_read(inode));
+            ret = bbfs_reserve_levels(inode, level, from);
+            if (ret == -ENOSPC && !(flags & IOMAP_NOWAIT)) {
+                mutex_unlock(&ci->alloc_lock);
+                bool retry = bbfs_commit_busy(sb);
+                mutex_lock(&ci->alloc_lock);
+                ret = retry ? bbfs_reserve_levels(inode, level, from) : ret;
+            }
+            iomap->type = IOMAP_DELALLOC;
+            iomap->addr = IOMAP_NULL_ADDR;
+            iomap->length = (u64)((1ul << level) - offset) << blkbits;
+            goto out;
+        }
+        if (flags & IOMAP_NOWAIT) {
+            ret = -EAGAIN;
+            goto out;
+        }
+        unsigned long mask = bbfs_missing_levels(inode, level);
+        mutex_unlock(&ci->alloc_lock);
+        ret = bbfs_alloc_levels(inode, mask, pos, pos + length, false);
+        if (ret) {
+            return ret;
+        }
+        mutex_lock(&ci->alloc_lock);
+        if (!bbfs_level_mapped(ci, level)) {
+            ret = -ENOSPC;
+            goto out;
+        }
+    }
+
+    /*
+     * An unwritten level reads as zeros whatever its blocks hold, so the first write zeroes what it will not cover,
+     * as for a new level, before clearing the bit. Only one writer converts a level: another one zeroing it later
+     * would wipe what the first wrote, so the bit is checked again under convert_lock.
+     */
+    iomap->type = IOMAP_MAPPED;
+    if (ci->l_unwritten & (1u << level)) {
+        if (!(flags & IOMAP_WRITE)) {
+            iomap->type = IOMAP_UNWRITTEN;
+        } else if (flags & IOMAP_NOWAIT) {
+            ret = -EAGAIN;
+            goto out;
+        } else {
+            mutex_unlock(&ci->alloc_lock);
+            mutex_lock(&ci->convert_lock);
+            mutex_lock(&ci->alloc_lock);
+            if (ci->l_unwritten & (1u << level)) {
+                unsigned long blk = ci->levels[level];
+                mutex_unlock(&ci->alloc_lock);
+                ret = bbfs_zero_new_level(inode, level, blk, pos, pos + length, i_size_read(inode));
+                mutex_lock(&ci->alloc_lock);
+                if (!ret) {
+                    converted = true;
+                    ci->l_unwritten &= ~(1u << level);
+                }
+            }
+            mutex_unlock(&ci->convert_lock);
+            if (ret) {
+                goto out;
+            }
+        }
+    }
+    iomap->addr = (u64)(sbi->block_begin + ci->levels[level] + offset) << blkbits;
+    iomap->length = (u64)(bbfs_level_blocks(ci, level) - offset) << blkbits;
+out:
+    mutex_unlock(&ci->alloc_lock);
+    if (converted) {
+        mark_inode_dirty(inode);
+    }
+    return ret;
+}
+
+static int bbfs_iomap_end(struct inode *inode, loff_t pos, loff_t length, ssize_t written, unsigned int flags,
+                          struct iomap *iomap) {
+    if (iomap->flags & IOMAP_F_SIZE_CHANGED) {
+        mark_inode_dirty(inode);
+    }
     return 0;
 }
 
-static void bbfs_readahead(struct readahead_control *rac) { mpage_readahead(rac, bbfs_file_get_block); }
+static const struct iomap_ops bbfs_iomap_ops = {
+    .iomap_begin = bbfs_iomap_begin,
+    .iomap_end = bbfs_iomap_end,
+};
+
+/*
+ * Writeback is where delalloc levels get real blocks. Everything reserved so far is allocated in one go, which lets
+ * bbfs_alloc_levels lay the whole dirty range out contiguously.
+ */
+static int bbfs_map_blocks(struct iomap_writepage_ctx *wpc, struct inode *inode, loff_t offset) {
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+
+    if (offset >= wpc->iomap.offset && offset < wpc->iomap.offset + wpc->iomap.length) {
+        return 0;
+    }
+    int level = ilog2((offset >> inode->i_blkbits) + 1);
+    if (level >= BBFS_MAX_LEVELS) {
+        return -EFBIG;
+    }
+    mutex_lock(&ci->alloc_lock);
+    unsigned long mask = bbfs_missing_levels(inode, level) | ci->l_resv;
+    mutex_unlock(&ci->alloc_lock);
+    int ret = bbfs_alloc_levels(inode, mask, 0, 0, false);
+    if (ret) {
+        return ret;
+    }
+    return bbfs_iomap_begin(inode, offset, i_size_read(inode) - offset, 0, &wpc->iomap, NULL);
+}
+
+static const struct iomap_writeback_ops bbfs_writeback_ops = {
+    .map_blocks = bbfs_map_blocks,
+};
+
+static bool bbfs_inode_inline(struct inode *inode) {
+    return BBFS_INODE(inode)->i_flags & BBFS_INODE_INLINE;
+}
+
+static void bbfs_inline_fill_folio(struct inode *inode, struct folio *folio) {
+    size_t size = folio->index ? 0 : min_t(loff_t, i_size_read(inode), bbfs_inline_max(inode->i_sb));
+    char *kaddr = kmap_local_folio(folio, 0);
+
+    memcpy(kaddr, BBFS_INODE(inode)->i_data, size);
+    memset(kaddr + size, 0, PAGE_SIZE - size);
+    kunmap_local(kaddr);
+    folio_zero_segment(folio, PAGE_SIZE, folio_size(folio));
+    folio_mark_uptodate(folio);
+}
+
+/*
+ * Small files keep their bytes in the inode's level array. Reads and writes copy straight to and from the cached
+ * inode; the page cache is only filled for splice and mmap and is dropped after every inline write. A shared writable
+ * mapping converts the file without i_rwsem, so the copies are made under alloc_lock with page faults disabled, and
+ * -ENOTBLK tells the caller the file was converted under it.
+ */
+static ssize_t bbfs_inline_read(struct kiocb *iocb, struct iov_iter *to) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+    ssize_t ret = 0;
+
+    for (;;) {
+        loff_t size = i_size_read(inode);
+        if (iocb->ki_pos >= size || !iov_iter_count(to)) {
+            break;
+        }
+        mutex_lock(&ci->alloc_lock);
+        if (!bbfs_inode_inline(inode)) {
+            mutex_unlock(&ci->alloc_lock);
+            return ret ? ret : -ENOTBLK;
+        }
+        pagefault_disable();
+        size_t copied = copy_to_iter(ci->i_data + iocb->ki_pos, size - iocb->ki_pos, to);
+        pagefault_enable();
+        mutex_unlock(&ci->alloc_lock);
+        iocb->ki_pos += copied;
+        ret += copied;
+        size_t left = min_t(size_t, size - iocb->ki_pos, iov_iter_count(to));
+        if (!copied && fault_in_iov_iter_writeable(to, left) == left) {
+            return ret ? ret : -EFAULT;
+        }
+    }
+    file_accessed(iocb->ki_filp);
+    return ret;
+}
+
+static ssize_t bbfs_inline_write(struct kiocb *iocb, struct iov_iter *from) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+    ssize_t ret = 0;
+
+    while (iov_iter_count(from)) {
+        size_t count = iov_iter_count(from);
+        if (fault_in_iov_iter_readable(from, count) == count) {
+            ret = ret ? ret : -EFAULT;
+            break;
+        }
+        mutex_lock(&ci->alloc_lock);
+        if (!bbfs_inode_inline(inode)) {
+            mutex_unlock(&ci->alloc_lock);
+            ret = ret ? ret : -ENOTBLK;
+            break;
+        }
+        loff_t size = i_size_read(inode);
+        if (iocb->ki_pos > size) {
+            memset(ci->i_data + size, 0, iocb->ki_pos - size);
+        }
+        pagefault_disable();
+        size_t copied = copy_from_iter(ci->i_data + iocb->ki_pos, count, from);
+        pagefault_enable();
+        iocb->ki_pos += copied;
+        if (iocb->ki_pos > size) {
+            i_size_write(inode, iocb->ki_pos);
+        }
+        mutex_unlock(&ci->alloc_lock);
+        ret += copied;
+    }
+    if (ret > 0) {
+        invalidate_inode_pages2_range(inode->i_mapping, 0, 0);
+        mark_inode_dirty(inode);
+    }
+    return ret;
+}
+
+/* The inline bytes are authoritative until the flag is cleared, so the first folio is always refilled from them. */
+static int bbfs_inline_convert(struct inode *inode) {
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+    bool dirty = false;
+    int ret = 0;
+
+    struct folio *folio = filemap_grab_folio(inode->i_mapping, 0);
+    if (IS_ERR(folio)) {
+        return PTR_ERR(folio);
+    }
+    mutex_lock(&ci->alloc_lock);
+    if (bbfs_inode_inline(inode)) {
+        dirty = i_size_read(inode);
+        bbfs_inline_fill_folio(inode, folio);
+        /* The whole first block is dirtied, so nothing needs zeroing when it is allocated. */
+        ret = dirty ? bbfs_reserve_levels(inode, 0, 0) : 0;
+        if (!ret) {
+            ci->i_flags &= ~BBFS_INODE_INLINE;
+            kfree(ci->i_data);
+            ci->i_data = NULL;
+        }
+    }
+    mutex_unlock(&ci->alloc_lock);
+    if (!ret && dirty) {
+        folio_mark_dirty(folio);
+    }
+    folio_unlock(folio);
+    folio_put(folio);
+    mark_inode_dirty(inode);
+    return ret;
+}
+
+static int bbfs_read_folio(struct file *file, struct folio *folio) {
+    struct inode *inode = folio->mapping->host;
+
+    if (bbfs_inode_inline(inode)) {
+        bbfs_inline_fill_folio(inode, folio);
+        folio_unlock(folio);
+        return 0;
+    }
+    return iomap_read_folio(folio, &bbfs_iomap_ops);
+}
+
+static void bbfs_readahead(struct readahead_control *rac) {
+    if (!bbfs_inode_inline(rac->mapping->host)) {
+        iomap_readahead(rac, &bbfs_iomap_ops);
+    }
+}
 
 static int bbfs_writepages(struct address_space *mapping, struct writeback_control *wbc) {
-    return mpage_writepages(mapping, wbc, bbfs_file_get_block);
+    struct iomap_writepage_ctx wpc = {};
+    return iomap_writepages(mapping, wbc, &wpc, &bbfs_writeback_ops);
 }
 
-static int bbfs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned int len,
-                            struct page **pagep, void **fsdata) {
-    return block_write_begin(mapping, pos, len, pagep, bbfs_file_get_block);
+static sector_t bbfs_bmap(struct address_space *mapping, sector_t block) {
+    if (bbfs_inode_inline(mapping->host)) {
+        return 0;
+    }
+    return iomap_bmap(mapping, block, &bbfs_iomap_ops);
 }
 
-static int bbfs_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned int len,
-                          unsigned int copied, struct page *page, void *fsdata) {
-    struct inode *inode = file_inode(file);
+const struct address_space_operations bbfs_aops = {
+    .read_folio = bbfs_read_folio,
+    .readahead = bbfs_readahead,
+    .writepages = bbfs_writepages,
+    .dirty_folio = iomap_dirty_folio,
+    .release_folio = iomap_release_folio,
+    .invalidate_folio = iomap_invalidate_folio,
+    .migrate_folio = filemap_migrate_folio,
+    .is_partially_uptodate = iomap_is_partially_uptodate,
+    .direct_IO = noop_direct_IO,
+    .bmap = bbfs_bmap,
+};
+
+static int bbfs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error, unsigned int flags) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+
+    if (error) {
+        return error;
+    }
+    if (size && iocb->ki_pos + size > i_size_read(inode)) {
+        i_size_write(inode, iocb->ki_pos + size);
+        mark_inode_dirty(inode);
+    }
+    return 0;
+}
+
+static const struct iomap_dio_ops bbfs_dio_write_ops = {
+    .end_io = bbfs_dio_write_end_io,
+};
+
+static ssize_t bbfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    if (!(iocb->ki_flags & IOCB_DIRECT) && !bbfs_inode_inline(inode)) {
+        return generic_file_read_iter(iocb, to);
+    }
+    if (!iov_iter_count(to)) {
+        return 0;
+    }
+
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!inode_trylock_shared(inode)) {
+            return -EAGAIN;
+        }
+    } else {
+        inode_lock_shared(inode);
+    }
+    if (bbfs_inode_inline(inode)) {
+        ret = bbfs_inline_read(iocb, to);
+        if (ret != -ENOTBLK) {
+            inode_unlock_shared(inode);
+            return ret;
+        }
+    }
+    if (iocb->ki_flags & IOCB_DIRECT) {
+        ret = iomap_dio_rw(iocb, to, &bbfs_iomap_ops, NULL, 0, NULL, 0);
+        file_accessed(iocb->ki_filp);
+    } else {
+        inode_unlock_shared(inode);
+        return generic_file_read_iter(iocb, to);
+    }
+    inode_unlock_shared(inode);
+    return ret;
+}
+
+static ssize_t bbfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!inode_trylock(inode)) {
+            return -EAGAIN;
+        }
+    } else {
+        inode_lock(inode);
+    }
+
+    ret = generic_write_checks(iocb, from);
+    if (ret <= 0) {
+        goto out;
+    }
+    ret = file_remove_privs(iocb->ki_filp);
+    if (ret) {
+        goto out;
+    }
+    ret = file_update_time(iocb->ki_filp);
+    if (ret) {
+        goto out;
+    }
+
+    if (bbfs_inode_inline(inode)) {
+        if (iocb->ki_pos + iov_iter_count(from) <= bbfs_inline_max(inode->i_sb)) {
+            ret = bbfs_inline_write(iocb, from);
+            if (ret != -ENOTBLK) {
+                goto out;
+            }
+        } else if (iocb->ki_flags & IOCB_NOWAIT) {
+            ret = -EAGAIN;
+            goto out;
+        } else {
+            ret = bbfs_inline_convert(inode);
+            if (ret) {
+                goto out;
+            }
+        }
+    }
+
+    /* Like truncate, a write that starts past EOF zeroes the gap, which may hold data a shrink cut off. */
+    loff_t size = i_size_read(inode);
+    if (iocb->ki_pos > size) {
+        ret = iocb->ki_flags & IOCB_NOWAIT ? -EAGAIN
+                                           : iomap_zero_range(inode, size, iocb->ki_pos - size, NULL, &bbfs_iomap_ops);
+        if (ret) {
+            goto out;
+        }
+    }
+
+    if (iocb->ki_flags & IOCB_DIRECT) {
+        /* Extending and sub-block writes finish their size update or zeroing at completion, so wait for them. */
+        unsigned int blkmask = i_blocksize(inode) - 1;
+        bool wait = iocb->ki_pos + iov_iter_count(from) > i_size_read(inode) ||
+                    ((iocb->ki_pos | iov_iter_count(from)) & blkmask);
+        ret = iomap_dio_rw(iocb, from, &bbfs_iomap_ops, &bbfs_dio_write_ops, wait ? IOMAP_DIO_FORCE_WAIT : 0, NULL,
+                           0);
+        if (ret == -ENOTBLK) {
+            ret = iomap_file_buffered_write(iocb, from, &bbfs_iomap_ops);
+        }
+    } else {
+        ret = iomap_file_buffered_write(iocb, from, &bbfs_iomap_ops);
+    }
+out:
+    inode_unlock(inode);
+    if (ret > 0) {
+        ret = generic_write_sync(iocb, ret);
+    }
+    return ret;
+}
+
+/*
+ * Without a journal, write just the metadata this inode dirtied: the buffers associated with it (its overflow block,
+ * or a directory's blocks), the bitmap blocks covering levels it gained since the last fsync, the block holding its
+ * directory entry, and the inode itself unless only timestamps changed and this is fdatasync. Overwrites within
+ * allocated levels leave the inode clean, so they cost the data writes and a cache flush. With a journal all of that
+ * was logged, and fsync waits for the transaction that last touched the inode.
+ */
+int bbfs_fsync(struct file *file, loff_t start, loff_t end, int datasync) {
+    struct inode *inode = file->f_mapping->host;
+    struct super_block *sb = inode->i_sb;
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+
+    int ret = file_write_and_wait_range(file, start, end);
+    if (ret) {
+        return ret;
+    }
+    if (sbi->journal) {
+        bool flushed;
+        ret = bbfs_journal_fsync(inode, datasync, &flushed);
+        return ret || flushed ? ret : blkdev_issue_flush(sb->s_bdev);
+    }
+
+    ret = sync_mapping_buffers(inode->i_mapping);
+    mutex_lock(&ci->alloc_lock);
+    for (unsigned int l = ci->l_synced; !ret && l < ci->l_num; l++) {
+        if (ci->levels[l] != BBFS_LEVEL_HOLE) {
+            ret = bbfs_sync_bitmap_range(sb, true, ci->levels[l], bbfs_level_blocks(ci, l));
+        }
+    }
+    if (!ret && sbi->disk_sb.features & BBFS_FEAT_COMPACT_INODE && ci->l_num > BBFS_CINODE_LEVELS &&
+        ci->l_synced <= BBFS_CINODE_LEVELS) {
+        ret = bbfs_sync_bitmap_range(sb, true, ci->l_overflow, 1);
+    }
+    if (!ret) {
+        ci->l_synced = ci->l_num;
+    }
+    mutex_unlock(&ci->alloc_lock);
+
+    uint64_t dirent = xchg(&ci->i_dirent, 0);
+    if (!ret && dirent) {
+        ret = bbfs_sync_bitmap_range(sb, false, inode->i_ino, 1);
+        struct buffer_head *bh = sb_find_get_block(sb, dirent);
+        if (bh) {
+            if (!ret && buffer_dirty(bh)) {
+                ret = sync_dirty_buffer(bh);
+            }
+            brelse(bh);
+        }
+    }
+    if (!ret && inode->i_state & (datasync ? I_DIRTY_DATASYNC : I_DIRTY_INODE)) {
+        ret = sync_inode_metadata(inode, 1);
+    }
+    if (!ret) {
+        ret = blkdev_issue_flush(sb->s_bdev);
+    }
+    return ret;
+}
+
+/*
+ * Shrinking zeroes the rest of the new last block and hands back every level past EOF, along with the unused end of
+ * the last one on partial_tail file systems; the level it keeps still holds whatever was cut off. Growing zeroes the
+ * gap for that reason, skipping holes and unwritten levels. Either way any preallocation past EOF is given up. Called
+ * with i_rwsem held.
+ */
+int bbfs_truncate(struct inode *inode, loff_t size) {
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+    loff_t old = i_size_read(inode);
     int ret;
 
-    ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+    if (bbfs_inode_inline(inode) && size <= bbfs_inline_max(inode->i_sb)) {
+        mutex_lock(&ci->alloc_lock);
+        bool still_inline = bbfs_inode_inline(inode);
+        if (still_inline && size < old) {
+            memset(ci->i_data + size, 0, old - size);
+        }
+        mutex_unlock(&ci->alloc_lock);
+        if (still_inline) {
+            truncate_setsize(inode, size);
+            return 0;
+        }
+    }
+    if (bbfs_inode_inline(inode)) {
+        ret = bbfs_inline_convert(inode);
+        if (ret) {
+            return ret;
+        }
+    }
+    inode_dio_wait(inode);
+    /* Otherwise a large folio straddling the old tail could be locked by a write fault that has to grow it. */
+    if (size > old && bbfs_past_tail(ci, (size - 1) >> inode->i_blkbits)) {
+        ret = bbfs_grow_tail(inode);
+        if (ret) {
+            return ret;
+        }
+    }
+    if (size > old) {
+        ret = iomap_zero_range(inode, old, size - old, NULL, &bbfs_iomap_ops);
+    } else {
+        ret = iomap_truncate_page(inode, size, NULL, &bbfs_iomap_ops);
+    }
+    if (ret) {
+        return ret;
+    }
+    truncate_setsize(inode, size);
+    ci->i_flags &= ~BBFS_INODE_PREALLOC;
+    bbfs_trim_tail(inode);
+    return 0;
+}
+
+/*
+ * Allocate every level that [start, end) touches. With the unwritten feature the levels that had no delalloc data
+ * pending are flagged to read as zeros until something is written to them; otherwise they are zeroed below
+ * max(EOF, end).
+ */
+static int bbfs_prealloc(struct inode *inode, loff_t start, loff_t end) {
+    struct super_block *sb = inode->i_sb;
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+    unsigned long last_block = (end - 1) >> inode->i_blkbits;
+    int first = ilog2((start >> inode->i_blkbits) + 1), last = ilog2(last_block + 1);
+
+    if (last >= BBFS_MAX_LEVELS) {
+        return -EFBIG;
+    }
+    int ret = bbfs_past_tail(ci, last_block) ? bbfs_grow_tail(inode) : 0;
+    if (ret) {
+        return ret;
+    }
+    mutex_lock(&ci->alloc_lock);
+    unsigned long mask = 0;
+    for (int l = first; l <= last; l++) {
+        mask |= bbfs_missing_levels(inode, l);
+    }
+    mutex_unlock(&ci->alloc_lock);
+    return bbfs_alloc_levels(inode, mask, end, end, sbi->disk_sb.features & BBFS_FEAT_UNWRITTEN);
+}
+
+/*
+ * Zero [start, end) for ZERO_RANGE and PUNCH_HOLE. Levels that lie entirely inside the range are dropped from the page
+ * cache and either freed (punching on a sparse file system), flagged unwritten or zeroed on disk; the partial levels
+ * at either end are zeroed through the page cache.
+ */
+static int bbfs_zero_levels(struct inode *inode, loff_t start, loff_t end, bool punch) {
+    struct super_block *sb = inode->i_sb;
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+    unsigned int blkbits = inode->i_blkbits;
+    unsigned long first_block = (start + (1 << blkbits) - 1) >> blkbits, end_block = end >> blkbits;
+    int lo = ilog2(first_block + 1), hi = min(ilog2(end_block + 1) - 1, BBFS_MAX_LEVELS - 1);
+    loff_t size = i_size_read(inode);
+    int ret = 0;
+
+    if ((1ul << lo) - 1 < first_block) {
+        lo++;
+    }
+    loff_t zstart = end, zend = end;
+    if (lo <= hi) {
+        zstart = (loff_t)((1ul << lo) - 1) << blkbits;
+        zend = (loff_t)((1ul << (hi + 1)) - 1) << blkbits;
+    }
+    if (min(zstart, size) > start) {
+        ret = iomap_zero_range(inode, start, min(zstart, size) - start, NULL, &bbfs_iomap_ops);
+    }
+    if (!ret && min(end, size) > zend) {
+        ret = iomap_zero_range(inode, zend, min(end, size) - zend, NULL, &bbfs_iomap_ops);
+    }
+    if (ret || lo > hi) {
+        return ret;
+    }
 
-    struct timespec64 cur_time = current_time(inode);
-    inode_set_mtime_to_ts(inode, cur_time);
-    inode_set_ctime_to_ts(inode, cur_time);
+    ret = filemap_write_and_wait_range(inode->i_mapping, zstart, zend - 1);
+    if (ret) {
+        return ret;
+    }
+    truncate_pagecache_range(inode, zstart, zend - 1);
+    ret = bbfs_journal_start(sb);
+    if (ret) {
+        return ret;
+    }
+    mutex_lock(&ci->alloc_lock);
+    unsigned long dropped = ci->l_resv & GENMASK(hi, lo);
+    ci->l_resv &= ~dropped;
+    bbfs_release_blocks(sb, dropped);
+    for (int l = lo; l <= hi && l < ci->l_num && !ret; l++) {
+        if (!bbfs_level_mapped(ci, l) || ci->l_unwritten & (1u << l)) {
+            continue;
+        }
+        if (punch && sbi->disk_sb.features & BBFS_FEAT_SPARSE) {
+            bbfs_free_level(inode, l);
+            continue;
+        }
+        if (sbi->disk_sb.features & BBFS_FEAT_UNWRITTEN) {
+            ci->l_unwritten |= 1u << l;
+        } else {
+            ret = sb_issue_zeroout(sb, sbi->block_begin + ci->levels[l], bbfs_level_blocks(ci, l), GFP_NOFS);
+        }
+    }
+    mutex_unlock(&ci->alloc_lock);
     mark_inode_dirty(inode);
+    bbfs_journal_stop(sb);
+    return ret;
+}
+
+static long bbfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len) {
+    struct inode *inode = file_inode(file);
+    loff_t end = offset + len;
+    long ret;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        return -EOPNOTSUPP;
+    }
+    inode_lock(inode);
+    filemap_invalidate_lock(inode->i_mapping);
+    ret = mode & FALLOC_FL_KEEP_SIZE ? 0 : inode_newsize_ok(inode, end);
+    if (!ret) {
+        ret = file_modified(file);
+    }
+    if (!ret && bbfs_inode_inline(inode)) {
+        ret = bbfs_inline_convert(inode);
+    }
+    if (ret) {
+        goto out;
+    }
+    inode_dio_wait(inode);
 
+    /*
+     * Growing the file first means truncate only zeroes the gap in levels that are already there, and zeroing a
+     * range before allocating it skips the levels the preallocation is about to zero anyway.
+     */
+    loff_t size = i_size_read(inode);
+    bool grow = end > size && !(mode & (FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE));
+    if (grow) {
+        ret = bbfs_truncate(inode, end);
+    }
+    if (!ret && mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        ret = bbfs_zero_levels(inode, offset, end, mode & FALLOC_FL_PUNCH_HOLE);
+    }
+    if (!ret && !(mode & FALLOC_FL_PUNCH_HOLE)) {
+        ret = bbfs_prealloc(inode, offset, end);
+    }
+    if (ret && grow) {
+        bbfs_truncate(inode, size);
+    }
+    /* Preallocation past EOF has to survive the trimming done on close, so it is kept until the next truncate. */
+    if (!ret && end > size && (mode & (FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) == FALLOC_FL_KEEP_SIZE) {
+        BBFS_INODE(inode)->i_flags |= BBFS_INODE_PREALLOC;
+        mark_inode_dirty(inode);
+    }
+out:
+    filemap_invalidate_unlock(inode->i_mapping);
+    inode_unlock(inode);
     return ret;
 }
 
-const struct address_space_operations bbfs_aops = {
-    .writepages = bbfs_writepages,
-    .readahead = bbfs_readahead,
-    .write_begin = bbfs_write_begin,
-    .write_end = bbfs_write_end,
+/* Levels that were never allocated read as holes, so SEEK_HOLE and SEEK_DATA follow the iomap extents. */
+static loff_t bbfs_file_llseek(struct file *file, loff_t offset, int whence) {
+    struct inode *inode = file->f_mapping->host;
+
+    if ((whence != SEEK_HOLE && whence != SEEK_DATA) || bbfs_inode_inline(inode)) {
+        return generic_file_llseek(file, offset, whence);
+    }
+    inode_lock_shared(inode);
+    if (whence == SEEK_HOLE) {
+        offset = iomap_seek_hole(inode, offset, &bbfs_iomap_ops);
+    } else {
+        offset = iomap_seek_data(inode, offset, &bbfs_iomap_ops);
+    }
+    inode_unlock_shared(inode);
+    if (offset < 0) {
+        return offset;
+    }
+    return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+/*
+ * Writes through a mapping take the same route as buffered writes: the faulting level is reserved and left delalloc
+ * until writeback allocates it, and an unwritten level is converted on the first fault.
+ */
+static vm_fault_t bbfs_page_mkwrite(struct vm_fault *vmf) {
+    struct inode *inode = file_inode(vmf->vma->vm_file);
+
+    sb_start_pagefault(inode->i_sb);
+    file_update_time(vmf->vma->vm_file);
+    filemap_invalidate_lock_shared(inode->i_mapping);
+    vm_fault_t ret = iomap_page_mkwrite(vmf, &bbfs_iomap_ops);
+    filemap_invalidate_unlock_shared(inode->i_mapping);
+    sb_end_pagefault(inode->i_sb);
+    return ret;
+}
+
+static const struct vm_operations_struct bbfs_file_vm_ops = {
+    .fault = filemap_fault,
+    .map_pages = filemap_map_pages,
+    .page_mkwrite = bbfs_page_mkwrite,
 };
 
+/* A shared writable mapping would dirty the page cache behind the inline copy's back, so such files convert first. */
+static int bbfs_file_mmap(struct file *file, struct vm_area_struct *vma) {
+    struct inode *inode = file_inode(file);
+
+    if (bbfs_inode_inline(inode) && vma->vm_flags & VM_SHARED && vma->vm_flags & VM_MAYWRITE) {
+        int ret = bbfs_inline_convert(inode);
+        if (ret) {
+            return ret;
+        }
+    }
+    file_accessed(file);
+    vma->vm_ops = &bbfs_file_vm_ops;
+    return 0;
+}
+
+static int bbfs_file_open(struct inode *inode, struct file *file) {
+    file->f_mode |= FMODE_NOWAIT | FMODE_CAN_ODIRECT;
+    return generic_file_open(inode, file);
+}
+
+static int bbfs_file_release(struct inode *inode, struct file *file) {
+    if (file->f_mode & FMODE_WRITE && atomic_read(&inode->i_writecount) == 1) {
+        inode_lock(inode);
+        bbfs_trim_tail(inode);
+        inode_unlock(inode);
+    }
+    return 0;
+}
+
+/* Shared by files and directories, since FITRIM may be issued on either. */
+long bbfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    struct super_block *sb = file_inode(file)->i_sb;
+    struct fstrim_range __user *user_range = (struct fstrim_range __user *)arg;
+    struct fstrim_range range;
+
+    if (cmd != FITRIM) {
+        return -ENOTTY;
+    }
+    if (!capable(CAP_SYS_ADMIN)) {
+        return -EPERM;
+    }
+    if (!bdev_max_discard_sectors(sb->s_bdev)) {
+        return -EOPNOTSUPP;
+    }
+    if (copy_from_user(&range, user_range, sizeof(range))) {
+        return -EFAULT;
+    }
+    int ret = bbfs_trim_fs(sb, &range);
+    if (ret) {
+        return ret;
+    }
+    if (copy_to_user(user_range, &range, sizeof(range))) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
 const struct file_operations bbfs_file_ops = {
-    .llseek = generic_file_llseek,
+    .llseek = bbfs_file_llseek,
     .owner = THIS_MODULE,
-    .read_iter = generic_file_read_iter,
-    .write_iter = generic_file_write_iter,
-    .fsync = generic_file_fsync,
+    .open = bbfs_file_open,
+    .release = bbfs_file_release,
+    .read_iter = bbfs_file_read_iter,
+    .write_iter = bbfs_file_write_iter,
+    .mmap = bbfs_file_mmap,
+    .fsync = bbfs_fsync,
+    .fallocate = bbfs_fallocate,
+    .unlocked_ioctl = bbfs_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .splice_read = filemap_splice_read,
+    .splice_write = iter_file_splice_write,
 };
@@ -2,9 +2,48 @@
 #define _FS_H
 
 #define BBFS_MAGIC 0x53464242
+#define BBFS_BLOCK_SIZE 4096
 #define MAX_BBFS_FILESIZE MAX_LFS_FILESIZE
-#define MAX_LEVEL 1005
+#define MAX_LEVEL 970
 #define MAX_SYMLINK_LEN 4024
+#define MAX_INLINE_LEN 4024
+
+#define BBFS_FEAT_PACKED_BITMAP 0x1
+#define BBFS_FEAT_DIR_INDEX 0x2
+#define BBFS_FEAT_PACKED_DIRENT 0x4
+#define BBFS_FEAT_INLINE_DATA 0x8
+#define BBFS_FEAT_COMPACT_INODE 0x10
+#define BBFS_FEAT_JOURNAL 0x20
+#define BBFS_FEAT_PARTIAL_TAIL 0x40
+#define BBFS_FEAT_SPARSE 0x80
+#define BBFS_FEAT_UNWRITTEN 0x100
+#define BBFS_FEAT_64BIT 0x200
+#define BBFS_FEAT_LAZY_ITABLE 0x400
+#define BBFS_FEAT_ALL                                                                                                  \
+    (BBFS_FEAT_PACKED_BITMAP | BBFS_FEAT_DIR_INDEX | BBFS_FEAT_PACKED_DIRENT | BBFS_FEAT_INLINE_DATA |                 \
+     BBFS_FEAT_COMPACT_INODE | BBFS_FEAT_JOURNAL | BBFS_FEAT_PARTIAL_TAIL | BBFS_FEAT_SPARSE |                         \
+     BBFS_FEAT_UNWRITTEN | BBFS_FEAT_64BIT | BBFS_FEAT_LAZY_ITABLE)
+
+#define BBFS_INODE_VALID 0x1
+#define BBFS_INODE_INLINE 0x2
+/* Set by fallocate with KEEP_SIZE past EOF, so that the preallocation survives until the next truncate. */
+#define BBFS_INODE_PREALLOC 0x4
+
+/*
+ * With the sparse feature, a file's level slot may hold this instead of a block number until it is written. On disk
+ * it is all ones in both halves of a 64bit slot, or in the single 32-bit word otherwise.
+ */
+#define BBFS_LEVEL_HOLE (~(uint64_t)0)
+
+#define BBFS_MAX_LEVELS 32
+#define BBFS_CINODE_LEVELS 16
+#define BBFS_CINODE_INLINE 176
+#define BBFS_INODES_PER_BLOCK 16
+
+#define BBFS_ITABLE_MAX_REGIONS 8192
+
+#define BBFS_DX_MAGIC 0x58444242
+#define BBFS_DX_MAX_DEPTH 1
 
 struct bbfs_sb {
     uint32_t magic;
@@ -13,11 +52,26 @@ struct bbfs_sb {
     uint32_t nr_bmap;
     uint32_t nr_inodes;
     uint32_t nr_blocks;
-    char padding[4072];
+    uint32_t features;
+    uint32_t nr_groups;
+    uint32_t group_inodes;
+    uint32_t group_blocks;
+    uint32_t nr_journal;
+    /* With 64bit, the upper halves of nr_inodes and nr_blocks. */
+    uint32_t nr_inodes_hi;
+    uint32_t nr_blocks_hi;
+    /*
+     * With lazy_itable, the inode table is split into itable_regions regions of itable_region_blocks blocks each, and
+     * a set bit in itable_uninit marks a region that mkfs did not zero.
+     */
+    uint32_t itable_region_blocks;
+    uint32_t itable_regions;
+    uint32_t itable_uninit[BBFS_ITABLE_MAX_REGIONS / 32];
+    char padding[3012];
 };
 
 struct bbfs_inode {
-    uint32_t valid;
+    uint32_t i_flags;
     uint32_t i_mode;
     uint32_t i_uid;
     uint32_t i_gid;
@@ -33,8 +87,51 @@ struct bbfs_inode {
         struct {
             uint32_t l_num;
             uint32_t levels[MAX_LEVEL];
+            uint32_t l_tail;
+            uint32_t l_unwritten;
+            uint32_t levels_hi[BBFS_MAX_LEVELS];
+            uint32_t i_size_hi;
         };
         char i_link[MAX_SYMLINK_LEN];
+        char i_data[MAX_INLINE_LEN];
+    };
+};
+
+/*
+ * Compact inodes are 256 bytes, 16 to a block. Everything up to l_num matches struct bbfs_inode. Levels beyond the
+ * first BBFS_CINODE_LEVELS continue in the l_overflow block, which also holds symlink targets too long for i_data.
+ * With partial_tail, a non-zero l_tail in either format is the number of blocks the last level still holds. With
+ * unwritten, l_unwritten is the mask of levels that were preallocated or zeroed and not written since; they read as
+ * zeros whatever their blocks hold, and the first write zeroes what it does not cover. With 64bit, levels_hi and
+ * i_size_hi hold the upper halves of the level slots and of i_size; only files with levels can outgrow 32 bits, so
+ * inline data never needs them. The overflow block keeps the upper halves of its slots right after the lower ones, and
+ * l_overflow_hi locates the block itself.
+ */
+struct bbfs_cinode {
+    uint32_t i_flags;
+    uint32_t i_mode;
+    uint32_t i_uid;
+    uint32_t i_gid;
+    uint32_t i_size;
+    uint32_t i_nlink;
+    uint64_t i_ctime_sec;
+    uint64_t i_ctime_nsec;
+    uint64_t i_atime_sec;
+    uint64_t i_atime_nsec;
+    uint64_t i_mtime_sec;
+    uint64_t i_mtime_nsec;
+    uint32_t l_num;
+    uint32_t l_overflow;
+    union {
+        struct {
+            uint32_t levels[BBFS_CINODE_LEVELS];
+            uint32_t l_tail;
+            uint32_t l_unwritten;
+            uint32_t levels_hi[BBFS_CINODE_LEVELS];
+            uint32_t i_size_hi;
+            uint32_t l_overflow_hi;
+        };
+        char i_data[BBFS_CINODE_INLINE];
     };
 };
 
@@ -54,20 +151,154 @@ struct bbfs_entry {
     char padding[244];
 };
 
+/*
+ * Packed directory records chain through rec_len and always cover the whole block. A record with name_len 0 is
+ * free space; a live record may carry slack after its name, which the next insert can split off.
+ */
+struct bbfs_dirent {
+    uint16_t rec_len;
+    uint8_t name_len;
+    uint8_t type;
+    uint32_t ino;
+    char name[];
+};
+
+#define BBFS_DIRENT_LEN(len) ((sizeof(struct bbfs_dirent) + (len) + 3) & ~3u)
+
+struct bbfs_dx_entry {
+    uint32_t hash;
+    uint32_t block;
+};
+
+struct bbfs_dx_node {
+    uint32_t magic;
+    uint32_t depth;
+    uint32_t count;
+    uint32_t next_block;
+    struct bbfs_dx_entry entries[510];
+};
+
+#define BBFS_JOURNAL_MAGIC 0x4a464242
+
+enum {
+    BBFS_JBLOCK_DESC = 1,
+    BBFS_JBLOCK_OPS,
+    BBFS_JBLOCK_REVOKE,
+    BBFS_JBLOCK_COMMIT,
+};
+
+/* Bitmap updates are journaled as operations rather than as copies of the bitmap blocks. */
+#define BBFS_JOP_BLOCKS 0x1
+#define BBFS_JOP_SET 0x2
+
+/*
+ * The journal starts with this block and is followed by a log that is rewritten from its second block after every
+ * checkpoint. A transaction is any number of descriptor blocks, each followed by copies of the blocks it tags, then
+ * op and revoke blocks, then a commit block carrying the crc32 of everything before it.
+ */
+struct bbfs_journal_sb {
+    uint32_t magic;
+    uint32_t nr_blocks;
+    uint64_t seq;
+    char padding[4080];
+};
+
+struct bbfs_journal_header {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t seq;
+    uint32_t count;
+    uint32_t crc;
+};
+
+struct bbfs_journal_op {
+    uint64_t start;
+    uint32_t count;
+    uint32_t type;
+};
+
+#define BBFS_JOURNAL_TAGS 509
+#define BBFS_JOURNAL_OPS 254
+
+struct bbfs_journal_block {
+    struct bbfs_journal_header h;
+    union {
+        uint64_t blocks[BBFS_JOURNAL_TAGS];
+        struct bbfs_journal_op ops[BBFS_JOURNAL_OPS];
+    };
+};
+
+static inline uint32_t bbfs_name_hash(const char *name, unsigned int len) {
+    uint32_t hash = 2166136261u;
+    for (unsigned int i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    hash = (hash ^ (hash >> 16)) * 0x85ebca6bu;
+    hash = (hash ^ (hash >> 13)) * 0xc2b2ae35u;
+    return hash ^ (hash >> 16);
+}
+
 #ifdef __LINUX_KERNEL__
+struct bbfs_group {
+    spinlock_t lock;
+    unsigned long ino_start, nr_inodes, free_inodes, i_next;
+    unsigned long blk_start, nr_blocks, free_blocks;
+    struct bbfs_buddy *buddy;
+};
+
+struct bbfs_journal;
+
+#define BBFS_MOUNT_DISCARD 0x1
+
 struct bbfs_sb_info {
     struct bbfs_sb disk_sb;
     uint64_t sb_begin, sb_end;
+    uint64_t journal_begin, journal_end;
     uint64_t imap_begin, imap_end;
     uint64_t bmap_begin, bmap_end;
     uint64_t inode_begin, inode_end;
     uint64_t block_begin, block_end;
-    char *i_map;
-    char *d_map;
+    unsigned long *i_map;
+    unsigned long *i_dirty;
+    unsigned long *d_map;
+    unsigned long *d_dirty;
+    unsigned long nr_inodes, nr_blocks;
+    unsigned long nr_groups, group_inodes, group_blocks;
+    struct bbfs_group *groups;
+    spinlock_t resv_lock;
+    unsigned long resv_blocks;
+    struct bbfs_journal *journal;
+    struct super_block *sb;
+    unsigned int mount_opts;
+    /* Busy extents: freed by the running transaction, and with discard committed ones waiting for the worker. */
+    spinlock_t discard_lock;
+    struct list_head discard_running, discard_ready;
+    struct work_struct discard_work;
+    /* With lazy_itable: inodes per inode table region, and the lock ordering region zeroing and superblock writes. */
+    unsigned long itable_region_inodes;
+    struct mutex itable_lock;
+    struct task_struct *itable_thread;
 };
 
 struct bbfs_inode_info {
-    struct bbfs_inode disk_inode;
+    uint32_t i_flags;
+    uint32_t l_num;
+    uint64_t l_overflow;
+    uint32_t l_resv;
+    /* Reserved levels with blocks below EOF that nothing in the page cache covers, to be zeroed when allocated. */
+    uint32_t l_resv_zero;
+    uint32_t l_tail;
+    uint32_t l_unwritten;
+    uint64_t levels[BBFS_MAX_LEVELS];
+    char *i_data;
+    struct mutex alloc_lock;
+    /* Held, outside alloc_lock, by the write that zeroes an unwritten level before clearing its bit. */
+    struct mutex convert_lock;
+    /* What fsync has to write: levels whose bitmap bits may not be on disk yet, and the block with the new dirent. */
+    uint32_t l_synced;
+    uint64_t i_dirent;
+    /* With a journal, the last transactions that logged this inode's metadata, and its size or block mapping. */
+    uint64_t i_trans, i_datasync_trans;
     struct inode vfs_inode;
 };
 
@@ -76,7 +307,65 @@ int bbfs_fill_super(struct super_block *sb, void *data, int silent);
 int bbfs_init_inode_cache(void);
 void bbfs_destroy_inode_cache(void);
 struct inode *bbfs_iget(struct super_block *sb, unsigned long ino);
-unsigned long bbfs_find_and_mark_free_block(struct super_block *sb, int level);
+int bbfs_write_inode(struct inode *inode, struct writeback_control *wbc);
+void bbfs_dirty_inode(struct inode *inode, int flags);
+unsigned int bbfs_inline_max(struct super_block *sb);
+int bbfs_add_level(struct inode *inode, unsigned int level, unsigned long blk_start);
+void bbfs_release_levels(struct inode *inode, int keep);
+void bbfs_trim_tail(struct inode *inode);
+void bbfs_free_level(struct inode *inode, unsigned int level);
+
+int bbfs_load_bitmaps(struct super_block *sb);
+int bbfs_sync_bitmaps(struct super_block *sb, int wait);
+void bbfs_destroy_bitmaps(struct bbfs_sb_info *sbi);
+unsigned long bbfs_find_and_mark_free_inode(struct inode *dir, umode_t mode);
+void bbfs_free_ino(struct super_block *sb, unsigned long ino);
+unsigned long bbfs_find_and_mark_free_block(struct inode *inode, int level);
+unsigned long bbfs_hold_free_block(struct inode *inode, int level);
+void bbfs_mark_held_blocks(struct super_block *sb, unsigned long blk_start, unsigned long nr);
+void bbfs_put_held_blocks(struct super_block *sb, unsigned long blk_start, unsigned long nr);
+void bbfs_free_block(struct super_block *sb, unsigned long blk_start, int level);
+void bbfs_free_blocks(struct super_block *sb, unsigned long blk_start, unsigned long nr);
+bool bbfs_claim_blocks(struct super_block *sb, unsigned long blk_start, unsigned long nr);
+int bbfs_reserve_blocks(struct super_block *sb, unsigned long nr);
+void bbfs_release_blocks(struct super_block *sb, unsigned long nr);
+bool bbfs_commit_busy(struct super_block *sb);
+int bbfs_sync_bitmap_range(struct super_block *sb, bool blocks, unsigned long start, unsigned long nr);
+int bbfs_replay_map(struct super_block *sb, const struct bbfs_journal_op *op);
+void bbfs_init_discard(struct bbfs_sb_info *sbi);
+void bbfs_queue_discards(struct super_block *sb, struct list_head *list, bool committed);
+void bbfs_flush_discards(struct bbfs_sb_info *sbi);
+int bbfs_trim_fs(struct super_block *sb, struct fstrim_range *range);
+
+int bbfs_itable_init_region(struct super_block *sb, unsigned long region);
+int bbfs_itable_init_any(struct super_block *sb);
+struct buffer_head *bbfs_itable_zero_block(struct super_block *sb, uint64_t blk);
+int bbfs_itable_start(struct super_block *sb);
+void bbfs_itable_stop(struct super_block *sb);
+
+int bbfs_journal_load(struct super_block *sb);
+int bbfs_journal_replay_maps(struct super_block *sb);
+int bbfs_journal_finish_load(struct super_block *sb);
+void bbfs_journal_destroy(struct super_block *sb);
+int bbfs_journal_start(struct super_block *sb);
+void bbfs_journal_stop(struct super_block *sb);
+int bbfs_journal_commit(struct super_block *sb);
+int bbfs_journal_fsync(struct inode *inode, int datasync, bool *flushed);
+void bbfs_journal_dirty(struct super_block *sb, struct buffer_head *bh, struct inode *owner);
+void bbfs_journal_inode(struct inode *inode, bool datasync);
+void bbfs_journal_log(struct bbfs_sb_info *sbi, unsigned int type, uint64_t start, unsigned long count);
+void bbfs_journal_forget(struct super_block *sb, uint64_t blk, unsigned long nr);
+
+int bbfs_find_entry(struct inode *dir, const struct qstr *name, unsigned long *ino);
+int bbfs_add_entry(struct inode *dir, const struct qstr *name, struct inode *inode);
+int bbfs_delete_entry(struct inode *dir, const struct qstr *name);
+int bbfs_replace_entry(struct inode *dir, const struct qstr *name, struct inode *inode);
+bool bbfs_empty_dir(struct inode *dir);
+
+void bbfs_release_reservation(struct inode *inode);
+int bbfs_truncate(struct inode *inode, loff_t size);
+int bbfs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+long bbfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
 
 extern const struct file_operations bbfs_file_ops;
 extern const struct file_operations bbfs_dir_ops;
@@ -84,6 +373,20 @@ extern const struct address_space_operations bbfs_aops;
 
 #define BBFS_SB(sb) (sb->s_fs_info)
 #define BBFS_INODE(inode) (container_of(inode, struct bbfs_inode_info, vfs_inode))
+
+/* A trimmed last level only holds its first l_tail blocks. */
+static inline unsigned long bbfs_level_blocks(struct bbfs_inode_info *ci, unsigned int l) {
+    return l + 1 == ci->l_num && ci->l_tail ? ci->l_tail : 1ul << l;
+}
+
+static inline bool bbfs_itable_region_uninit(struct bbfs_sb_info *sbi, unsigned long region) {
+    return READ_ONCE(sbi->disk_sb.itable_uninit[region / 32]) & (1u << (region % 32));
+}
+
+/* Whether ino lies in a region of the inode table that has not been zeroed yet. */
+static inline bool bbfs_ino_uninit(struct bbfs_sb_info *sbi, unsigned long ino) {
+    return sbi->itable_region_inodes && bbfs_itable_region_uninit(sbi, ino / sbi->itable_region_inodes);
+}
 #endif
 
 #endif
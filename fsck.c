@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/stat.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libbbfs.h"
+#include "disk.h"
+
+/* The usual fsck exit codes, so that fsck(8) and boot scripts can tell the outcomes apart. */
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+#define MAX_THREADS 16
+/* Inodes handed to a worker at a time. */
+#define CHUNK 1024
+
+enum {
+    INO_FREE,
+    INO_USED,
+    INO_BAD,
+};
+
+struct extent {
+    uint64_t start, nr;
+};
+
+static struct {
+    struct bbfs_img img;
+    int repair;
+    int compact, is64, packed_map, packed_dirent;
+    /* What the scan found: the state of each inode, the entries naming it, and each directory's subdirectories. */
+    uint8_t *state;
+    uint32_t *refs, *subdirs;
+    uint64_t *used;
+    unsigned long next;
+    unsigned long fixed, uncorrected;
+    pthread_mutex_t out_lock;
+} fs = {.out_lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void report(int fixable, const char *fmt, ...) {
+    va_list ap;
+
+    pthread_mutex_lock(&fs.out_lock);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    if (fixable && fs.repair) {
+        printf(", fixed\n");
+        fs.fixed++;
+    } else {
+        printf("\n");
+        fs.uncorrected++;
+    }
+    pthread_mutex_unlock(&fs.out_lock);
+}
+
+/* Set or clear [start, start + nr) in the rebuilt block map. Returns how many blocks were already in that state. */
+static uint64_t mark_used(uint64_t start, uint64_t nr, int set) {
+    uint64_t overlap = 0;
+    for (uint64_t i = start; i < start + nr;) {
+        uint64_t bits = 64 - i % 64 < start + nr - i ? 64 - i % 64 : start + nr - i;
+        uint64_t mask = (bits == 64 ? ~0ull : (1ull << bits) - 1) << (i % 64);
+        uint64_t old = set ? __atomic_fetch_or(&fs.used[i / 64], mask, __ATOMIC_RELAXED)
+                           : __atomic_fetch_and(&fs.used[i / 64], ~mask, __ATOMIC_RELAXED);
+        overlap += __builtin_popcountll((set ? old : ~old) & mask);
+        i += bits;
+    }
+    return overlap;
+}
+
+static uint64_t get_level(const uint32_t *lo, const uint32_t *hi, unsigned int i) {
+    if (hi) {
+        return (uint64_t)hi[i] << 32 | lo[i];
+    }
+    return lo[i] == UINT32_MAX ? BBFS_LEVEL_HOLE : lo[i];
+}
+
+/*
+ * Collect the blocks an inode owns, the way bbfs_iget would read them, into ext. Level l covers (1 << l) blocks, the
+ * last one l_tail instead if set. Returns the number of extents, or -1 with why set if the inode cannot be valid.
+ */
+static int inode_extents(void *raw, struct extent *ext, uint64_t *levels, uint32_t *l_num, const char **why) {
+    struct bbfs_inode *di = raw;
+    struct bbfs_cinode *ci = raw;
+    uint32_t mode = di->i_mode & S_IFMT;
+    int nr = 0;
+
+    *l_num = 0;
+    if (mode != S_IFREG && mode != S_IFDIR && mode != S_IFLNK) {
+        *why = "bad mode";
+        return -1;
+    }
+    uint64_t overflow = fs.compact ? ci->l_overflow | (fs.is64 ? (uint64_t)ci->l_overflow_hi << 32 : 0) : 0;
+    if (mode == S_IFLNK || di->i_flags & BBFS_INODE_INLINE) {
+        uint32_t max = mode == S_IFLNK ? MAX_SYMLINK_LEN - 1 : fs.compact ? BBFS_CINODE_INLINE : MAX_INLINE_LEN;
+        if (mode == S_IFDIR || di->i_size > max) {
+            *why = "bad inline data";
+            return -1;
+        }
+        if (fs.compact && di->i_size > BBFS_CINODE_INLINE) {
+            if (overflow >= fs.img.layout.nr_blocks) {
+                *why = "bad overflow block";
+                return -1;
+            }
+            ext[nr++] = (struct extent){overflow, 1};
+        }
+    } else {
+        uint32_t num = fs.compact ? ci->l_num : di->l_num;
+        uint32_t tail = fs.compact ? ci->l_tail : di->l_tail;
+        if (num > BBFS_MAX_LEVELS || (tail && (!num || tail >= 1ul << (num - 1)))) {
+            *why = "bad level count";
+            return -1;
+        }
+        if (fs.compact && num > BBFS_CINODE_LEVELS) {
+            if (overflow >= fs.img.layout.nr_blocks) {
+                *why = "bad overflow block";
+                return -1;
+            }
+            ext[nr++] = (struct extent){overflow, 1};
+        }
+        for (uint32_t l = 0; l < num; l++) {
+            const uint32_t *lo = fs.compact ? ci->levels : di->levels;
+            const uint32_t *hi = !fs.is64 ? NULL : fs.compact ? ci->levels_hi : di->levels_hi;
+            unsigned int i = l;
+            if (l >= BBFS_CINODE_LEVELS && fs.compact) {
+                lo = (uint32_t *)bbfs_img_block(&fs.img, fs.img.layout.block_begin + overflow);
+                hi = fs.is64 ? lo + BBFS_CINODE_LEVELS : NULL;
+                i = l - BBFS_CINODE_LEVELS;
+            }
+            levels[l] = get_level(lo, hi, i);
+            if (levels[l] == BBFS_LEVEL_HOLE) {
+                if (mode == S_IFDIR) {
+                    *why = "hole in a directory";
+                    return -1;
+                }
+                continue;
+            }
+            uint64_t n = l + 1 == num && tail ? tail : 1ull << l;
+            if (levels[l] >= fs.img.layout.nr_blocks || n > fs.img.layout.nr_blocks - levels[l]) {
+                *why = "level out of range";
+                return -1;
+            }
+            ext[nr++] = (struct extent){levels[l], n};
+        }
+        if (mode == S_IFDIR && tail) {
+            *why = "partial directory level";
+            return -1;
+        }
+        *l_num = num;
+    }
+    return nr;
+}
+
+static int next_chunk(unsigned long *start, unsigned long *end) {
+    *start = __atomic_fetch_add(&fs.next, CHUNK, __ATOMIC_RELAXED);
+    if (*start >= fs.img.layout.nr_inodes) {
+        return 0;
+    }
+    *end = *start + CHUNK < fs.img.layout.nr_inodes ? *start + CHUNK : fs.img.layout.nr_inodes;
+    return 1;
+}
+
+/* Pass 1: decide which inodes are in use and build the block map from what they own. */
+static void *scan_inodes(void *arg) {
+    struct extent ext[BBFS_MAX_LEVELS + 1];
+    uint64_t levels[BBFS_MAX_LEVELS];
+    uint32_t l_num;
+    unsigned long start, end;
+
+    while (next_chunk(&start, &end)) {
+        for (unsigned long ino = start; ino < end; ino++) {
+            struct bbfs_inode *di = bbfs_img_inode_raw(&fs.img, ino);
+            if (bbfs_img_ino_uninit(&fs.img, ino) || !(di->i_flags & BBFS_INODE_VALID)) {
+                continue;
+            }
+            const char *why;
+            int nr = inode_extents(di, ext, levels, &l_num, &why);
+            if (nr < 0) {
+                fs.state[ino] = INO_BAD;
+                report(1, "inode %lu: %s%s", ino, why, fs.repair ? ", clearing it" : "");
+                continue;
+            }
+            fs.state[ino] = INO_USED;
+            for (int i = 0; i < nr; i++) {
+                uint64_t dup = mark_used(ext[i].start, ext[i].nr, 1);
+                if (dup) {
+                    report(0, "inode %lu: %llu of the blocks from %llu also belong to another inode", ino,
+                           (unsigned long long)dup, (unsigned long long)ext[i].start);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+static unsigned int mode_dtype(uint32_t mode) { return (mode & S_IFMT) >> 12; }
+
+static void check_dir_block(unsigned long dir, char *data, uint32_t *subdirs) {
+    struct bbfs_dir_rec rec;
+    int off;
+
+    for (off = 0; bbfs_dir_rec(fs.packed_dirent, data, off, &rec); off = rec.next) {
+        if (!rec.len) {
+            continue;
+        }
+        if (rec.ino >= fs.img.layout.nr_inodes || fs.state[rec.ino] != INO_USED) {
+            report(1, "directory %lu: entry '%.*s' points to free inode %u%s", dir, rec.len, rec.name, rec.ino,
+                   fs.repair ? ", removing it" : "");
+            if (fs.repair && fs.packed_dirent) {
+                ((struct bbfs_dirent *)(data + off))->name_len = 0;
+            } else if (fs.repair) {
+                ((struct bbfs_entry *)(data + off))->valid = 0;
+            }
+            continue;
+        }
+        uint32_t mode = ((struct bbfs_inode *)bbfs_img_inode_raw(&fs.img, rec.ino))->i_mode;
+        if (rec.type != mode_dtype(mode)) {
+            report(1, "directory %lu: entry '%.*s' has type %u instead of %u", dir, rec.len, rec.name, rec.type,
+                   mode_dtype(mode));
+            if (fs.repair && fs.packed_dirent) {
+                ((struct bbfs_dirent *)(data + off))->type = mode_dtype(mode);
+            } else if (fs.repair) {
+                ((struct bbfs_entry *)(data + off))->type = mode_dtype(mode);
+            }
+        }
+        __atomic_fetch_add(&fs.refs[rec.ino], 1, __ATOMIC_RELAXED);
+        if (S_ISDIR(mode)) {
+            (*subdirs)++;
+        }
+    }
+    if (off < (int)BBFS_BLOCK_SIZE) {
+        report(0, "directory %lu: corrupt record at offset %d of block %llu", dir, off,
+               (unsigned long long)((data - fs.img.map) / BBFS_BLOCK_SIZE));
+    }
+}
+
+/* Pass 2: walk every directory's entries, counting the links to each inode. Index nodes carry no entries. */
+static void *scan_dirs(void *arg) {
+    struct extent ext[BBFS_MAX_LEVELS + 1];
+    uint64_t levels[BBFS_MAX_LEVELS];
+    uint32_t l_num;
+    unsigned long start, end;
+    const char *why;
+
+    while (next_chunk(&start, &end)) {
+        for (unsigned long ino = start; ino < end; ino++) {
+            struct bbfs_inode *di = bbfs_img_inode_raw(&fs.img, ino);
+            if (fs.state[ino] != INO_USED || !S_ISDIR(di->i_mode)) {
+                continue;
+            }
+            inode_extents(di, ext, levels, &l_num, &why);
+            uint32_t subdirs = 0;
+            for (uint32_t l = 0; l < l_num; l++) {
+                for (uint64_t i = 0; i < 1ull << l; i++) {
+                    char *data = bbfs_img_block(&fs.img, fs.img.layout.block_begin + levels[l] + i);
+                    if (((struct bbfs_dx_node *)data)->magic != BBFS_DX_MAGIC) {
+                        check_dir_block(ino, data, &subdirs);
+                    }
+                }
+            }
+            fs.subdirs[ino] = subdirs;
+        }
+    }
+    return NULL;
+}
+
+static void run_workers(void *(*fn)(void *), long nr_threads) {
+    pthread_t threads[MAX_THREADS];
+    long started;
+
+    fs.next = 0;
+    for (started = 0; started < nr_threads; started++) {
+        if (pthread_create(&threads[started], NULL, fn, NULL)) {
+            break;
+        }
+    }
+    /* Whatever a failed thread creation left over is done here. */
+    if (!started) {
+        fn(NULL);
+    }
+    for (long i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Put the links found back into i_nlink, and deal with inodes no directory names. */
+static void check_links(void) {
+    struct extent ext[BBFS_MAX_LEVELS + 1];
+    uint64_t levels[BBFS_MAX_LEVELS];
+    uint32_t l_num;
+    const char *why;
+
+    for (uint64_t ino = 0; ino < fs.img.layout.nr_inodes; ino++) {
+        struct bbfs_inode *di = bbfs_img_inode_raw(&fs.img, ino);
+        if (fs.state[ino] == INO_BAD) {
+            if (fs.repair) {
+                di->i_flags = 0;
+            }
+            continue;
+        }
+        if (fs.state[ino] != INO_USED) {
+            continue;
+        }
+        int dir = S_ISDIR(di->i_mode);
+        if (ino && !fs.refs[ino] && !di->i_nlink) {
+            /* Unlinked while open and never evicted: free it, as the last iput would have. */
+            report(1, "inode %llu: unlinked but not freed%s", (unsigned long long)ino,
+                   fs.repair ? ", releasing it" : "");
+            if (fs.repair) {
+                int nr = inode_extents(di, ext, levels, &l_num, &why);
+                for (int i = 0; i < nr; i++) {
+                    mark_used(ext[i].start, ext[i].nr, 0);
+                }
+                di->i_flags = 0;
+                fs.state[ino] = INO_FREE;
+            }
+            continue;
+        }
+        if (ino && !fs.refs[ino]) {
+            report(0, "inode %llu: orphan %s with %u links, not in any directory", (unsigned long long)ino,
+                   dir ? "directory" : "file", di->i_nlink);
+            continue;
+        }
+        if (dir && fs.refs[ino] > (ino ? 1 : 0)) {
+            report(0, "inode %llu: directory with %u entries", (unsigned long long)ino, fs.refs[ino]);
+        }
+        uint32_t nlink = dir ? 2 + fs.subdirs[ino] : fs.refs[ino];
+        if (di->i_nlink != nlink) {
+            report(1, "inode %llu: link count %u, should be %u", (unsigned long long)ino, di->i_nlink, nlink);
+            if (fs.repair) {
+                di->i_nlink = nlink;
+            }
+        }
+    }
+}
+
+/* Compare an on-disk bitmap with the one the scan produced, and rewrite it if asked to. */
+static void check_map(const char *name, uint64_t begin, uint64_t nr, int (*expect)(uint64_t)) {
+    uint64_t wrong = 0, first = 0;
+
+    for (uint64_t i = 0; i < nr; i++) {
+        int val = expect(i);
+        if (bbfs_img_test_map(&fs.img, begin, i) == val) {
+            continue;
+        }
+        if (!wrong++) {
+            first = i;
+        }
+        if (fs.repair) {
+            bbfs_img_set_map(&fs.img, begin, i, val);
+        }
+    }
+    if (wrong) {
+        report(1, "%s bitmap: %llu entries wrong, the first at %llu", name, (unsigned long long)wrong,
+               (unsigned long long)first);
+    }
+}
+
+static int expect_inode(uint64_t ino) { return fs.state[ino] == INO_USED; }
+
+static int expect_block(uint64_t blk) { return fs.used[blk / 64] >> (blk % 64) & 1; }
+
+int main(int argc, char **argv) {
+    long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "nyt:")) != -1) {
+        if (opt == 'n') {
+            fs.repair = 0;
+        } else if (opt == 'y') {
+            fs.repair = 1;
+        } else if (opt == 't') {
+            nr_threads = strtol(optarg, NULL, 0);
+        } else {
+            return FSCK_ERROR;
+        }
+    }
+    if (optind != argc - 1) {
+        return FSCK_ERROR;
+    }
+    nr_threads = nr_threads < 1 ? 1 : nr_threads > MAX_THREADS ? MAX_THREADS : nr_threads;
+
+    /* O_EXCL makes opening a block device fail while it is mounted; image files ignore it. */
+    int ret = bbfs_img_open(&fs.img, argv[optind], fs.repair ? BBFS_IMG_WRITE | BBFS_IMG_EXCL : 0);
+    if (ret == -EINVAL) {
+        fprintf(stderr, "%s: no valid bbfs superblock\n", argv[optind]);
+        return FSCK_ERROR;
+    }
+    if (ret && ret != -EUCLEAN) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+        return FSCK_ERROR;
+    }
+    if (ret || bbfs_img_journal_dirty(&fs.img)) {
+        fprintf(stderr, "%s: the journal needs recovery, mount the file system once to replay it\n", argv[optind]);
+        if (!ret) {
+            bbfs_img_close(&fs.img);
+        }
+        return FSCK_UNCORRECTED;
+    }
+    struct bbfs_layout *layout = &fs.img.layout;
+    uint32_t features = fs.img.sb->features;
+    fs.compact = !!(features & BBFS_FEAT_COMPACT_INODE);
+    fs.is64 = !!(features & BBFS_FEAT_64BIT);
+    fs.packed_map = !!(features & BBFS_FEAT_PACKED_BITMAP);
+    fs.packed_dirent = !!(features & BBFS_FEAT_PACKED_DIRENT);
+    /*
+     * The whole image is mapped, and the metadata is read ahead in bulk before the workers walk it. Inode table regions
+     * that were never initialized are skipped, as the scan does not read them.
+     */
+    madvise(bbfs_img_block(&fs.img, layout->imap_begin), (layout->inode_begin - layout->imap_begin) * BBFS_BLOCK_SIZE,
+            MADV_WILLNEED);
+    uint64_t region_blocks = fs.img.region_inodes ? fs.img.sb->itable_region_blocks
+                                                  : layout->block_begin - layout->inode_begin;
+    for (uint64_t blk = layout->inode_begin, ino = 0; blk < layout->block_begin; blk += region_blocks) {
+        uint64_t nr = layout->block_begin - blk < region_blocks ? layout->block_begin - blk : region_blocks;
+        if (!bbfs_img_ino_uninit(&fs.img, ino)) {
+            madvise(bbfs_img_block(&fs.img, blk), nr * BBFS_BLOCK_SIZE, MADV_WILLNEED);
+        }
+        ino += fs.img.region_inodes;
+    }
+
+    fs.state = calloc(layout->nr_inodes, sizeof(*fs.state));
+    fs.refs = calloc(layout->nr_inodes, sizeof(*fs.refs));
+    fs.subdirs = calloc(layout->nr_inodes, sizeof(*fs.subdirs));
+    fs.used = calloc((layout->nr_blocks + 63) / 64, sizeof(*fs.used));
+    if (!fs.state || !fs.refs || !fs.subdirs || !fs.used) {
+        bbfs_img_close(&fs.img);
+        return FSCK_ERROR;
+    }
+
+    ret = FSCK_OK;
+    run_workers(scan_inodes, nr_threads);
+    struct bbfs_inode *root = bbfs_img_inode_raw(&fs.img, 0);
+    if (fs.state[0] != INO_USED || !S_ISDIR(root->i_mode)) {
+        fprintf(stderr, "%s: the root directory is lost\n", argv[optind]);
+        ret = FSCK_UNCORRECTED;
+        goto out;
+    }
+    run_workers(scan_dirs, nr_threads);
+    check_links();
+    check_map("inode", layout->imap_begin, layout->nr_inodes, expect_inode);
+    check_map("block", layout->bmap_begin, layout->nr_blocks, expect_block);
+
+    uint64_t inodes = 0, blocks = 0;
+    for (uint64_t ino = 0; ino < layout->nr_inodes; ino++) {
+        inodes += fs.state[ino] == INO_USED;
+    }
+    for (uint64_t i = 0; i < (layout->nr_blocks + 63) / 64; i++) {
+        blocks += __builtin_popcountll(fs.used[i]);
+    }
+    printf("%s: %llu/%llu inodes, %llu/%llu blocks\n", argv[optind], (unsigned long long)inodes,
+           (unsigned long long)layout->nr_inodes, (unsigned long long)blocks, (unsigned long long)layout->nr_blocks);
+
+    if (fs.uncorrected) {
+        ret = FSCK_UNCORRECTED;
+    } else if (fs.fixed) {
+        ret = FSCK_FIXED;
+    }
+out:
+    free(fs.state);
+    free(fs.refs);
+    free(fs.subdirs);
+    free(fs.used);
+    if (bbfs_img_close(&fs.img)) {
+        ret = FSCK_ERROR;
+    }
+    return ret;
+}
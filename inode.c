@@ -5,68 +5,162 @@
 #include <linux/buffer_head.h>
 #include <linux/fs.h>
 #include <linux/kernel.h>
+#include <linux/log2.h>
 #include <linux/module.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
 #include <linux/stat.h>
+#include <linux/writeback.h>
 
 #include "fs.h"
 
 static const struct inode_operations bbfs_inode_ops;
 static const struct inode_operations bbfs_symlink_inode_ops;
 
-static unsigned long bbfs_find_and_mark_free_inode(struct super_block *sb) {
+static bool bbfs_compact(struct super_block *sb) {
     struct bbfs_sb_info *sbi = BBFS_SB(sb);
-    for (unsigned long i = 0; i < sbi->disk_sb.nr_imap; i++) {
-        struct buffer_head *bh = sb_bread(sb, sbi->imap_begin + i);
-        struct bbfs_imap_block *imap_blk = (struct bbfs_imap_block *)bh->b_data;
-        for (unsigned long j = 0; j < sizeof(struct bbfs_imap_block) / sizeof(uint32_t); j++) {
-            if (!imap_blk->blocks[j]) {
-                imap_blk->blocks[j] = 1;
-                mark_buffer_dirty(bh);
-                brelse(bh);
-                return i * (sizeof(struct bbfs_imap_block) / sizeof(uint32_t)) + j;
-            }
+    return sbi->disk_sb.features & BBFS_FEAT_COMPACT_INODE;
+}
+
+unsigned int bbfs_inline_max(struct super_block *sb) { return bbfs_compact(sb) ? BBFS_CINODE_INLINE : MAX_INLINE_LEN; }
+
+static struct buffer_head *bbfs_inode_bread(struct super_block *sb, unsigned long ino, void **raw) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    uint64_t blk = sbi->inode_begin + (bbfs_compact(sb) ? ino / BBFS_INODES_PER_BLOCK : ino);
+    struct buffer_head *bh = bbfs_ino_uninit(sbi, ino) ? bbfs_itable_zero_block(sb, blk) : sb_bread(sb, blk);
+
+    if (bh) {
+        *raw = bh->b_data;
+        if (bbfs_compact(sb)) {
+            *raw += ino % BBFS_INODES_PER_BLOCK * sizeof(struct bbfs_cinode);
         }
-        brelse(bh);
     }
-    return LONG_MAX;
+    return bh;
 }
 
-unsigned long bbfs_find_and_mark_free_block(struct super_block *sb, int level) {
+static bool bbfs_64bit(struct super_block *sb) {
     struct bbfs_sb_info *sbi = BBFS_SB(sb);
-    unsigned long blk_start = 0;
-    unsigned long blk_num = 1ul << level;
-    for (blk_start = 0; blk_start < sbi->disk_sb.nr_blocks; blk_start += blk_num) {
-        bool found = true;
-        for (int i = 0; i < blk_num; i++) {
-            struct buffer_head *bh =
-                sb_bread(sb, sbi->bmap_begin + (blk_start + i) / (sizeof(struct bbfs_sb) / sizeof(uint32_t)));
-            struct bbfs_bmap_block *bmap_blk = (struct bbfs_bmap_block *)bh->b_data;
-            if (bmap_blk->blocks[(blk_start + i) % (sizeof(struct bbfs_sb) / sizeof(uint32_t))]) {
-                found = false;
-                brelse(bh);
-                break;
-            }
-            brelse(bh);
+    return sbi->disk_sb.features & BBFS_FEAT_64BIT;
+}
+
+/* Without 64bit a level slot is one word, and a hole is all ones in it. */
+static void bbfs_get_levels(uint64_t *levels, const uint32_t *lo, const uint32_t *hi, unsigned int nr) {
+    for (unsigned int i = 0; i < nr; i++) {
+        if (hi) {
+            levels[i] = (uint64_t)hi[i] << 32 | lo[i];
+        } else {
+            levels[i] = lo[i] == U32_MAX ? BBFS_LEVEL_HOLE : lo[i];
         }
-        if (found) {
-            for (int i = 0; i < blk_num; i++) {
-                struct buffer_head *bh =
-                    sb_bread(sb, sbi->bmap_begin + (blk_start + i) / (sizeof(struct bbfs_sb) / sizeof(uint32_t)));
-                struct bbfs_bmap_block *bmap_blk = (struct bbfs_bmap_block *)bh->b_data;
-                bmap_blk->blocks[(blk_start + i) % (sizeof(struct bbfs_sb) / sizeof(uint32_t))] = 1;
-                mark_buffer_dirty(bh);
-                brelse(bh);
-            }
-            return blk_start;
+    }
+}
+
+static void bbfs_put_levels(uint32_t *lo, uint32_t *hi, const uint64_t *levels, unsigned int nr) {
+    for (unsigned int i = 0; i < nr; i++) {
+        lo[i] = levels[i];
+        if (hi) {
+            hi[i] = levels[i] >> 32;
         }
     }
-    return LONG_MAX;
+}
+
+/* With 64bit the overflow block's upper half sits in the union, which a symlink long enough to need the block frees. */
+static uint64_t bbfs_get_overflow(struct super_block *sb, const struct bbfs_cinode *di) {
+    return di->l_overflow | (bbfs_64bit(sb) ? (uint64_t)di->l_overflow_hi << 32 : 0);
+}
+
+static void bbfs_put_overflow(struct super_block *sb, struct bbfs_cinode *di, uint64_t blk) {
+    di->l_overflow = blk;
+    if (bbfs_64bit(sb)) {
+        di->l_overflow_hi = blk >> 32;
+    }
+}
+
+static int bbfs_read_levels(struct inode *inode, void *raw) {
+    struct super_block *sb = inode->i_sb;
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+
+    if (!bbfs_compact(sb)) {
+        struct bbfs_inode *di = raw;
+        if (di->l_num > BBFS_MAX_LEVELS) {
+            return -EIO;
+        }
+        if (di->l_tail && (!di->l_num || di->l_tail >= 1ul << (di->l_num - 1))) {
+            return -EIO;
+        }
+        ci->l_num = di->l_num;
+        ci->l_tail = di->l_tail;
+        ci->l_unwritten = di->l_unwritten;
+        bbfs_get_levels(ci->levels, di->levels, bbfs_64bit(sb) ? di->levels_hi : NULL, ci->l_num);
+        if (bbfs_64bit(sb)) {
+            inode->i_size |= (loff_t)di->i_size_hi << 32;
+        }
+        return 0;
+    }
+
+    struct bbfs_cinode *di = raw;
+    if (di->l_num > BBFS_MAX_LEVELS || (di->l_tail && (!di->l_num || di->l_tail >= 1ul << (di->l_num - 1)))) {
+        return -EIO;
+    }
+    ci->l_num = di->l_num;
+    ci->l_tail = di->l_tail;
+    ci->l_unwritten = di->l_unwritten;
+    ci->l_overflow = bbfs_get_overflow(sb, di);
+    bbfs_get_levels(ci->levels, di->levels, bbfs_64bit(sb) ? di->levels_hi : NULL, min(ci->l_num, BBFS_CINODE_LEVELS));
+    if (bbfs_64bit(sb)) {
+        inode->i_size |= (loff_t)di->i_size_hi << 32;
+    }
+    if (ci->l_num > BBFS_CINODE_LEVELS) {
+        struct buffer_head *bh = sb_bread(sb, sbi->block_begin + ci->l_overflow);
+        if (!bh) {
+            return -EIO;
+        }
+        uint32_t *lo = (uint32_t *)bh->b_data;
+        bbfs_get_levels(ci->levels + BBFS_CINODE_LEVELS, lo, bbfs_64bit(sb) ? lo + BBFS_CINODE_LEVELS : NULL,
+                        ci->l_num - BBFS_CINODE_LEVELS);
+        brelse(bh);
+    }
+    return 0;
+}
+
+static int bbfs_read_data(struct inode *inode, void *raw) {
+    struct super_block *sb = inode->i_sb;
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+    bool link = S_ISLNK(inode->i_mode);
+    unsigned int max = link ? MAX_SYMLINK_LEN - 1 : bbfs_inline_max(sb);
+
+    if (inode->i_size > max) {
+        return -EIO;
+    }
+    ci->i_data = kzalloc(link ? inode->i_size + 1 : max, GFP_NOFS);
+    if (!ci->i_data) {
+        return -ENOMEM;
+    }
+    if (!bbfs_compact(sb)) {
+        memcpy(ci->i_data, ((struct bbfs_inode *)raw)->i_data, inode->i_size);
+        return 0;
+    }
+
+    struct bbfs_cinode *di = raw;
+    if (inode->i_size <= BBFS_CINODE_INLINE) {
+        memcpy(ci->i_data, di->i_data, inode->i_size);
+        return 0;
+    }
+    ci->l_overflow = bbfs_get_overflow(sb, di);
+    struct buffer_head *bh = sb_bread(sb, sbi->block_begin + ci->l_overflow);
+    if (!bh) {
+        return -EIO;
+    }
+    memcpy(ci->i_data, bh->b_data, inode->i_size);
+    brelse(bh);
+    return 0;
 }
 
 struct inode *bbfs_iget(struct super_block *sb, unsigned long ino) {
     struct bbfs_sb_info *sbi = BBFS_SB(sb);
 
-    if (ino >= sbi->disk_sb.nr_inodes) {
+    if (ino >= sbi->nr_inodes) {
         return ERR_PTR(-EINVAL);
     }
 
@@ -80,28 +174,41 @@ struct inode *bbfs_iget(struct super_block *sb, unsigned long ino) {
     }
 
     struct bbfs_inode_info *ci = BBFS_INODE(inode);
-    struct buffer_head *bh = sb_bread(sb, sbi->inode_begin + ino);
+    void *raw;
+    struct buffer_head *bh = bbfs_inode_bread(sb, ino, &raw);
     if (!bh) {
-        brelse(bh);
         iget_failed(inode);
         return ERR_PTR(-EIO);
     }
-    memcpy(ci, bh->b_data, PAGE_SIZE);
-    brelse(bh);
+    /* The header is laid out identically in both inode formats. */
+    struct bbfs_inode *di = raw;
 
     inode->i_ino = ino;
     inode->i_sb = sb;
 
-    inode->i_mode = ci->disk_inode.i_mode;
-    i_uid_write(inode, ci->disk_inode.i_uid);
-    i_gid_write(inode, ci->disk_inode.i_gid);
-    inode->i_size = ci->disk_inode.i_size;
+    inode->i_mode = di->i_mode;
+    i_uid_write(inode, di->i_uid);
+    i_gid_write(inode, di->i_gid);
+    inode->i_size = di->i_size;
 
-    inode_set_ctime(inode, ci->disk_inode.i_ctime_sec, ci->disk_inode.i_ctime_nsec);
-    inode_set_atime(inode, ci->disk_inode.i_atime_sec, ci->disk_inode.i_atime_nsec);
-    inode_set_mtime(inode, ci->disk_inode.i_mtime_sec, ci->disk_inode.i_mtime_nsec);
+    inode_set_ctime(inode, di->i_ctime_sec, di->i_ctime_nsec);
+    inode_set_atime(inode, di->i_atime_sec, di->i_atime_nsec);
+    inode_set_mtime(inode, di->i_mtime_sec, di->i_mtime_nsec);
 
-    set_nlink(inode, ci->disk_inode.i_nlink);
+    set_nlink(inode, di->i_nlink);
+    ci->i_flags = di->i_flags;
+
+    int ret;
+    if (S_ISLNK(inode->i_mode) || ci->i_flags & BBFS_INODE_INLINE) {
+        ret = bbfs_read_data(inode, raw);
+    } else {
+        ret = bbfs_read_levels(inode, raw);
+    }
+    brelse(bh);
+    if (ret) {
+        iget_failed(inode);
+        return ERR_PTR(ret);
+    }
 
     if (S_ISDIR(inode->i_mode)) {
         inode->i_op = &bbfs_inode_ops;
@@ -110,34 +217,267 @@ struct inode *bbfs_iget(struct super_block *sb, unsigned long ino) {
         inode->i_op = &bbfs_inode_ops;
         inode->i_fop = &bbfs_file_ops;
         inode->i_mapping->a_ops = &bbfs_aops;
+        mapping_set_large_folios(inode->i_mapping);
     } else if (S_ISLNK(inode->i_mode)) {
         inode->i_op = &bbfs_symlink_inode_ops;
+        inode->i_link = ci->i_data;
     }
 
     unlock_new_inode(inode);
     return inode;
 }
 
+static int bbfs_write_levels(struct inode *inode, void *raw) {
+    struct super_block *sb = inode->i_sb;
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+
+    if (!bbfs_compact(sb)) {
+        struct bbfs_inode *di = raw;
+        di->l_num = ci->l_num;
+        di->l_tail = ci->l_tail;
+        di->l_unwritten = ci->l_unwritten;
+        bbfs_put_levels(di->levels, bbfs_64bit(sb) ? di->levels_hi : NULL, ci->levels, ci->l_num);
+        if (bbfs_64bit(sb)) {
+            di->i_size_hi = inode->i_size >> 32;
+        }
+        return 0;
+    }
+
+    struct bbfs_cinode *di = raw;
+    di->l_num = ci->l_num;
+    di->l_tail = ci->l_tail;
+    di->l_unwritten = ci->l_unwritten;
+    bbfs_put_overflow(sb, di, ci->l_overflow);
+    bbfs_put_levels(di->levels, bbfs_64bit(sb) ? di->levels_hi : NULL, ci->levels, min(ci->l_num, BBFS_CINODE_LEVELS));
+    if (bbfs_64bit(sb)) {
+        di->i_size_hi = inode->i_size >> 32;
+    }
+    if (ci->l_num > BBFS_CINODE_LEVELS) {
+        struct buffer_head *bh = sb_bread(sb, sbi->block_begin + ci->l_overflow);
+        if (!bh) {
+            return -EIO;
+        }
+        uint32_t *lo = (uint32_t *)bh->b_data;
+        bbfs_put_levels(lo, bbfs_64bit(sb) ? lo + BBFS_CINODE_LEVELS : NULL, ci->levels + BBFS_CINODE_LEVELS,
+                        ci->l_num - BBFS_CINODE_LEVELS);
+        bbfs_journal_dirty(sb, bh, inode);
+        brelse(bh);
+    }
+    return 0;
+}
+
+static void bbfs_write_data(struct inode *inode, void *raw) {
+    struct super_block *sb = inode->i_sb;
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+
+    if (!bbfs_compact(sb)) {
+        memcpy(((struct bbfs_inode *)raw)->i_data, ci->i_data, inode->i_size);
+        return;
+    }
+    struct bbfs_cinode *di = raw;
+    if (inode->i_size <= BBFS_CINODE_INLINE) {
+        memcpy(di->i_data, ci->i_data, inode->i_size);
+    } else {
+        bbfs_put_overflow(sb, di, ci->l_overflow);
+    }
+}
+
+static int bbfs_update_inode(struct inode *inode, bool sync) {
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+    void *raw;
+    struct buffer_head *bh = bbfs_inode_bread(inode->i_sb, inode->i_ino, &raw);
+    if (!bh) {
+        return -EIO;
+    }
+    struct bbfs_inode *di = raw;
+
+    lock_buffer(bh);
+    memset(raw, 0, bbfs_compact(inode->i_sb) ? sizeof(struct bbfs_cinode) : sizeof(struct bbfs_inode));
+    di->i_flags = ci->i_flags;
+    di->i_mode = inode->i_mode;
+    di->i_uid = i_uid_read(inode);
+    di->i_gid = i_gid_read(inode);
+    di->i_size = inode->i_size;
+    di->i_nlink = inode->i_nlink;
+
+    di->i_ctime_sec = inode_get_ctime_sec(inode);
+    di->i_ctime_nsec = inode_get_ctime_nsec(inode);
+    di->i_atime_sec = inode_get_atime_sec(inode);
+    di->i_atime_nsec = inode_get_atime_nsec(inode);
+    di->i_mtime_sec = inode_get_mtime_sec(inode);
+    di->i_mtime_nsec = inode_get_mtime_nsec(inode);
+
+    int ret = 0;
+    if (ci->i_data) {
+        bbfs_write_data(inode, raw);
+    } else {
+        ret = bbfs_write_levels(inode, raw);
+    }
+    unlock_buffer(bh);
+    bbfs_journal_dirty(inode->i_sb, bh, NULL);
+    if (sync) {
+        sync_dirty_buffer(bh);
+    }
+    brelse(bh);
+    return ret;
+}
+
+/* With a journal the inode was logged when it was dirtied, so writing it back only has to wait for the commit. */
+int bbfs_write_inode(struct inode *inode, struct writeback_control *wbc) {
+    struct bbfs_sb_info *sbi = BBFS_SB(inode->i_sb);
+
+    if (sbi->journal) {
+        return wbc->sync_mode == WB_SYNC_ALL && !wbc->for_sync ? bbfs_journal_commit(inode->i_sb) : 0;
+    }
+    return bbfs_update_inode(inode, wbc->sync_mode == WB_SYNC_ALL);
+}
+
+void bbfs_dirty_inode(struct inode *inode, int flags) {
+    struct super_block *sb = inode->i_sb;
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+
+    if (!sbi->journal || flags == I_DIRTY_TIME || bbfs_journal_start(sb)) {
+        return;
+    }
+    bbfs_update_inode(inode, false);
+    bbfs_journal_inode(inode, flags & I_DIRTY_DATASYNC);
+    bbfs_journal_stop(sb);
+}
+
+/* Map level to blk_start. On sparse file systems the slots skipped on the way are left as holes. */
+int bbfs_add_level(struct inode *inode, unsigned int level, unsigned long blk_start) {
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+
+    if (level >= BBFS_MAX_LEVELS) {
+        return -EFBIG;
+    }
+    if (bbfs_compact(inode->i_sb) && ci->l_num <= BBFS_CINODE_LEVELS && level >= BBFS_CINODE_LEVELS) {
+        unsigned long blk = bbfs_find_and_mark_free_block(inode, 0);
+        if (blk == LONG_MAX) {
+            return -ENOSPC;
+        }
+        ci->l_overflow = blk;
+    }
+    while (ci->l_num < level) {
+        ci->levels[ci->l_num++] = BBFS_LEVEL_HOLE;
+    }
+    ci->levels[level] = blk_start;
+    ci->l_num = max(ci->l_num, level + 1);
+    ci->l_synced = min(ci->l_synced, level);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+/* Free every level from keep up, along with any holes that would be left at the end. */
+void bbfs_release_levels(struct inode *inode, int keep) {
+    struct super_block *sb = inode->i_sb;
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+
+    while (ci->l_num > keep || (ci->l_num && ci->levels[ci->l_num - 1] == BBFS_LEVEL_HOLE)) {
+        unsigned long nr = bbfs_level_blocks(ci, ci->l_num - 1);
+        ci->l_num--;
+        ci->l_tail = 0;
+        ci->l_unwritten &= ~(1u << ci->l_num);
+        if (ci->levels[ci->l_num] != BBFS_LEVEL_HOLE) {
+            /* Only directory blocks are journaled; file data never needs revoking. */
+            if (S_ISDIR(inode->i_mode)) {
+                bbfs_journal_forget(sb, sbi->block_begin + ci->levels[ci->l_num], nr);
+            }
+            bbfs_free_blocks(sb, ci->levels[ci->l_num], nr);
+        }
+        if (bbfs_compact(sb) && ci->l_num == BBFS_CINODE_LEVELS) {
+            bbfs_journal_forget(sb, sbi->block_begin + ci->l_overflow, 1);
+            bbfs_free_block(sb, ci->l_overflow, 0);
+        }
+    }
+    ci->l_synced = min(ci->l_synced, ci->l_num);
+    mark_inode_dirty(inode);
+}
+
+/* Punch a single level out of a sparse file. Called with alloc_lock held. */
+void bbfs_free_level(struct inode *inode, unsigned int level) {
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+
+    if (level >= ci->l_num || ci->levels[level] == BBFS_LEVEL_HOLE) {
+        return;
+    }
+    if (level + 1 == ci->l_num) {
+        bbfs_release_levels(inode, level);
+        return;
+    }
+    bbfs_free_block(inode->i_sb, ci->levels[level], level);
+    ci->levels[level] = BBFS_LEVEL_HOLE;
+    ci->l_unwritten &= ~(1u << level);
+    mark_inode_dirty(inode);
+}
+
+/*
+ * A file's last level is allocated whole, so appends keep landing in it while the file is in use. Once nothing is
+ * writing it any more (last close, truncate, eviction) the levels past EOF go back to the free pool, unless fallocate
+ * put them there on purpose. With partial_tail so do the unused blocks of the last level, and l_tail records how
+ * much of it is left; bbfs_grow_tail takes the rest back before a write needs it.
+ */
+void bbfs_trim_tail(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+    unsigned long nr = DIV_ROUND_UP(i_size_read(inode), i_blocksize(inode));
+    unsigned int keep = nr ? ilog2(nr) + 1 : 0;
+    bool trimmed = false;
+
+    if (ci->i_flags & (BBFS_INODE_INLINE | BBFS_INODE_PREALLOC) || (!ci->l_num && !ci->l_resv) ||
+        bbfs_journal_start(sb)) {
+        return;
+    }
+    mutex_lock(&ci->alloc_lock);
+    /* Nothing past EOF can be dirty any more, so neither can the levels reserved for it. */
+    unsigned long drop = ci->l_resv & ~((1ul << keep) - 1);
+    ci->l_resv &= ~drop;
+    bbfs_release_blocks(sb, drop);
+    if (ci->l_num > keep) {
+        bbfs_release_levels(inode, keep);
+        trimmed = true;
+    }
+    if (sbi->disk_sb.features & BBFS_FEAT_PARTIAL_TAIL && ci->l_num && ci->l_num == keep) {
+        unsigned int l = ci->l_num - 1;
+        unsigned long used = nr + 1 - (1ul << l);
+        if (used < bbfs_level_blocks(ci, l)) {
+            bbfs_free_blocks(sb, ci->levels[l] + used, bbfs_level_blocks(ci, l) - used);
+            ci->l_tail = used;
+            trimmed = true;
+        }
+    }
+    mutex_unlock(&ci->alloc_lock);
+    /* Marking an inode that is being evicted dirty no longer writes it back. */
+    if (trimmed && !sbi->journal && inode->i_state & I_FREEING) {
+        bbfs_update_inode(inode, false);
+    } else if (trimmed) {
+        mark_inode_dirty(inode);
+    }
+    bbfs_journal_stop(sb);
+}
+
 static struct inode *bbfs_new_inode(struct inode *dir, mode_t mode) {
     struct super_block *sb = dir->i_sb;
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
 
-    unsigned long ino = bbfs_find_and_mark_free_inode(sb);
-    struct inode *inode = bbfs_iget(sb, ino);
-    if (IS_ERR(inode)) {
-        return inode;
+    unsigned long ino = bbfs_find_and_mark_free_inode(dir, mode);
+    if (ino == LONG_MAX) {
+        return ERR_PTR(-ENOSPC);
+    }
+    struct inode *inode = new_inode(sb);
+    if (!inode) {
+        bbfs_free_ino(sb, ino);
+        return ERR_PTR(-ENOMEM);
     }
+    inode->i_ino = ino;
 
     struct bbfs_inode_info *ci = BBFS_INODE(inode);
-    memset(&ci->disk_inode, 0, sizeof(struct bbfs_inode));
-    ci->disk_inode.valid = 1;
-    inode->i_mode = mode;
-    inode->i_uid = current_uid();
-    inode->i_gid = current_gid();
-    struct timespec64 cur_time = current_time(inode);
-    inode_set_ctime_current(inode);
-    inode_set_atime_to_ts(inode, cur_time);
-    inode_set_ctime_to_ts(inode, cur_time);
-    inode_set_mtime_to_ts(inode, cur_time);
+    ci->i_flags = BBFS_INODE_VALID;
+    inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
+    simple_inode_init_ts(inode);
 
     if (S_ISDIR(inode->i_mode)) {
         inode->i_size = sizeof(struct bbfs_inode);
@@ -149,459 +489,309 @@ static struct inode *bbfs_new_inode(struct inode *dir, mode_t mode) {
         inode->i_op = &bbfs_inode_ops;
         inode->i_fop = &bbfs_file_ops;
         inode->i_mapping->a_ops = &bbfs_aops;
-        set_nlink(inode, 1);
+        mapping_set_large_folios(inode->i_mapping);
+        if (sbi->disk_sb.features & BBFS_FEAT_INLINE_DATA) {
+            ci->i_data = kzalloc(bbfs_inline_max(sb), GFP_NOFS);
+            if (ci->i_data) {
+                ci->i_flags |= BBFS_INODE_INLINE;
+            }
+        }
     } else if (S_ISLNK(inode->i_mode)) {
         inode->i_size = 0;
         inode->i_op = &bbfs_symlink_inode_ops;
-        set_nlink(inode, 1);
     }
 
-    inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
+    if (insert_inode_locked(inode) < 0) {
+        make_bad_inode(inode);
+        iput(inode);
+        bbfs_free_ino(sb, ino);
+        return ERR_PTR(-EIO);
+    }
+    mark_inode_dirty(inode);
     return inode;
 }
 
 static struct dentry *bbfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags) {
-    struct super_block *sb = dir->i_sb;
-    struct bbfs_sb_info *sbi = sb->s_fs_info;
-    struct bbfs_inode_info *ci = BBFS_INODE(dir);
-
-    for (int i = 0; i < ci->disk_inode.l_num; i++) {
-        unsigned long blk_start = ci->disk_inode.levels[i];
-        unsigned long blk_num = 1ul << i;
-        for (int j = blk_start; j < blk_start + blk_num; j++) {
-            struct buffer_head *bh = sb_bread(sb, sbi->block_begin + j);
-            for (int k = 0; k < PAGE_SIZE; k += sizeof(struct bbfs_entry)) {
-                struct bbfs_entry *ent = (struct bbfs_entry *)(bh->b_data + k);
-                if (!ent->valid) {
-                    continue;
-                }
-                if (!strcmp(ent->name, dentry->d_name.name)) {
-                    struct inode *inode = bbfs_iget(sb, ent->ino);
-                    d_add(dentry, inode);
-                    brelse(bh);
-                    return NULL;
-                }
-            }
-            brelse(bh);
+    struct inode *inode = NULL;
+    unsigned long ino;
+
+    if (dentry->d_name.len > NAME_MAX) {
+        return ERR_PTR(-ENAMETOOLONG);
+    }
+    int ret = bbfs_find_entry(dir, &dentry->d_name, &ino);
+    if (!ret) {
+        inode = bbfs_iget(dir->i_sb, ino);
+        if (IS_ERR(inode)) {
+            return ERR_CAST(inode);
         }
+    } else if (ret != -ENOENT) {
+        return ERR_PTR(ret);
     }
+    d_add(dentry, inode);
     return NULL;
 }
 
-static int bbfs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
-    struct super_block *sb = dir->i_sb;
-    struct bbfs_sb_info *sbi = sb->s_fs_info;
-    struct bbfs_inode_info *dir_ci = BBFS_INODE(dir);
-
-    mode |= S_IFREG;
-    for (int i = 0; i < dir_ci->disk_inode.l_num; i++) {
-        unsigned long blk_start = dir_ci->disk_inode.levels[i];
-        unsigned long blk_num = 1ul << i;
-        for (int j = blk_start; j < blk_start + blk_num; j++) {
-            struct buffer_head *bh = sb_bread(sb, sbi->block_begin + j);
-            for (int k = 0; k < PAGE_SIZE; k += sizeof(struct bbfs_entry)) {
-                struct bbfs_entry *ent = (struct bbfs_entry *)(bh->b_data + k);
-                if (!ent->valid) {
-                    struct inode *file = bbfs_new_inode(dir, mode);
-                    mark_inode_dirty(file);
-                    ent->valid = 1;
-                    ent->type = DT_REG;
-                    ent->ino = file->i_ino;
-                    strcpy(ent->name, dentry->d_name.name);
-                    mark_buffer_dirty(bh);
-                    brelse(bh);
-                    d_instantiate(dentry, file);
-                    return 0;
-                }
-            }
-            brelse(bh);
-        }
+static int bbfs_add_new_inode(struct inode *dir, struct dentry *dentry, struct inode *file) {
+    int ret = bbfs_add_entry(dir, &dentry->d_name, file);
+    if (ret) {
+        clear_nlink(file);
+        discard_new_inode(file);
+        return ret;
     }
+    mark_inode_dirty(file);
+    d_instantiate_new(dentry, file);
+    return 0;
+}
 
-    int level = dir_ci->disk_inode.l_num++;
-    unsigned long blk_start = bbfs_find_and_mark_free_block(sb, level);
-    dir_ci->disk_inode.levels[level] = blk_start;
-    mark_inode_dirty(dir);
-
-    unsigned long blk_num = 1ul << level;
-    for (int j = blk_start; j < blk_start + blk_num; j++) {
-        struct buffer_head *bh = sb_bread(sb, sbi->block_begin + j);
-        for (int k = 0; k < PAGE_SIZE; k += sizeof(struct bbfs_entry)) {
-            struct bbfs_entry *ent = (struct bbfs_entry *)(bh->b_data + k);
-            if (!ent->valid) {
-                struct inode *file = bbfs_new_inode(dir, mode);
-                mark_inode_dirty(file);
-                ent->valid = 1;
-                ent->type = DT_REG;
-                ent->ino = file->i_ino;
-                strcpy(ent->name, dentry->d_name.name);
-                mark_buffer_dirty(bh);
-                brelse(bh);
-                d_instantiate(dentry, file);
-                return 0;
-            }
-        }
-        brelse(bh);
+static int __bbfs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
+    struct inode *file = bbfs_new_inode(dir, mode | S_IFREG);
+    if (IS_ERR(file)) {
+        return PTR_ERR(file);
     }
-    return -1;
+    return bbfs_add_new_inode(dir, dentry, file);
 }
 
-static int bbfs_link(struct dentry *old_dentry, struct inode *dir, struct dentry *dentry) {
-    struct super_block *sb = dir->i_sb;
-    struct bbfs_sb_info *sbi = BBFS_SB(sb);
-    struct bbfs_inode_info *dir_ci = BBFS_INODE(dir);
+static int __bbfs_link(struct dentry *old_dentry, struct inode *dir, struct dentry *dentry) {
     struct inode *file = d_inode(old_dentry);
 
-    for (int i = 0; i < dir_ci->disk_inode.l_num; i++) {
-        unsigned long blk_start = dir_ci->disk_inode.levels[i];
-        unsigned long blk_num = 1ul << i;
-        for (int j = blk_start; j < blk_start + blk_num; j++) {
-            struct buffer_head *bh = sb_bread(sb, sbi->block_begin + j);
-            for (int k = 0; k < PAGE_SIZE; k += sizeof(struct bbfs_entry)) {
-                struct bbfs_entry *ent = (struct bbfs_entry *)(bh->b_data + k);
-                if (!ent->valid) {
-                    ent->valid = 1;
-                    if (S_ISDIR(file->i_mode)) {
-                        ent->type = DT_DIR;
-                    } else if (S_ISREG(file->i_mode)) {
-                        ent->type = DT_REG;
-                    } else if (S_ISLNK(file->i_mode)) {
-                        ent->type = DT_LNK;
-                    }
-                    ent->ino = file->i_ino;
-                    strcpy(ent->name, dentry->d_name.name);
-                    mark_buffer_dirty(bh);
-                    brelse(bh);
-                    inode_inc_link_count(file);
-                    ihold(file);
-                    d_instantiate(dentry, file);
-                    return 0;
-                }
-            }
-            brelse(bh);
-        }
+    int ret = bbfs_add_entry(dir, &dentry->d_name, file);
+    if (ret) {
+        return ret;
     }
-
-    return -1;
+    inode_set_ctime_current(file);
+    inode_inc_link_count(file);
+    ihold(file);
+    d_instantiate(dentry, file);
+    return 0;
 }
 
-static int bbfs_unlink(struct inode *dir, struct dentry *dentry) {
-    struct super_block *sb = dir->i_sb;
-    struct bbfs_sb_info *sbi = sb->s_fs_info;
-    struct bbfs_inode_info *dir_ci = BBFS_INODE(dir);
-    struct inode *file = dentry->d_inode;
-    struct bbfs_inode_info *file_ci = BBFS_INODE(file);
-    bool found = false;
-
-    for (int i = 0; i < dir_ci->disk_inode.l_num; i++) {
-        unsigned long blk_start = dir_ci->disk_inode.levels[i];
-        unsigned long blk_num = 1ul << i;
-        for (int j = blk_start; j < blk_start + blk_num; j++) {
-            struct buffer_head *bh = sb_bread(sb, sbi->block_begin + j);
-            for (int k = 0; k < PAGE_SIZE; k += sizeof(struct bbfs_entry)) {
-                struct bbfs_entry *ent = (struct bbfs_entry *)(bh->b_data + k);
-                if (ent->valid && !strcmp(ent->name, dentry->d_name.name)) {
-                    found = true;
-                    memset(ent, 0, sizeof(struct bbfs_entry));
-                    mark_buffer_dirty(bh);
-                    inode_dec_link_count(file);
-                    break;
-                }
-            }
-            brelse(bh);
-            if (found) {
-                break;
-            }
-        }
-        if (found) {
-            break;
-        }
+static int __bbfs_unlink(struct inode *dir, struct dentry *dentry) {
+    struct inode *file = d_inode(dentry);
+
+    int ret = bbfs_delete_entry(dir, &dentry->d_name);
+    if (ret) {
+        return ret;
     }
+    inode_set_ctime_to_ts(file, inode_get_ctime(dir));
+    inode_dec_link_count(file);
+    return 0;
+}
 
-    if (file->i_nlink) {
-        return 0;
+static int __bbfs_rename(struct mnt_idmap *idmap, struct inode *old_dir, struct dentry *old_dentry,
+                         struct inode *new_dir, struct dentry *new_dentry, unsigned int flags) {
+    struct inode *file = d_inode(old_dentry);
+    struct inode *target = d_inode(new_dentry);
+
+    if (flags & ~RENAME_NOREPLACE) {
+        return -EINVAL;
+    }
+    if (target && S_ISDIR(target->i_mode) && !bbfs_empty_dir(target)) {
+        return -ENOTEMPTY;
     }
 
-    for (int i = 0; i < file_ci->disk_inode.l_num; i++) {
-        unsigned long blk_start = dir_ci->disk_inode.levels[i];
-        unsigned long blk_num = 1ul << i;
-        for (int j = blk_start; j < blk_start + blk_num; j++) {
-            struct buffer_head *bh = sb_bread(sb, sbi->block_begin + j);
-            struct bbfs_bmap_block *bmap_blk = (struct bbfs_bmap_block *)bh->b_data;
-            memset(bmap_blk, 0, sizeof(struct bbfs_bmap_block));
-            mark_buffer_dirty(bh);
-            brelse(bh);
+    /* The new name is in place before anything is dropped, so a failure leaves both names rather than neither. */
+    int ret = target ? bbfs_replace_entry(new_dir, &new_dentry->d_name, file)
+                     : bbfs_add_entry(new_dir, &new_dentry->d_name, file);
+    if (ret) {
+        return ret;
+    }
+    if (target) {
+        if (S_ISDIR(target->i_mode)) {
+            clear_nlink(target);
+            inode_dec_link_count(new_dir);
+        } else {
+            inode_dec_link_count(target);
         }
     }
+    ret = bbfs_delete_entry(old_dir, &old_dentry->d_name);
+    if (ret) {
+        return ret;
+    }
+    if (S_ISDIR(file->i_mode) && old_dir != new_dir) {
+        inode_dec_link_count(old_dir);
+        inode_inc_link_count(new_dir);
+    }
+    inode_set_ctime_current(file);
+    mark_inode_dirty(file);
+    return 0;
+}
 
-    struct buffer_head *bh =
-        sb_bread(sb, sbi->imap_begin + file->i_ino / (sizeof(struct bbfs_imap_block) / sizeof(uint32_t)));
-    struct bbfs_imap_block *imap_blk = (struct bbfs_imap_block *)bh->b_data;
-    imap_blk->blocks[file->i_ino % (sizeof(struct bbfs_imap_block) / sizeof(uint32_t))] = 0;
-    mark_buffer_dirty(bh);
-    brelse(bh);
+static int __bbfs_mkdir(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode) {
+    struct inode *file = bbfs_new_inode(dir, mode | S_IFDIR);
+    if (IS_ERR(file)) {
+        return PTR_ERR(file);
+    }
+    int ret = bbfs_add_new_inode(dir, dentry, file);
+    if (ret) {
+        return ret;
+    }
+    inode_inc_link_count(dir);
+    return 0;
+}
 
+static int __bbfs_rmdir(struct inode *dir, struct dentry *dentry) {
+    struct inode *file = d_inode(dentry);
+
+    if (!bbfs_empty_dir(file)) {
+        return -ENOTEMPTY;
+    }
+    int ret = bbfs_delete_entry(dir, &dentry->d_name);
+    if (ret) {
+        return ret;
+    }
+    clear_nlink(file);
+    mark_inode_dirty(file);
+    inode_dec_link_count(dir);
     return 0;
 }
 
-static int bbfs_rename(struct mnt_idmap *idmap, struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir,
-                       struct dentry *new_dentry, unsigned int flags) {
-    struct bbfs_inode_info *old_dir_ci = BBFS_INODE(old_dir);
-    struct bbfs_inode_info *new_dir_ci = BBFS_INODE(new_dir);
-    struct inode *file = old_dentry->d_inode;
-    struct super_block *sb = file->i_sb;
+static int bbfs_write_symlink_block(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
     struct bbfs_sb_info *sbi = BBFS_SB(sb);
-    bool found = false;
-    struct bbfs_entry entry;
-
-    for (int i = 0; i < old_dir_ci->disk_inode.l_num; i++) {
-        unsigned long blk_start = old_dir_ci->disk_inode.levels[i];
-        unsigned long blk_num = 1ul << i;
-        for (int j = blk_start; j < blk_start + blk_num; j++) {
-            struct buffer_head *bh = sb_bread(sb, sbi->block_begin + j);
-            for (int k = 0; k < PAGE_SIZE; k += sizeof(struct bbfs_entry)) {
-                struct bbfs_entry *ent = (struct bbfs_entry *)(bh->b_data + k);
-                if (ent->valid && ent->ino == file->i_ino) {
-                    found = true;
-                    memcpy(&entry, ent, sizeof(struct bbfs_entry));
-                    memset(ent, 0, sizeof(struct bbfs_entry));
-                    mark_buffer_dirty(bh);
-                    if (S_ISDIR(file->i_mode)) {
-                        inode_dec_link_count(old_dir);
-                    }
-                    break;
-                }
-            }
-            brelse(bh);
-            if (found) {
-                break;
-            }
-        }
-        if (found) {
-            break;
-        }
-    }
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
 
-    strcpy(entry.name, new_dentry->d_name.name);
-
-    for (int i = 0; i < new_dir_ci->disk_inode.l_num; i++) {
-        unsigned long blk_start = new_dir_ci->disk_inode.levels[i];
-        unsigned long blk_num = 1ul << i;
-        for (int j = blk_start; j < blk_start + blk_num; j++) {
-            struct buffer_head *bh = sb_bread(sb, sbi->block_begin + j);
-            for (int k = 0; k < PAGE_SIZE; k += sizeof(struct bbfs_entry)) {
-                struct bbfs_entry *ent = (struct bbfs_entry *)(bh->b_data + k);
-                if (!ent->valid) {
-                    memcpy(ent, &entry, sizeof(struct bbfs_entry));
-                    mark_buffer_dirty(bh);
-                    brelse(bh);
-                    if (S_ISDIR(file->i_mode)) {
-                        inode_inc_link_count(new_dir);
-                    }
-                    return 0;
-                }
-            }
-            brelse(bh);
-        }
+    unsigned long blk = bbfs_find_and_mark_free_block(inode, 0);
+    if (blk == LONG_MAX) {
+        return -ENOSPC;
+    }
+    struct buffer_head *bh = sb_getblk(sb, sbi->block_begin + blk);
+    if (!bh) {
+        bbfs_free_block(sb, blk, 0);
+        return -EIO;
     }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, PAGE_SIZE);
+    memcpy(bh->b_data, ci->i_data, inode->i_size);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    bbfs_journal_dirty(sb, bh, inode);
+    brelse(bh);
+    ci->l_overflow = blk;
+    return 0;
+}
 
-    int level = new_dir_ci->disk_inode.l_num++;
-    unsigned long blk_start = bbfs_find_and_mark_free_block(sb, level);
-    new_dir_ci->disk_inode.levels[level] = blk_start;
-    mark_inode_dirty(new_dir);
-
-    unsigned long blk_num = 1ul << level;
-    for (int j = blk_start; j < blk_start + blk_num; j++) {
-        struct buffer_head *bh = sb_bread(sb, sbi->block_begin + j);
-        for (int k = 0; k < PAGE_SIZE; k += sizeof(struct bbfs_entry)) {
-            struct bbfs_entry *ent = (struct bbfs_entry *)(bh->b_data + k);
-            if (!ent->valid) {
-                memcpy(ent, &entry, sizeof(struct bbfs_entry));
-                mark_buffer_dirty(bh);
-                brelse(bh);
-                if (S_ISDIR(file->i_mode)) {
-                    inode_inc_link_count(new_dir);
-                }
-                return 0;
-            }
+static int __bbfs_symlink(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, const char *symname) {
+    unsigned int len = strlen(symname);
+
+    if (len >= MAX_SYMLINK_LEN) {
+        return -ENAMETOOLONG;
+    }
+    struct inode *file = bbfs_new_inode(dir, S_IFLNK | S_IRWXUGO);
+    if (IS_ERR(file)) {
+        return PTR_ERR(file);
+    }
+    struct bbfs_inode_info *file_ci = BBFS_INODE(file);
+    file_ci->i_data = kmemdup(symname, len + 1, GFP_KERNEL);
+    if (!file_ci->i_data) {
+        clear_nlink(file);
+        discard_new_inode(file);
+        return -ENOMEM;
+    }
+    file->i_link = file_ci->i_data;
+    file->i_size = len;
+
+    if (bbfs_compact(dir->i_sb) && len > BBFS_CINODE_INLINE) {
+        int ret = bbfs_write_symlink_block(file);
+        if (ret) {
+            file->i_size = 0;
+            clear_nlink(file);
+            discard_new_inode(file);
+            return ret;
         }
-        brelse(bh);
     }
-    return -1;
+    return bbfs_add_new_inode(dir, dentry, file);
 }
 
-static int bbfs_mkdir(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode) {
-    struct super_block *sb = dir->i_sb;
-    struct bbfs_sb_info *sbi = sb->s_fs_info;
-    struct bbfs_inode_info *dir_ci = BBFS_INODE(dir);
-
-    mode |= S_IFDIR;
-    for (int i = 0; i < dir_ci->disk_inode.l_num; i++) {
-        unsigned long blk_start = dir_ci->disk_inode.levels[i];
-        unsigned long blk_num = 1ul << i;
-        for (int j = blk_start; j < blk_start + blk_num; j++) {
-            struct buffer_head *bh = sb_bread(sb, sbi->block_begin + j);
-            for (int k = 0; k < PAGE_SIZE; k += sizeof(struct bbfs_entry)) {
-                struct bbfs_entry *ent = (struct bbfs_entry *)(bh->b_data + k);
-                if (!ent->valid) {
-                    struct inode *file = bbfs_new_inode(dir, mode);
-                    mark_inode_dirty(file);
-                    d_instantiate(dentry, file);
-                    ent->valid = 1;
-                    ent->type = DT_DIR;
-                    ent->ino = file->i_ino;
-                    strcpy(ent->name, dentry->d_name.name);
-                    mark_buffer_dirty(bh);
-                    brelse(bh);
-                    inode_inc_link_count(dir);
-                    return 0;
-                }
-            }
-            brelse(bh);
-        }
+/* Every namespace operation runs as one journal handle, so it commits or replays as a whole. */
+static int bbfs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl) {
+    int ret = bbfs_journal_start(dir->i_sb);
+    if (ret) {
+        return ret;
     }
+    ret = __bbfs_create(idmap, dir, dentry, mode, excl);
+    bbfs_journal_stop(dir->i_sb);
+    return ret;
+}
 
-    int level = dir_ci->disk_inode.l_num++;
-    unsigned long blk_start = bbfs_find_and_mark_free_block(sb, level);
-    dir_ci->disk_inode.levels[level] = blk_start;
-    mark_inode_dirty(dir);
-
-    unsigned long blk_num = 1ul << level;
-    for (int j = blk_start; j < blk_start + blk_num; j++) {
-        struct buffer_head *bh = sb_bread(sb, sbi->block_begin + j);
-        for (int k = 0; k < PAGE_SIZE; k += sizeof(struct bbfs_entry)) {
-            struct bbfs_entry *ent = (struct bbfs_entry *)(bh->b_data + k);
-            if (!ent->valid) {
-                struct inode *file = bbfs_new_inode(dir, mode);
-                ent->ino = file->i_ino;
-                mark_inode_dirty(file);
-                d_instantiate(dentry, file);
-                ent->valid = 1;
-                ent->type = DT_DIR;
-                strcpy(ent->name, dentry->d_name.name);
-                mark_buffer_dirty(bh);
-                brelse(bh);
-                inode_inc_link_count(dir);
-                return 0;
-            }
-        }
-        brelse(bh);
+static int bbfs_link(struct dentry *old_dentry, struct inode *dir, struct dentry *dentry) {
+    int ret = bbfs_journal_start(dir->i_sb);
+    if (ret) {
+        return ret;
     }
-    return -1;
+    ret = __bbfs_link(old_dentry, dir, dentry);
+    bbfs_journal_stop(dir->i_sb);
+    return ret;
 }
 
-static int bbfs_rmdir(struct inode *dir, struct dentry *dentry) {
-    struct super_block *sb = dir->i_sb;
-    struct bbfs_sb_info *sbi = sb->s_fs_info;
-    struct bbfs_inode_info *ci = BBFS_INODE(dir);
-    struct inode *file = dentry->d_inode;
-    bool found = false;
-
-    for (int i = 0; i < ci->disk_inode.l_num; i++) {
-        unsigned long blk_start = ci->disk_inode.levels[i];
-        unsigned long blk_num = 1ul << i;
-        for (int j = blk_start; j < blk_start + blk_num; j++) {
-            struct buffer_head *bh = sb_bread(sb, sbi->block_begin + j);
-            for (int k = 0; k < PAGE_SIZE; k += sizeof(struct bbfs_entry)) {
-                struct bbfs_entry *ent = (struct bbfs_entry *)(bh->b_data + k);
-                if (ent->valid && !strcmp(ent->name, dentry->d_name.name)) {
-                    found = true;
-                    memset(ent, 0, sizeof(struct bbfs_entry));
-                    mark_buffer_dirty(bh);
-                    inode_dec_link_count(file);
-                    break;
-                }
-            }
-            brelse(bh);
-            if (found) {
-                break;
-            }
-        }
-        if (found) {
-            break;
-        }
+static int bbfs_unlink(struct inode *dir, struct dentry *dentry) {
+    int ret = bbfs_journal_start(dir->i_sb);
+    if (ret) {
+        return ret;
     }
+    ret = __bbfs_unlink(dir, dentry);
+    bbfs_journal_stop(dir->i_sb);
+    return ret;
+}
 
-    if (file->i_nlink < 2) {
-        return 0;
+static int bbfs_rename(struct mnt_idmap *idmap, struct inode *old_dir, struct dentry *old_dentry, struct inode *new_dir,
+                       struct dentry *new_dentry, unsigned int flags) {
+    int ret = bbfs_journal_start(old_dir->i_sb);
+    if (ret) {
+        return ret;
     }
+    ret = __bbfs_rename(idmap, old_dir, old_dentry, new_dir, new_dentry, flags);
+    bbfs_journal_stop(old_dir->i_sb);
+    return ret;
+}
 
-    struct buffer_head *bh =
-        sb_bread(sb, sbi->imap_begin + file->i_ino / (sizeof(struct bbfs_imap_block) / sizeof(uint32_t)));
-    struct bbfs_imap_block *imap_blk = (struct bbfs_imap_block *)bh->b_data;
-    imap_blk->blocks[file->i_ino % (sizeof(struct bbfs_imap_block) / sizeof(uint32_t))] = 0;
-    mark_buffer_dirty(bh);
-    brelse(bh);
-    inode_dec_link_count(dir);
-    iput(file);
+static int bbfs_mkdir(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode) {
+    int ret = bbfs_journal_start(dir->i_sb);
+    if (ret) {
+        return ret;
+    }
+    ret = __bbfs_mkdir(idmap, dir, dentry, mode);
+    bbfs_journal_stop(dir->i_sb);
+    return ret;
+}
 
-    return 0;
+static int bbfs_rmdir(struct inode *dir, struct dentry *dentry) {
+    int ret = bbfs_journal_start(dir->i_sb);
+    if (ret) {
+        return ret;
+    }
+    ret = __bbfs_rmdir(dir, dentry);
+    bbfs_journal_stop(dir->i_sb);
+    return ret;
 }
 
 static int bbfs_symlink(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, const char *symname) {
-    struct super_block *sb = dir->i_sb;
-    struct bbfs_sb_info *sbi = sb->s_fs_info;
-    struct bbfs_inode_info *dir_ci = BBFS_INODE(dir);
-    struct bbfs_inode_info *file_ci;
-
-    for (int i = 0; i < dir_ci->disk_inode.l_num; i++) {
-        unsigned long blk_start = dir_ci->disk_inode.levels[i];
-        unsigned long blk_num = 1ul << i;
-        for (int j = blk_start; j < blk_start + blk_num; j++) {
-            struct buffer_head *bh = sb_bread(sb, sbi->block_begin + j);
-            for (int k = 0; k < PAGE_SIZE; k += sizeof(struct bbfs_entry)) {
-                struct bbfs_entry *ent = (struct bbfs_entry *)(bh->b_data + k);
-                if (!ent->valid) {
-                    struct inode *file = bbfs_new_inode(dir, S_IFLNK | S_IRWXUGO);
-                    file_ci = BBFS_INODE(file);
-                    file->i_link = file_ci->disk_inode.i_link;
-                    file_ci->disk_inode.i_size = strlen(symname);
-                    strcpy(file_ci->disk_inode.i_link, symname);
-                    mark_inode_dirty(file);
-                    ent->valid = 1;
-                    ent->type = DT_LNK;
-                    ent->ino = file->i_ino;
-                    strcpy(ent->name, dentry->d_name.name);
-                    mark_buffer_dirty(bh);
-                    brelse(bh);
-                    d_instantiate(dentry, file);
-                    return 0;
-                }
-            }
-            brelse(bh);
-        }
+    int ret = bbfs_journal_start(dir->i_sb);
+    if (ret) {
+        return ret;
     }
+    ret = __bbfs_symlink(idmap, dir, dentry, symname);
+    bbfs_journal_stop(dir->i_sb);
+    return ret;
+}
 
-    int level = dir_ci->disk_inode.l_num++;
-    unsigned long blk_start = bbfs_find_and_mark_free_block(sb, level);
-    dir_ci->disk_inode.levels[level] = blk_start;
-    mark_inode_dirty(dir);
-
-    unsigned long blk_num = 1ul << level;
-    for (int j = blk_start; j < blk_start + blk_num; j++) {
-        struct buffer_head *bh = sb_bread(sb, sbi->block_begin + j);
-        for (int k = 0; k < PAGE_SIZE; k += sizeof(struct bbfs_entry)) {
-            struct bbfs_entry *ent = (struct bbfs_entry *)(bh->b_data + k);
-            if (!ent->valid) {
-                struct inode *file = bbfs_new_inode(dir, S_IFLNK | S_IRWXUGO);
-                file_ci = BBFS_INODE(file);
-                file->i_link = file_ci->disk_inode.i_link;
-                file_ci->disk_inode.i_size = strlen(symname);
-                strcpy(file_ci->disk_inode.i_link, symname);
-                mark_inode_dirty(file);
-                ent->valid = 1;
-                ent->type = DT_LNK;
-                ent->ino = file->i_ino;
-                strcpy(ent->name, dentry->d_name.name);
-                mark_buffer_dirty(bh);
-                brelse(bh);
-                d_instantiate(dentry, file);
-                return 0;
-            }
+static int bbfs_setattr(struct mnt_idmap *idmap, struct dentry *dentry, struct iattr *attr) {
+    struct inode *inode = d_inode(dentry);
+
+    int ret = setattr_prepare(idmap, dentry, attr);
+    if (ret) {
+        return ret;
+    }
+    if (attr->ia_valid & ATTR_SIZE && S_ISREG(inode->i_mode)) {
+        filemap_invalidate_lock(inode->i_mapping);
+        ret = bbfs_truncate(inode, attr->ia_size);
+        filemap_invalidate_unlock(inode->i_mapping);
+        if (ret) {
+            return ret;
         }
-        brelse(bh);
     }
-    return -1;
+    setattr_copy(idmap, inode, attr);
+    mark_inode_dirty(inode);
+    return 0;
 }
 
 static const struct inode_operations bbfs_inode_ops = {
@@ -613,6 +803,7 @@ static const struct inode_operations bbfs_inode_ops = {
     .rmdir = bbfs_rmdir,
     .rename = bbfs_rename,
     .symlink = bbfs_symlink,
+    .setattr = bbfs_setattr,
 };
 
 static const char *bbfs_get_link(struct dentry *dentry, struct inode *inode, struct delayed_call *callback) {
@@ -0,0 +1,148 @@
+#ifndef __LINUX_KERNEL__
+#define __LINUX_KERNEL__
+#endif
+
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+
+#include "fs.h"
+
+/* The background thread sleeps this many times as long as zeroing the last region took. */
+#define BBFS_ITABLE_WAIT_MULT 10
+
+/*
+ * With lazy_itable, mkfs zeroes only the first region of the inode table. The others read as zeroes without I/O
+ * until they are initialized: zeroed on disk, then cleared in the superblock with a flush and FUA so the bit never
+ * reaches the disk ahead of the zeroes. The allocator stays out of uninitialized regions, so nothing is written there
+ * before that.
+ */
+int bbfs_itable_init_region(struct super_block *sb, unsigned long region) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    int ret = 0;
+
+    mutex_lock(&sbi->itable_lock);
+    if (!bbfs_itable_region_uninit(sbi, region)) {
+        goto out;
+    }
+    uint64_t first = sbi->inode_begin + (uint64_t)region * sbi->disk_sb.itable_region_blocks;
+    uint64_t nr = min_t(uint64_t, sbi->disk_sb.itable_region_blocks, sbi->inode_end - first);
+    ret = sb_issue_zeroout(sb, first, nr, GFP_NOFS);
+    if (ret) {
+        goto out;
+    }
+
+    struct buffer_head *bh = sb_bread(sb, 0);
+    if (!bh) {
+        ret = -EIO;
+        goto out;
+    }
+    lock_buffer(bh);
+    memcpy(bh->b_data, &sbi->disk_sb, sizeof(struct bbfs_sb));
+    ((struct bbfs_sb *)bh->b_data)->itable_uninit[region / 32] &= ~(1u << (region % 32));
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    ret = __sync_dirty_buffer(bh, REQ_SYNC | REQ_PREFLUSH | REQ_FUA);
+    brelse(bh);
+    if (!ret) {
+        WRITE_ONCE(sbi->disk_sb.itable_uninit[region / 32],
+                   sbi->disk_sb.itable_uninit[region / 32] & ~(1u << (region % 32)));
+    }
+out:
+    mutex_unlock(&sbi->itable_lock);
+    return ret;
+}
+
+static unsigned long bbfs_itable_next_uninit(struct bbfs_sb_info *sbi, unsigned long region) {
+    while (region < sbi->disk_sb.itable_regions && !bbfs_itable_region_uninit(sbi, region)) {
+        region++;
+    }
+    return region;
+}
+
+/* For the allocator once every free inode left is in an uninitialized region. */
+int bbfs_itable_init_any(struct super_block *sb) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    unsigned long region = bbfs_itable_next_uninit(sbi, 0);
+
+    if (region >= sbi->disk_sb.itable_regions) {
+        return -ENOSPC;
+    }
+    return bbfs_itable_init_region(sb, region);
+}
+
+/* A buffer for an inode block of an uninitialized region, zeroed in memory instead of read. */
+struct buffer_head *bbfs_itable_zero_block(struct super_block *sb, uint64_t blk) {
+    struct buffer_head *bh = sb_getblk(sb, blk);
+    if (!bh) {
+        return NULL;
+    }
+    lock_buffer(bh);
+    if (!buffer_uptodate(bh)) {
+        memset(bh->b_data, 0, bh->b_size);
+        set_buffer_uptodate(bh);
+    }
+    unlock_buffer(bh);
+    return bh;
+}
+
+static void bbfs_itable_idle(void) {
+    set_current_state(TASK_INTERRUPTIBLE);
+    if (!kthread_should_stop()) {
+        schedule();
+    }
+    __set_current_state(TASK_RUNNING);
+}
+
+static int bbfs_itable_thread(void *data) {
+    struct super_block *sb = data;
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    unsigned long region = 0;
+
+    set_user_nice(current, MAX_NICE);
+    while (!kthread_should_stop()) {
+        region = bbfs_itable_next_uninit(sbi, region);
+        if (region >= sbi->disk_sb.itable_regions) {
+            bbfs_itable_idle();
+            continue;
+        }
+        ktime_t start = ktime_get();
+        if (bbfs_itable_init_region(sb, region)) {
+            pr_warn("bbfs: zeroing inode table region %lu failed, leaving the rest to the allocator\n", region);
+            region = sbi->disk_sb.itable_regions;
+            continue;
+        }
+        schedule_timeout_interruptible(msecs_to_jiffies(ktime_ms_delta(ktime_get(), start) * BBFS_ITABLE_WAIT_MULT));
+    }
+    return 0;
+}
+
+int bbfs_itable_start(struct super_block *sb) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+
+    if (sb_rdonly(sb) || bbfs_itable_next_uninit(sbi, 0) >= sbi->disk_sb.itable_regions) {
+        return 0;
+    }
+    sbi->itable_thread = kthread_run(bbfs_itable_thread, sb, "bbfs-itable");
+    if (IS_ERR(sbi->itable_thread)) {
+        int ret = PTR_ERR(sbi->itable_thread);
+        sbi->itable_thread = NULL;
+        return ret;
+    }
+    return 0;
+}
+
+void bbfs_itable_stop(struct super_block *sb) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+
+    if (sbi->itable_thread) {
+        kthread_stop(sbi->itable_thread);
+        sbi->itable_thread = NULL;
+    }
+}
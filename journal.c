@@ -0,0 +1,851 @@
+#ifndef __LINUX_KERNEL__
+#define __LINUX_KERNEL__
+#endif
+
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/crc32.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/rwsem.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/wait.h>
+
+#include "fs.h"
+
+/*
+ * Blocks and bitmap ops a single handle may add to the running transaction. A handle that goes over only gets a
+ * warning: the transaction may run up to half again past max_blocks and max_ops, which still fits in the half of the
+ * log a commit always has, and commits as soon as it is past them.
+ */
+#define BBFS_JOURNAL_CREDITS 32
+#define BBFS_JOURNAL_OP_CREDITS 64
+#define BBFS_JOURNAL_INTERVAL (5 * HZ)
+
+/*
+ * Running: joined the running transaction and must not reach its home location before that commits.
+ * Logged: a committed copy is in the log, so the block is written home at the next checkpoint or revoked if freed.
+ */
+enum {
+    BH_BBFS_Running = BH_PrivateStart,
+    BH_BBFS_Logged,
+};
+
+BUFFER_FNS(BBFS_Running, bbfs_running)
+TAS_BUFFER_FNS(BBFS_Running, bbfs_running)
+BUFFER_FNS(BBFS_Logged, bbfs_logged)
+TAS_BUFFER_FNS(BBFS_Logged, bbfs_logged)
+
+struct bbfs_revoke {
+    uint64_t blk;
+    uint64_t seq;
+};
+
+/*
+ * Handles hold barrier for read while they modify metadata. A commit takes it for write only long enough to copy the
+ * running transaction into log buffers, so new handles proceed while the log is written, and every fsync that arrives
+ * during one commit is satisfied by the next.
+ */
+struct bbfs_journal {
+    struct super_block *sb;
+    uint64_t begin;
+    unsigned long len, head;
+    uint64_t seq, committed;
+    unsigned long max_blocks, max_ops;
+    struct rw_semaphore barrier;
+    struct mutex commit_mutex;
+    spinlock_t lock;
+    struct buffer_head **running;
+    unsigned long nr_running, blk_credits;
+    struct bbfs_journal_op *ops;
+    unsigned long nr_ops, op_credits;
+    uint64_t *revoked;
+    unsigned long nr_revoked;
+    struct buffer_head **checkpoint;
+    unsigned long nr_checkpoint;
+    struct bbfs_revoke *replay_revokes;
+    unsigned long nr_replay_revokes;
+    struct bbfs_journal_op *replay_ops;
+    unsigned long nr_replay_ops;
+    bool replayed;
+    struct task_struct *thread;
+    wait_queue_head_t wait;
+    int err;
+};
+
+struct bbfs_handle {
+    int depth;
+    unsigned long blocks, ops;
+};
+
+static struct bbfs_journal *bbfs_journal(struct super_block *sb) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    return sbi->journal;
+}
+
+/* Whether the running transaction has used up its share of the log and should commit without waiting for the timer. */
+static bool bbfs_journal_full(struct bbfs_journal *j) {
+    return !READ_ONCE(j->err) && (READ_ONCE(j->nr_running) >= j->max_blocks || READ_ONCE(j->nr_ops) >= j->max_ops);
+}
+
+static void bbfs_journal_charge(unsigned long *used, unsigned long credits) {
+    if (++*used > credits) {
+        pr_warn_once("bbfs: journal handle used more than %lu credits\n", credits);
+    }
+}
+
+static void bbfs_journal_abort(struct bbfs_journal *j, int err) {
+    if (!READ_ONCE(j->err)) {
+        WRITE_ONCE(j->err, err);
+        pr_err("bbfs: journal aborted (%d)\n", err);
+    }
+}
+
+static int bbfs_journal_write_sb(struct bbfs_journal *j) {
+    struct buffer_head *bh = sb_bread(j->sb, j->begin);
+    if (!bh) {
+        return -EIO;
+    }
+    lock_buffer(bh);
+    ((struct bbfs_journal_sb *)bh->b_data)->seq = j->seq;
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    int ret = sync_dirty_buffer(bh);
+    brelse(bh);
+    if (!ret) {
+        ret = blkdev_issue_flush(j->sb->s_bdev);
+    }
+    if (!ret) {
+        j->head = 1;
+    }
+    return ret;
+}
+
+/*
+ * Write every block committed since the last checkpoint, plus the bitmaps, to its home location and restart the log.
+ * Called right after a commit with barrier held for write, so the buffers hold exactly the committed contents.
+ */
+static int bbfs_journal_checkpoint(struct bbfs_journal *j) {
+    int ret = bbfs_sync_bitmaps(j->sb, 1);
+
+    for (unsigned long i = 0; i < j->nr_checkpoint; i++) {
+        struct buffer_head *bh = j->checkpoint[i];
+        if (test_clear_buffer_bbfs_logged(bh)) {
+            mark_buffer_dirty(bh);
+            write_dirty_buffer(bh, REQ_SYNC);
+        }
+    }
+    for (unsigned long i = 0; i < j->nr_checkpoint; i++) {
+        wait_on_buffer(j->checkpoint[i]);
+        if (!buffer_uptodate(j->checkpoint[i])) {
+            ret = -EIO;
+        }
+        brelse(j->checkpoint[i]);
+    }
+    j->nr_checkpoint = 0;
+    if (!ret) {
+        ret = blkdev_issue_flush(j->sb->s_bdev);
+    }
+    if (!ret) {
+        ret = bbfs_journal_write_sb(j);
+    }
+    if (ret) {
+        bbfs_journal_abort(j, ret);
+    }
+    return ret;
+}
+
+static struct buffer_head *bbfs_journal_getblk(struct bbfs_journal *j, unsigned long pos, unsigned int type,
+                                               unsigned int count) {
+    struct buffer_head *bh = sb_getblk(j->sb, j->begin + pos);
+    if (!bh) {
+        return NULL;
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, PAGE_SIZE);
+    if (type) {
+        struct bbfs_journal_header *h = (struct bbfs_journal_header *)bh->b_data;
+        h->magic = BBFS_JOURNAL_MAGIC;
+        h->type = type;
+        h->seq = j->seq;
+        h->count = count;
+    }
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    return bh;
+}
+
+/* Copy the running transaction into the log. Called with barrier held for write, which it drops. */
+static int bbfs_journal_do_commit(struct bbfs_journal *j) {
+    unsigned long n = j->nr_running, nops = j->nr_ops, nrev = j->nr_revoked;
+    unsigned long total = n + DIV_ROUND_UP(n, BBFS_JOURNAL_TAGS) + DIV_ROUND_UP(nops, BBFS_JOURNAL_OPS) +
+                          DIV_ROUND_UP(nrev, BBFS_JOURNAL_TAGS) + 1;
+    unsigned long nr = 0;
+    int ret = 0;
+    LIST_HEAD(discards);
+
+    if (!n && !nops && !nrev) {
+        up_write(&j->barrier);
+        return 0;
+    }
+    if (j->head + total > j->len) {
+        up_write(&j->barrier);
+        bbfs_journal_abort(j, -ENOSPC);
+        return -ENOSPC;
+    }
+    struct buffer_head **jbh = kvmalloc_array(total, sizeof(*jbh), GFP_NOFS);
+    if (!jbh) {
+        up_write(&j->barrier);
+        return -ENOMEM;
+    }
+
+    struct bbfs_journal_block *desc = NULL;
+    for (unsigned long i = 0; i < n; i++) {
+        if (i % BBFS_JOURNAL_TAGS == 0) {
+            unsigned long count = min_t(unsigned long, n - i, BBFS_JOURNAL_TAGS);
+            jbh[nr] = bbfs_journal_getblk(j, j->head + nr, BBFS_JBLOCK_DESC, count);
+            if (!jbh[nr]) {
+                goto fail;
+            }
+            desc = (struct bbfs_journal_block *)jbh[nr++]->b_data;
+        }
+        desc->blocks[i % BBFS_JOURNAL_TAGS] = j->running[i]->b_blocknr;
+        jbh[nr] = bbfs_journal_getblk(j, j->head + nr, 0, 0);
+        if (!jbh[nr]) {
+            goto fail;
+        }
+        memcpy(jbh[nr++]->b_data, j->running[i]->b_data, PAGE_SIZE);
+    }
+    for (unsigned long i = 0; i < nops; i += BBFS_JOURNAL_OPS) {
+        unsigned long count = min_t(unsigned long, nops - i, BBFS_JOURNAL_OPS);
+        jbh[nr] = bbfs_journal_getblk(j, j->head + nr, BBFS_JBLOCK_OPS, count);
+        if (!jbh[nr]) {
+            goto fail;
+        }
+        memcpy(((struct bbfs_journal_block *)jbh[nr++]->b_data)->ops, j->ops + i, count * sizeof(*j->ops));
+    }
+    for (unsigned long i = 0; i < nrev; i += BBFS_JOURNAL_TAGS) {
+        unsigned long count = min_t(unsigned long, nrev - i, BBFS_JOURNAL_TAGS);
+        jbh[nr] = bbfs_journal_getblk(j, j->head + nr, BBFS_JBLOCK_REVOKE, count);
+        if (!jbh[nr]) {
+            goto fail;
+        }
+        memcpy(((struct bbfs_journal_block *)jbh[nr++]->b_data)->blocks, j->revoked + i, count * sizeof(uint64_t));
+    }
+    uint32_t crc = ~0u;
+    for (unsigned long i = 0; i < nr; i++) {
+        crc = crc32_le(crc, jbh[i]->b_data, PAGE_SIZE);
+    }
+    jbh[nr] = bbfs_journal_getblk(j, j->head + nr, BBFS_JBLOCK_COMMIT, nr);
+    if (!jbh[nr]) {
+        goto fail;
+    }
+    ((struct bbfs_journal_header *)jbh[nr++]->b_data)->crc = crc;
+
+    spin_lock(&j->lock);
+    for (unsigned long i = 0; i < n; i++) {
+        struct buffer_head *bh = j->running[i];
+        clear_buffer_bbfs_running(bh);
+        if (test_set_buffer_bbfs_logged(bh)) {
+            put_bh(bh);
+        } else {
+            j->checkpoint[j->nr_checkpoint++] = bh;
+        }
+    }
+    j->nr_running = j->nr_ops = j->nr_revoked = 0;
+    uint64_t seq = j->seq++;
+    j->head += total;
+    spin_unlock(&j->lock);
+    /* The barrier keeps out new frees, so this is exactly what the transaction freed. */
+    struct bbfs_sb_info *sbi = BBFS_SB(j->sb);
+    spin_lock(&sbi->discard_lock);
+    list_splice_init(&sbi->discard_running, &discards);
+    spin_unlock(&sbi->discard_lock);
+
+    /* Once the log is half used, keep the barrier through the checkpoint so the buffers stay at this commit. */
+    bool wrap = j->len - j->head < j->len / 2;
+    if (!wrap) {
+        up_write(&j->barrier);
+    }
+
+    for (unsigned long i = 0; i < nr - 1; i++) {
+        mark_buffer_dirty(jbh[i]);
+        write_dirty_buffer(jbh[i], REQ_SYNC);
+    }
+    for (unsigned long i = 0; i < nr - 1; i++) {
+        wait_on_buffer(jbh[i]);
+        if (!buffer_uptodate(jbh[i])) {
+            ret = -EIO;
+        }
+    }
+    /* The flush also covers the blocks directory growth wrote in place before this commit. */
+    if (!ret) {
+        ret = blkdev_issue_flush(j->sb->s_bdev);
+    }
+    if (!ret) {
+        mark_buffer_dirty(jbh[nr - 1]);
+        write_dirty_buffer(jbh[nr - 1], REQ_SYNC | REQ_FUA);
+        wait_on_buffer(jbh[nr - 1]);
+        if (!buffer_uptodate(jbh[nr - 1])) {
+            ret = -EIO;
+        }
+    }
+    for (unsigned long i = 0; i < nr; i++) {
+        brelse(jbh[i]);
+    }
+    kvfree(jbh);
+
+    if (ret) {
+        bbfs_journal_abort(j, ret);
+    } else {
+        WRITE_ONCE(j->committed, seq);
+    }
+    bbfs_queue_discards(j->sb, &discards, !ret);
+    if (wrap) {
+        if (!ret) {
+            ret = bbfs_journal_checkpoint(j);
+        }
+        up_write(&j->barrier);
+    }
+    return ret;
+
+fail:
+    while (nr--) {
+        brelse(jbh[nr]);
+    }
+    kvfree(jbh);
+    up_write(&j->barrier);
+    return -ENOMEM;
+}
+
+/*
+ * Make transaction seq durable. Callers that queue up behind a commit find their work already done. flushed tells
+ * whether this call flushed the device cache itself, which only a commit started after the caller's writes does.
+ */
+static int bbfs_journal_commit_seq(struct bbfs_journal *j, uint64_t seq, bool *flushed) {
+    mutex_lock(&j->commit_mutex);
+    int ret = READ_ONCE(j->err);
+    if (!ret && READ_ONCE(j->committed) < seq) {
+        down_write(&j->barrier);
+        ret = bbfs_journal_do_commit(j);
+        if (flushed) {
+            *flushed = !ret;
+        }
+    }
+    mutex_unlock(&j->commit_mutex);
+    return ret;
+}
+
+int bbfs_journal_commit(struct super_block *sb) {
+    struct bbfs_journal *j = bbfs_journal(sb);
+
+    if (!j) {
+        return 0;
+    }
+    return bbfs_journal_commit_seq(j, READ_ONCE(j->seq), NULL);
+}
+
+/* Commit whatever transaction last logged the inode, or only its size and mapping for fdatasync. */
+int bbfs_journal_fsync(struct inode *inode, int datasync, bool *flushed) {
+    struct bbfs_journal *j = bbfs_journal(inode->i_sb);
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+    uint64_t seq = READ_ONCE(datasync ? ci->i_datasync_trans : ci->i_trans);
+
+    *flushed = false;
+    if (seq <= READ_ONCE(j->committed)) {
+        return READ_ONCE(j->err);
+    }
+    return bbfs_journal_commit_seq(j, seq, flushed);
+}
+
+/*
+ * Open a handle around a metadata update. Handles nest; only the outermost one reserves credits, and it waits for a
+ * commit when the running transaction could not take them. Must not be called with a handle's locks held elsewhere.
+ */
+int bbfs_journal_start(struct super_block *sb) {
+    struct bbfs_journal *j = bbfs_journal(sb);
+    struct bbfs_handle *h = current->journal_info;
+
+    if (!j) {
+        return 0;
+    }
+    if (h) {
+        h->depth++;
+        return 0;
+    }
+    h = kmalloc(sizeof(*h), GFP_NOFS);
+    if (!h) {
+        return -ENOMEM;
+    }
+    for (;;) {
+        spin_lock(&j->lock);
+        int ret = j->err;
+        if (!ret && j->nr_running + j->blk_credits + BBFS_JOURNAL_CREDITS <= j->max_blocks &&
+            j->nr_ops + j->op_credits + BBFS_JOURNAL_OP_CREDITS <= j->max_ops) {
+            j->blk_credits += BBFS_JOURNAL_CREDITS;
+            j->op_credits += BBFS_JOURNAL_OP_CREDITS;
+            spin_unlock(&j->lock);
+            break;
+        }
+        uint64_t seq = j->seq;
+        spin_unlock(&j->lock);
+        if (!ret) {
+            ret = bbfs_journal_commit_seq(j, seq, NULL);
+        }
+        if (ret) {
+            kfree(h);
+            return ret;
+        }
+    }
+    down_read(&j->barrier);
+    h->depth = 1;
+    h->blocks = h->ops = 0;
+    current->journal_info = h;
+    return 0;
+}
+
+void bbfs_journal_stop(struct super_block *sb) {
+    struct bbfs_journal *j = bbfs_journal(sb);
+    struct bbfs_handle *h = current->journal_info;
+
+    if (!j || --h->depth) {
+        return;
+    }
+    current->journal_info = NULL;
+    up_read(&j->barrier);
+    spin_lock(&j->lock);
+    j->blk_credits -= BBFS_JOURNAL_CREDITS;
+    j->op_credits -= BBFS_JOURNAL_OP_CREDITS;
+    spin_unlock(&j->lock);
+    kfree(h);
+}
+
+/*
+ * Add a modified metadata buffer to the running transaction. Without a journal it is simply marked dirty. A block
+ * that belongs to a single inode is passed with its owner, whose fsync then covers it.
+ */
+void bbfs_journal_dirty(struct super_block *sb, struct buffer_head *bh, struct inode *owner) {
+    struct bbfs_journal *j = bbfs_journal(sb);
+
+    if (!j) {
+        if (owner) {
+            mark_buffer_dirty_inode(bh, owner);
+        } else {
+            mark_buffer_dirty(bh);
+        }
+        return;
+    }
+    if (owner) {
+        bbfs_journal_inode(owner, true);
+    }
+    struct bbfs_handle *h = current->journal_info;
+    spin_lock(&j->lock);
+    if (!test_set_buffer_bbfs_running(bh)) {
+        if (h) {
+            bbfs_journal_charge(&h->blocks, BBFS_JOURNAL_CREDITS);
+        }
+        if (j->nr_running < j->max_blocks + j->max_blocks / 2) {
+            get_bh(bh);
+            j->running[j->nr_running++] = bh;
+        } else {
+            clear_buffer_bbfs_running(bh);
+            bbfs_journal_abort(j, -ENOSPC);
+        }
+        /* A block freed and reused within one transaction must not stay revoked. */
+        for (unsigned long i = 0; i < j->nr_revoked; i++) {
+            if (j->revoked[i] == bh->b_blocknr) {
+                j->revoked[i] = j->revoked[--j->nr_revoked];
+                break;
+            }
+        }
+    }
+    spin_unlock(&j->lock);
+    if (bbfs_journal_full(j)) {
+        wake_up(&j->wait);
+    }
+}
+
+/* Note that the running transaction holds the inode's metadata. Called within a handle, so the seq is stable. */
+void bbfs_journal_inode(struct inode *inode, bool datasync) {
+    struct bbfs_journal *j = bbfs_journal(inode->i_sb);
+    struct bbfs_inode_info *ci = BBFS_INODE(inode);
+
+    WRITE_ONCE(ci->i_trans, j->seq);
+    if (datasync) {
+        WRITE_ONCE(ci->i_datasync_trans, j->seq);
+    }
+}
+
+/* Record a bitmap update. Called under the owning group's lock. */
+void bbfs_journal_log(struct bbfs_sb_info *sbi, unsigned int type, uint64_t start, unsigned long count) {
+    struct bbfs_journal *j = sbi->journal;
+
+    if (!j) {
+        return;
+    }
+    struct bbfs_handle *h = current->journal_info;
+    spin_lock(&j->lock);
+    struct bbfs_journal_op *last = j->nr_ops ? &j->ops[j->nr_ops - 1] : NULL;
+    if (last && last->type == type && last->start + last->count == start && last->count + count <= U32_MAX) {
+        last->count += count;
+    } else {
+        if (h) {
+            bbfs_journal_charge(&h->ops, BBFS_JOURNAL_OP_CREDITS);
+        }
+        if (j->nr_ops < j->max_ops + j->max_ops / 2) {
+            j->ops[j->nr_ops++] = (struct bbfs_journal_op){.start = start, .count = count, .type = type};
+        } else {
+            bbfs_journal_abort(j, -ENOSPC);
+        }
+    }
+    spin_unlock(&j->lock);
+    if (bbfs_journal_full(j)) {
+        wake_up(&j->wait);
+    }
+}
+
+/*
+ * Metadata blocks are about to be freed. Drop them from the running transaction and revoke any logged copy, so that
+ * neither a checkpoint nor a replay writes stale metadata over whatever the blocks are reused for.
+ */
+void bbfs_journal_forget(struct super_block *sb, uint64_t blk, unsigned long nr) {
+    struct bbfs_journal *j = bbfs_journal(sb);
+
+    if (!j) {
+        return;
+    }
+    for (uint64_t b = blk; b < blk + nr; b++) {
+        struct buffer_head *bh = sb_find_get_block(sb, b);
+        if (!bh) {
+            continue;
+        }
+        spin_lock(&j->lock);
+        if (test_clear_buffer_bbfs_running(bh)) {
+            for (unsigned long i = 0; i < j->nr_running; i++) {
+                if (j->running[i] == bh) {
+                    j->running[i] = j->running[--j->nr_running];
+                    break;
+                }
+            }
+            put_bh(bh);
+        }
+        if (test_clear_buffer_bbfs_logged(bh)) {
+            if (j->nr_revoked < j->len) {
+                j->revoked[j->nr_revoked++] = b;
+            } else {
+                bbfs_journal_abort(j, -ENOSPC);
+            }
+        }
+        spin_unlock(&j->lock);
+        bforget(bh);
+    }
+}
+
+static int bbfs_journal_thread(void *data) {
+    struct bbfs_journal *j = data;
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible_timeout(j->wait, kthread_should_stop() || bbfs_journal_full(j), BBFS_JOURNAL_INTERVAL);
+        bbfs_journal_commit_seq(j, READ_ONCE(j->seq), NULL);
+    }
+    return 0;
+}
+
+/* Check the transaction at pos. Returns the position of its commit block, 0 if it is not complete, or an error. */
+static long bbfs_journal_validate(struct bbfs_journal *j, unsigned long pos, uint64_t seq) {
+    uint32_t crc = ~0u;
+
+    for (unsigned long p = pos; p < j->len;) {
+        struct buffer_head *bh = sb_bread(j->sb, j->begin + p);
+        if (!bh) {
+            return -EIO;
+        }
+        struct bbfs_journal_header *h = (struct bbfs_journal_header *)bh->b_data;
+        unsigned int type = h->type, count = h->count;
+        if (h->magic != BBFS_JOURNAL_MAGIC || h->seq != seq) {
+            brelse(bh);
+            return 0;
+        }
+        if (type == BBFS_JBLOCK_COMMIT) {
+            bool ok = h->crc == crc && count == p - pos;
+            brelse(bh);
+            return ok ? p : 0;
+        }
+        crc = crc32_le(crc, bh->b_data, PAGE_SIZE);
+        brelse(bh);
+        if (type < BBFS_JBLOCK_DESC || type > BBFS_JBLOCK_REVOKE ||
+            count > (type == BBFS_JBLOCK_OPS ? BBFS_JOURNAL_OPS : BBFS_JOURNAL_TAGS)) {
+            return 0;
+        }
+        p++;
+        for (unsigned long i = 0; type == BBFS_JBLOCK_DESC && i < count && p < j->len; i++, p++) {
+            bh = sb_bread(j->sb, j->begin + p);
+            if (!bh) {
+                return -EIO;
+            }
+            crc = crc32_le(crc, bh->b_data, PAGE_SIZE);
+            brelse(bh);
+        }
+    }
+    return 0;
+}
+
+static int bbfs_revoke_cmp(const void *a, const void *b) {
+    const struct bbfs_revoke *ra = a, *rb = b;
+    if (ra->blk != rb->blk) {
+        return ra->blk < rb->blk ? -1 : 1;
+    }
+    return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+/* Whether blk was revoked by transaction seq or a later one. Revokes are sorted by block, then sequence. */
+static bool bbfs_journal_revoked(struct bbfs_journal *j, uint64_t blk, uint64_t seq) {
+    unsigned long lo = 0, hi = j->nr_replay_revokes;
+
+    while (lo < hi) {
+        unsigned long mid = lo + (hi - lo) / 2;
+        if (j->replay_revokes[mid].blk <= blk) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo && j->replay_revokes[lo - 1].blk == blk && j->replay_revokes[lo - 1].seq >= seq;
+}
+
+/*
+ * Pass 0 collects revokes and counts ops, pass 1 writes the logged blocks home and gathers the ops for
+ * bbfs_journal_replay_maps. Both walk the same committed transactions.
+ */
+static int bbfs_journal_replay_pass(struct bbfs_journal *j, int pass, uint64_t *end_seq) {
+    struct bbfs_sb_info *sbi = BBFS_SB(j->sb);
+    unsigned long pos = 1;
+    uint64_t seq = j->seq;
+
+    for (;;) {
+        long end = bbfs_journal_validate(j, pos, seq);
+        if (end <= 0) {
+            *end_seq = seq;
+            return end;
+        }
+        while (pos < end) {
+            struct buffer_head *bh = sb_bread(j->sb, j->begin + pos);
+            if (!bh) {
+                return -EIO;
+            }
+            struct bbfs_journal_block *jb = (struct bbfs_journal_block *)bh->b_data;
+            unsigned int count = jb->h.count;
+            if (jb->h.type == BBFS_JBLOCK_DESC) {
+                for (unsigned int i = 0; pass && i < count; i++) {
+                    uint64_t blk = jb->blocks[i];
+                    if (blk >= sbi->block_end) {
+                        brelse(bh);
+                        return -EIO;
+                    }
+                    if (bbfs_journal_revoked(j, blk, seq)) {
+                        continue;
+                    }
+                    struct buffer_head *src = sb_bread(j->sb, j->begin + pos + 1 + i);
+                    struct buffer_head *dst = sb_getblk(j->sb, blk);
+                    if (!src || !dst) {
+                        brelse(src);
+                        brelse(dst);
+                        brelse(bh);
+                        return -EIO;
+                    }
+                    lock_buffer(dst);
+                    memcpy(dst->b_data, src->b_data, PAGE_SIZE);
+                    set_buffer_uptodate(dst);
+                    unlock_buffer(dst);
+                    mark_buffer_dirty(dst);
+                    brelse(dst);
+                    brelse(src);
+                }
+                pos += count;
+            } else if (jb->h.type == BBFS_JBLOCK_OPS) {
+                if (pass) {
+                    memcpy(j->replay_ops + j->nr_replay_ops, jb->ops, count * sizeof(*jb->ops));
+                }
+                j->nr_replay_ops += count;
+            } else if (jb->h.type == BBFS_JBLOCK_REVOKE && !pass) {
+                struct bbfs_revoke *r = krealloc_array(j->replay_revokes, j->nr_replay_revokes + count,
+                                                       sizeof(*r), GFP_KERNEL);
+                if (!r) {
+                    brelse(bh);
+                    return -ENOMEM;
+                }
+                for (unsigned int i = 0; i < count; i++) {
+                    r[j->nr_replay_revokes++] = (struct bbfs_revoke){.blk = jb->blocks[i], .seq = seq};
+                }
+                j->replay_revokes = r;
+            }
+            brelse(bh);
+            pos++;
+        }
+        pos = end + 1;
+        seq++;
+    }
+}
+
+static int bbfs_journal_replay(struct bbfs_journal *j) {
+    uint64_t end_seq;
+
+    int ret = bbfs_journal_replay_pass(j, 0, &end_seq);
+    if (ret || end_seq == j->seq) {
+        return ret;
+    }
+    sort(j->replay_revokes, j->nr_replay_revokes, sizeof(struct bbfs_revoke), bbfs_revoke_cmp, NULL);
+    if (j->nr_replay_ops) {
+        j->replay_ops = kvmalloc_array(j->nr_replay_ops, sizeof(*j->replay_ops), GFP_KERNEL);
+        if (!j->replay_ops) {
+            return -ENOMEM;
+        }
+    }
+    j->nr_replay_ops = 0;
+    ret = bbfs_journal_replay_pass(j, 1, &end_seq);
+    if (!ret) {
+        ret = sync_blockdev(j->sb->s_bdev);
+    }
+    if (ret) {
+        return ret;
+    }
+    pr_info("bbfs: replayed journal transactions %llu-%llu\n", j->seq, end_seq - 1);
+    j->seq = end_seq;
+    j->replayed = true;
+    return 0;
+}
+
+static void bbfs_journal_free(struct bbfs_journal *j) {
+    for (unsigned long i = 0; i < j->nr_running; i++) {
+        clear_buffer_bbfs_running(j->running[i]);
+        brelse(j->running[i]);
+    }
+    for (unsigned long i = 0; i < j->nr_checkpoint; i++) {
+        clear_buffer_bbfs_logged(j->checkpoint[i]);
+        brelse(j->checkpoint[i]);
+    }
+    kvfree(j->running);
+    kvfree(j->ops);
+    kvfree(j->revoked);
+    kvfree(j->checkpoint);
+    kfree(j->replay_revokes);
+    kvfree(j->replay_ops);
+    kfree(j);
+}
+
+/* Set up the journal and write committed transactions home. Runs before the bitmaps are loaded. */
+int bbfs_journal_load(struct super_block *sb) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+
+    if (!(sbi->disk_sb.features & BBFS_FEAT_JOURNAL)) {
+        return 0;
+    }
+    struct bbfs_journal *j = kzalloc(sizeof(*j), GFP_KERNEL);
+    if (!j) {
+        return -ENOMEM;
+    }
+    j->sb = sb;
+    j->begin = sbi->journal_begin;
+    j->len = sbi->journal_end - sbi->journal_begin;
+    j->head = 1;
+    j->max_blocks = j->len / 4;
+    j->max_ops = j->max_blocks * 4;
+    init_rwsem(&j->barrier);
+    mutex_init(&j->commit_mutex);
+    spin_lock_init(&j->lock);
+    init_waitqueue_head(&j->wait);
+    if (j->max_blocks < BBFS_JOURNAL_CREDITS) {
+        kfree(j);
+        return -EINVAL;
+    }
+    j->running = kvmalloc_array(j->len, sizeof(*j->running), GFP_KERNEL);
+    j->ops = kvmalloc_array(j->max_ops + j->max_ops / 2, sizeof(*j->ops), GFP_KERNEL);
+    j->revoked = kvmalloc_array(j->len, sizeof(*j->revoked), GFP_KERNEL);
+    j->checkpoint = kvmalloc_array(j->len, sizeof(*j->checkpoint), GFP_KERNEL);
+    if (!j->running || !j->ops || !j->revoked || !j->checkpoint) {
+        bbfs_journal_free(j);
+        return -ENOMEM;
+    }
+
+    struct buffer_head *bh = sb_bread(sb, j->begin);
+    if (!bh) {
+        bbfs_journal_free(j);
+        return -EIO;
+    }
+    struct bbfs_journal_sb *jsb = (struct bbfs_journal_sb *)bh->b_data;
+    int ret = jsb->magic == BBFS_JOURNAL_MAGIC && jsb->nr_blocks == j->len ? 0 : -EINVAL;
+    j->seq = jsb->seq;
+    brelse(bh);
+    if (!ret) {
+        ret = bbfs_journal_replay(j);
+    }
+    if (ret) {
+        bbfs_journal_free(j);
+        return ret;
+    }
+    j->committed = j->seq - 1;
+    sbi->journal = j;
+    return 0;
+}
+
+/* Apply the replayed bitmap ops to the freshly loaded in-memory maps. */
+int bbfs_journal_replay_maps(struct super_block *sb) {
+    struct bbfs_journal *j = bbfs_journal(sb);
+
+    for (unsigned long i = 0; j && i < j->nr_replay_ops; i++) {
+        int ret = bbfs_replay_map(sb, &j->replay_ops[i]);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* Finish a replay by checkpointing it, then start the commit thread. */
+int bbfs_journal_finish_load(struct super_block *sb) {
+    struct bbfs_journal *j = bbfs_journal(sb);
+
+    if (!j) {
+        return 0;
+    }
+    int ret = 0;
+    if (j->replayed) {
+        ret = bbfs_journal_checkpoint(j);
+    }
+    kfree(j->replay_revokes);
+    kvfree(j->replay_ops);
+    j->replay_revokes = NULL;
+    j->replay_ops = NULL;
+    j->nr_replay_revokes = j->nr_replay_ops = 0;
+    if (ret) {
+        return ret;
+    }
+    j->thread = kthread_run(bbfs_journal_thread, j, "bbfs-journal");
+    if (IS_ERR(j->thread)) {
+        ret = PTR_ERR(j->thread);
+        j->thread = NULL;
+    }
+    return ret;
+}
+
+void bbfs_journal_destroy(struct super_block *sb) {
+    struct bbfs_sb_info *sbi = BBFS_SB(sb);
+    struct bbfs_journal *j = sbi->journal;
+
+    if (!j) {
+        return;
+    }
+    if (j->thread) {
+        kthread_stop(j->thread);
+        if (!bbfs_journal_commit_seq(j, j->seq, NULL)) {
+            down_write(&j->barrier);
+            bbfs_journal_checkpoint(j);
+            up_write(&j->barrier);
+        }
+    }
+    sbi->journal = NULL;
+    bbfs_journal_free(j);
+}
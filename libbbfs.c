@@ -0,0 +1,1136 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libbbfs.h"
+#include "disk.h"
+
+static bool bbfs_img_feature(struct bbfs_img *img, uint32_t flag) { return img->sb->features & flag; }
+
+static unsigned int bbfs_ilog2(uint64_t n) { return 63 - __builtin_clzll(n); }
+
+static unsigned int bbfs_order_base_2(uint64_t n) { return n <= 1 ? 0 : 64 - __builtin_clzll(n - 1); }
+
+static uint64_t bbfs_img_level_blocks(struct bbfs_img_inode *inode, unsigned int l) {
+    return l + 1 == inode->l_num && inode->l_tail ? inode->l_tail : 1ull << l;
+}
+
+void bbfs_layout(const struct bbfs_sb *sb, struct bbfs_layout *layout) {
+    bool is64 = sb->features & BBFS_FEAT_64BIT;
+
+    layout->nr_inodes = sb->nr_inodes | (is64 ? (uint64_t)sb->nr_inodes_hi << 32 : 0);
+    layout->nr_blocks = sb->nr_blocks | (is64 ? (uint64_t)sb->nr_blocks_hi << 32 : 0);
+    layout->journal_begin = sb->nr_sb;
+    layout->imap_begin = layout->journal_begin + (sb->features & BBFS_FEAT_JOURNAL ? sb->nr_journal : 0);
+    layout->bmap_begin = layout->imap_begin + sb->nr_imap;
+    layout->inode_begin = layout->bmap_begin + sb->nr_bmap;
+    if (sb->features & BBFS_FEAT_COMPACT_INODE) {
+        layout->block_begin = layout->inode_begin + (layout->nr_inodes + BBFS_INODES_PER_BLOCK - 1) /
+                                                        BBFS_INODES_PER_BLOCK;
+    } else {
+        layout->block_begin = layout->inode_begin + layout->nr_inodes;
+    }
+    layout->block_end = layout->block_begin + layout->nr_blocks;
+}
+
+/* The same checks bbfs_fill_super makes before trusting the geometry. */
+static int bbfs_img_check_sb(struct bbfs_img *img) {
+    struct bbfs_sb *sb = img->sb;
+    struct bbfs_layout *layout = &img->layout;
+
+    if (sb->magic != BBFS_MAGIC || sb->features & ~BBFS_FEAT_ALL || sb->nr_sb != sizeof(*sb) / BBFS_BLOCK_SIZE) {
+        return -EINVAL;
+    }
+    bbfs_layout(sb, layout);
+    uint64_t entries = bbfs_img_map_entries(img);
+    if (!layout->nr_inodes || layout->block_end > img->size / BBFS_BLOCK_SIZE ||
+        (uint64_t)sb->nr_imap * entries < layout->nr_inodes || (uint64_t)sb->nr_bmap * entries < layout->nr_blocks) {
+        return -EINVAL;
+    }
+
+    if (sb->features & BBFS_FEAT_LAZY_ITABLE && sb->itable_regions) {
+        uint64_t region_blocks = sb->itable_region_blocks;
+        uint64_t inode_blocks = layout->block_begin - layout->inode_begin;
+        if (sb->itable_regions > BBFS_ITABLE_MAX_REGIONS || !region_blocks ||
+            region_blocks * sb->itable_regions < inode_blocks ||
+            region_blocks * (sb->itable_regions - 1) >= inode_blocks) {
+            return -EINVAL;
+        }
+        img->region_inodes = region_blocks * (sb->features & BBFS_FEAT_COMPACT_INODE ? BBFS_INODES_PER_BLOCK : 1);
+    }
+    return 0;
+}
+
+/* The kernel's crc32_le, without the final inversion. */
+static uint32_t bbfs_crc32_le(uint32_t crc, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) {
+            crc = crc >> 1 ^ (crc & 1 ? 0xedb88320 : 0);
+        }
+    }
+    return crc;
+}
+
+/*
+ * Whether the log starts with a complete transaction, the same test as bbfs_journal_validate. The image is only
+ * consistent once a mount has replayed it.
+ */
+int bbfs_img_journal_dirty(struct bbfs_img *img) {
+    uint64_t begin = img->layout.journal_begin;
+    struct bbfs_journal_sb *jsb = (struct bbfs_journal_sb *)bbfs_img_block(img, begin);
+    uint32_t crc = ~0u;
+
+    if (!bbfs_img_feature(img, BBFS_FEAT_JOURNAL)) {
+        return 0;
+    }
+    if (jsb->magic != BBFS_JOURNAL_MAGIC || jsb->nr_blocks != img->sb->nr_journal) {
+        return -EINVAL;
+    }
+    for (uint64_t p = 1; p < jsb->nr_blocks;) {
+        struct bbfs_journal_header *h = (struct bbfs_journal_header *)bbfs_img_block(img, begin + p);
+        if (h->magic != BBFS_JOURNAL_MAGIC || h->seq != jsb->seq) {
+            return 0;
+        }
+        if (h->type == BBFS_JBLOCK_COMMIT) {
+            return h->crc == crc && h->count == p - 1;
+        }
+        crc = bbfs_crc32_le(crc, h, BBFS_BLOCK_SIZE);
+        if (h->type < BBFS_JBLOCK_DESC || h->type > BBFS_JBLOCK_REVOKE ||
+            h->count > (h->type == BBFS_JBLOCK_OPS ? BBFS_JOURNAL_OPS : BBFS_JOURNAL_TAGS)) {
+            return 0;
+        }
+        p++;
+        for (uint32_t i = 0; h->type == BBFS_JBLOCK_DESC && i < h->count && p < jsb->nr_blocks; i++, p++) {
+            crc = bbfs_crc32_le(crc, bbfs_img_block(img, begin + p), BBFS_BLOCK_SIZE);
+        }
+    }
+    return 0;
+}
+
+int bbfs_img_open(struct bbfs_img *img, const char *path, int flags) {
+    bool write = flags & BBFS_IMG_WRITE;
+    struct stat stat_buf;
+    int ret;
+
+    memset(img, 0, sizeof(*img));
+    img->flags = flags;
+    img->map = MAP_FAILED;
+    img->fd = open(path, (write ? O_RDWR : O_RDONLY) | (flags & BBFS_IMG_EXCL ? O_EXCL : 0));
+    if (img->fd == -1) {
+        return -errno;
+    }
+    if (fstat(img->fd, &stat_buf)) {
+        ret = -errno;
+        goto err;
+    }
+    if ((stat_buf.st_mode & S_IFMT) == S_IFBLK && ioctl(img->fd, BLKGETSIZE64, &stat_buf.st_size)) {
+        ret = -errno;
+        goto err;
+    }
+    img->size = stat_buf.st_size;
+    if (img->size < sizeof(struct bbfs_sb)) {
+        ret = -EINVAL;
+        goto err;
+    }
+    img->map = mmap(NULL, img->size, PROT_READ | (write ? PROT_WRITE : 0), MAP_SHARED, img->fd, 0);
+    if (img->map == MAP_FAILED) {
+        ret = -errno;
+        goto err;
+    }
+    img->sb = (struct bbfs_sb *)img->map;
+    ret = bbfs_img_check_sb(img);
+    if (!ret && write && bbfs_img_journal_dirty(img)) {
+        ret = -EUCLEAN;
+    }
+    if (ret) {
+        goto err;
+    }
+    return 0;
+err:
+    if (img->map != MAP_FAILED) {
+        munmap(img->map, img->size);
+    }
+    close(img->fd);
+    return ret;
+}
+
+int bbfs_img_close(struct bbfs_img *img) {
+    int ret = 0;
+
+    if (img->flags & BBFS_IMG_WRITE && (msync(img->map, img->size, MS_SYNC) || fsync(img->fd))) {
+        ret = -errno;
+    }
+    for (uint64_t g = 0; img->groups && g < img->nr_groups; g++) {
+        free(img->groups[g].buddy);
+    }
+    free(img->groups);
+    munmap(img->map, img->size);
+    close(img->fd);
+    return ret;
+}
+
+void *bbfs_img_inode_raw(struct bbfs_img *img, uint64_t ino) {
+    if (bbfs_img_feature(img, BBFS_FEAT_COMPACT_INODE)) {
+        char *data = bbfs_img_block(img, img->layout.inode_begin + ino / BBFS_INODES_PER_BLOCK);
+        return data + ino % BBFS_INODES_PER_BLOCK * sizeof(struct bbfs_cinode);
+    }
+    return bbfs_img_block(img, img->layout.inode_begin + ino);
+}
+
+int bbfs_img_ino_uninit(struct bbfs_img *img, uint64_t ino) {
+    if (!img->region_inodes) {
+        return 0;
+    }
+    uint64_t region = ino / img->region_inodes;
+    return !!(img->sb->itable_uninit[region / 32] & (1u << (region % 32)));
+}
+
+uint64_t bbfs_img_map_entries(struct bbfs_img *img) {
+    return bbfs_img_feature(img, BBFS_FEAT_PACKED_BITMAP) ? BBFS_BLOCK_SIZE * 8 : BBFS_BLOCK_SIZE / sizeof(uint32_t);
+}
+
+/* Bit or entry i of the bitmap starting at block begin, in either format. */
+int bbfs_img_test_map(struct bbfs_img *img, uint64_t begin, uint64_t i) {
+    uint64_t entries = bbfs_img_map_entries(img);
+    char *data = bbfs_img_block(img, begin + i / entries);
+
+    i %= entries;
+    if (bbfs_img_feature(img, BBFS_FEAT_PACKED_BITMAP)) {
+        return data[i / 8] >> (i % 8) & 1;
+    }
+    return ((uint32_t *)data)[i] != 0;
+}
+
+/* Bits or entries i to i + 63 of the bitmap starting at block begin, i a multiple of 64, as a word of used bits. */
+static uint64_t bbfs_img_map_word(struct bbfs_img *img, uint64_t begin, uint64_t i) {
+    uint64_t entries = bbfs_img_map_entries(img), word = 0;
+    char *data = bbfs_img_block(img, begin + i / entries);
+
+    i %= entries;
+    if (bbfs_img_feature(img, BBFS_FEAT_PACKED_BITMAP)) {
+        for (int byte = 7; byte >= 0; byte--) {
+            word = word << 8 | (uint8_t)data[i / 8 + byte];
+        }
+        return word;
+    }
+    for (int bit = 63; bit >= 0; bit--) {
+        word = word << 1 | (((uint32_t *)data)[i + bit] != 0);
+    }
+    return word;
+}
+
+void bbfs_img_set_map(struct bbfs_img *img, uint64_t begin, uint64_t i, int val) {
+    uint64_t entries = bbfs_img_map_entries(img);
+    char *data = bbfs_img_block(img, begin + i / entries);
+
+    i %= entries;
+    if (bbfs_img_feature(img, BBFS_FEAT_PACKED_BITMAP)) {
+        uint8_t *byte = (uint8_t *)data + i / 8;
+        *byte = val ? *byte | 1u << (i % 8) : *byte & ~(1u << (i % 8));
+    } else {
+        ((uint32_t *)data)[i] = val;
+    }
+}
+
+/* Group geometry and buddy trees as bbfs_load_bitmaps sets them up. */
+int bbfs_img_load_maps(struct bbfs_img *img) {
+    struct bbfs_sb *sb = img->sb;
+    uint64_t nr_inodes = img->layout.nr_inodes, nr_blocks = img->layout.nr_blocks;
+
+    if (sb->nr_groups) {
+        img->nr_groups = sb->nr_groups;
+        img->group_inodes = sb->group_inodes;
+        img->group_blocks = sb->group_blocks;
+        if (img->nr_groups > 1 && (img->group_inodes % 64 || img->group_blocks % 64)) {
+            return -EINVAL;
+        }
+    } else {
+        img->nr_groups = 1;
+        img->group_inodes = nr_inodes;
+        img->group_blocks = nr_blocks;
+    }
+    if (!img->group_inodes || !img->group_blocks || img->nr_groups * img->group_inodes > nr_inodes ||
+        (img->nr_groups - 1) * img->group_blocks >= nr_blocks || img->nr_groups * img->group_blocks < nr_blocks) {
+        return -EINVAL;
+    }
+
+    img->groups = calloc(img->nr_groups, sizeof(*img->groups));
+    if (!img->groups) {
+        return -ENOMEM;
+    }
+    for (uint64_t g = 0; g < img->nr_groups; g++) {
+        struct bbfs_img_group *grp = &img->groups[g];
+        grp->ino_start = grp->i_next = g * img->group_inodes;
+        grp->nr_inodes = img->group_inodes;
+        for (uint64_t ino = grp->ino_start; ino < grp->ino_start + grp->nr_inodes; ino++) {
+            grp->free_inodes += !bbfs_img_test_map(img, img->layout.imap_begin, ino);
+        }
+        grp->blk_start = g * img->group_blocks;
+        grp->nr_blocks = nr_blocks - grp->blk_start < img->group_blocks ? nr_blocks - grp->blk_start
+                                                                         : img->group_blocks;
+        unsigned int order = bbfs_buddy_order(bbfs_order_base_2(grp->nr_blocks));
+        grp->buddy = calloc(bbfs_buddy_size(order), 1);
+        if (!grp->buddy) {
+            return -ENOMEM;
+        }
+        bbfs_buddy_init(grp->buddy, order);
+        for (uint64_t i = 0; i < grp->nr_blocks; i += 64) {
+            uint64_t used = bbfs_img_map_word(img, img->layout.bmap_begin, grp->blk_start + i);
+            grp->buddy->words[i / 64] = ~used & (grp->nr_blocks - i < 64 ? (1ull << (grp->nr_blocks - i)) - 1 : ~0ull);
+        }
+        bbfs_buddy_build(grp->buddy);
+    }
+    return 0;
+}
+
+static void bbfs_img_mark_blocks(struct bbfs_img *img, struct bbfs_img_group *grp, uint64_t blk_start, uint64_t nr,
+                                 bool free) {
+    bbfs_buddy_update(grp->buddy, blk_start - grp->blk_start, blk_start - grp->blk_start + nr, free);
+    for (uint64_t blk = blk_start; blk < blk_start + nr; blk++) {
+        bbfs_img_set_map(img, img->layout.bmap_begin, blk, !free);
+    }
+}
+
+/* A level bigger than a group takes a run of whole, entirely free groups. */
+static uint64_t bbfs_img_alloc_span(struct bbfs_img *img, unsigned int level) {
+    uint64_t nr = 1ull << level;
+    uint64_t span = (nr + img->group_blocks - 1) / img->group_blocks;
+
+    for (uint64_t first = 0; first + span <= img->nr_groups; first++) {
+        uint64_t g;
+        for (g = first; g < first + span; g++) {
+            struct bbfs_img_group *grp = &img->groups[g];
+            if (grp->nr_blocks != img->group_blocks || grp->buddy->tree[1] != grp->buddy->order + 1) {
+                break;
+            }
+        }
+        if (g < first + span) {
+            continue;
+        }
+        for (g = first; g < first + span; g++) {
+            struct bbfs_img_group *grp = &img->groups[g];
+            uint64_t taken = (g - first) * img->group_blocks;
+            bbfs_img_mark_blocks(img, grp, grp->blk_start, nr - taken < grp->nr_blocks ? nr - taken : grp->nr_blocks,
+                                 false);
+        }
+        return first * img->group_blocks;
+    }
+    return UINT64_MAX;
+}
+
+/* The policy of bbfs_find_and_mark_free_block: an aligned run of 1 << level, starting from the inode's group. */
+uint64_t bbfs_img_alloc_blocks(struct bbfs_img *img, uint64_t ino, unsigned int level) {
+    uint64_t start = ino / img->group_inodes;
+
+    if (level >= 64) {
+        return UINT64_MAX;
+    }
+    for (uint64_t n = 0; n < img->nr_groups; n++) {
+        struct bbfs_img_group *grp = &img->groups[(start + n) % img->nr_groups];
+        long blk_start = bbfs_buddy_find(grp->buddy, level);
+        if (blk_start >= 0) {
+            bbfs_img_mark_blocks(img, grp, grp->blk_start + blk_start, 1ull << level, false);
+            return grp->blk_start + blk_start;
+        }
+    }
+    if ((1ull << level) > img->group_blocks) {
+        return bbfs_img_alloc_span(img, level);
+    }
+    return UINT64_MAX;
+}
+
+void bbfs_img_free_blocks(struct bbfs_img *img, uint64_t blk_start, uint64_t nr) {
+    while (nr) {
+        struct bbfs_img_group *grp = &img->groups[blk_start / img->group_blocks];
+        uint64_t left = grp->blk_start + grp->nr_blocks - blk_start;
+        uint64_t n = left < nr ? left : nr;
+        bbfs_img_mark_blocks(img, grp, blk_start, n, true);
+        blk_start += n;
+        nr -= n;
+    }
+}
+
+static uint64_t bbfs_img_next_free_ino(struct bbfs_img *img, uint64_t ino, uint64_t ino_end) {
+    for (;;) {
+        while (ino < ino_end && bbfs_img_test_map(img, img->layout.imap_begin, ino)) {
+            ino++;
+        }
+        if (ino >= ino_end || !bbfs_img_ino_uninit(img, ino)) {
+            return ino;
+        }
+        ino = (ino / img->region_inodes + 1) * img->region_inodes;
+    }
+}
+
+/* Zero the first uninitialized region of the inode table and clear its bit, as bbfs_itable_init_region does. */
+static int bbfs_img_init_region(struct bbfs_img *img) {
+    struct bbfs_sb *sb = img->sb;
+
+    for (uint64_t r = 0; r < sb->itable_regions; r++) {
+        if (!(sb->itable_uninit[r / 32] & (1u << (r % 32)))) {
+            continue;
+        }
+        uint64_t first = img->layout.inode_begin + r * sb->itable_region_blocks;
+        uint64_t nr = img->layout.block_begin - first < sb->itable_region_blocks ? img->layout.block_begin - first
+                                                                                  : sb->itable_region_blocks;
+        memset(bbfs_img_block(img, first), 0, nr * BBFS_BLOCK_SIZE);
+        sb->itable_uninit[r / 32] &= ~(1u << (r % 32));
+        return 0;
+    }
+    return -ENOSPC;
+}
+
+/* The policy of bbfs_find_and_mark_free_inode. Directories are spread over the groups, files follow their parent. */
+uint64_t bbfs_img_alloc_ino(struct bbfs_img *img, uint64_t dir_ino, uint32_t mode) {
+    uint64_t start = S_ISDIR(mode) ? img->dir_group++ : dir_ino / img->group_inodes;
+
+    do {
+        for (uint64_t n = 0; n < img->nr_groups; n++) {
+            struct bbfs_img_group *grp = &img->groups[(start + n) % img->nr_groups];
+            if (!grp->free_inodes) {
+                continue;
+            }
+            uint64_t ino_end = grp->ino_start + grp->nr_inodes;
+            uint64_t ino = bbfs_img_next_free_ino(img, grp->i_next, ino_end);
+            if (ino >= ino_end) {
+                ino = bbfs_img_next_free_ino(img, grp->ino_start, ino_end);
+            }
+            if (ino < ino_end) {
+                bbfs_img_set_map(img, img->layout.imap_begin, ino, 1);
+                grp->free_inodes--;
+                grp->i_next = ino + 1;
+                return ino;
+            }
+        }
+    } while (!bbfs_img_init_region(img));
+    return UINT64_MAX;
+}
+
+void bbfs_img_free_ino(struct bbfs_img *img, uint64_t ino) {
+    struct bbfs_img_group *grp = &img->groups[ino / img->group_inodes];
+
+    bbfs_img_set_map(img, img->layout.imap_begin, ino, 0);
+    grp->free_inodes++;
+    if (ino < grp->i_next) {
+        grp->i_next = ino;
+    }
+}
+
+static void bbfs_img_get_levels(uint64_t *levels, const uint32_t *lo, const uint32_t *hi, unsigned int nr) {
+    for (unsigned int i = 0; i < nr; i++) {
+        if (hi) {
+            levels[i] = (uint64_t)hi[i] << 32 | lo[i];
+        } else {
+            levels[i] = lo[i] == UINT32_MAX ? BBFS_LEVEL_HOLE : lo[i];
+        }
+    }
+}
+
+static void bbfs_img_put_levels(uint32_t *lo, uint32_t *hi, const uint64_t *levels, unsigned int nr) {
+    for (unsigned int i = 0; i < nr; i++) {
+        lo[i] = levels[i];
+        if (hi) {
+            hi[i] = levels[i] >> 32;
+        }
+    }
+}
+
+/* Decode an inode the way bbfs_iget does. Free inodes, and those in uninitialized regions, give -ENOENT. */
+int bbfs_img_iget(struct bbfs_img *img, uint64_t ino, struct bbfs_img_inode *inode) {
+    bool is64 = bbfs_img_feature(img, BBFS_FEAT_64BIT);
+
+    if (ino >= img->layout.nr_inodes) {
+        return -EINVAL;
+    }
+    memset(inode, 0, sizeof(*inode));
+    inode->ino = ino;
+    if (bbfs_img_ino_uninit(img, ino)) {
+        return -ENOENT;
+    }
+    struct bbfs_inode *di = bbfs_img_inode_raw(img, ino);
+    if (!(di->i_flags & BBFS_INODE_VALID)) {
+        return -ENOENT;
+    }
+    inode->flags = di->i_flags;
+    inode->mode = di->i_mode;
+    inode->nlink = di->i_nlink;
+    inode->size = di->i_size;
+    if (S_ISLNK(inode->mode) || inode->flags & BBFS_INODE_INLINE) {
+        return 0;
+    }
+
+    if (!bbfs_img_feature(img, BBFS_FEAT_COMPACT_INODE)) {
+        inode->l_num = di->l_num;
+        inode->l_tail = di->l_tail;
+        inode->l_unwritten = di->l_unwritten;
+        if (inode->l_num > BBFS_MAX_LEVELS) {
+            return -EIO;
+        }
+        bbfs_img_get_levels(inode->levels, di->levels, is64 ? di->levels_hi : NULL, inode->l_num);
+        inode->size |= is64 ? (uint64_t)di->i_size_hi << 32 : 0;
+    } else {
+        struct bbfs_cinode *ci = (struct bbfs_cinode *)di;
+        inode->l_num = ci->l_num;
+        inode->l_tail = ci->l_tail;
+        inode->l_unwritten = ci->l_unwritten;
+        inode->l_overflow = ci->l_overflow | (is64 ? (uint64_t)ci->l_overflow_hi << 32 : 0);
+        if (inode->l_num > BBFS_MAX_LEVELS) {
+            return -EIO;
+        }
+        unsigned int nr = inode->l_num < BBFS_CINODE_LEVELS ? inode->l_num : BBFS_CINODE_LEVELS;
+        bbfs_img_get_levels(inode->levels, ci->levels, is64 ? ci->levels_hi : NULL, nr);
+        inode->size |= is64 ? (uint64_t)ci->i_size_hi << 32 : 0;
+        if (inode->l_num > BBFS_CINODE_LEVELS) {
+            if (inode->l_overflow >= img->layout.nr_blocks) {
+                return -EIO;
+            }
+            uint32_t *lo = (uint32_t *)bbfs_img_block(img, img->layout.block_begin + inode->l_overflow);
+            bbfs_img_get_levels(inode->levels + BBFS_CINODE_LEVELS, lo, is64 ? lo + BBFS_CINODE_LEVELS : NULL,
+                                inode->l_num - BBFS_CINODE_LEVELS);
+        }
+    }
+    if (inode->l_tail && (!inode->l_num || inode->l_tail >= 1u << (inode->l_num - 1))) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Write an inode back. Inline data and symlink targets are left alone, so only their header changes. */
+void bbfs_img_iput(struct bbfs_img *img, struct bbfs_img_inode *inode) {
+    bool is64 = bbfs_img_feature(img, BBFS_FEAT_64BIT);
+    struct bbfs_inode *di = bbfs_img_inode_raw(img, inode->ino);
+
+    di->i_flags = inode->flags;
+    di->i_mode = inode->mode;
+    di->i_nlink = inode->nlink;
+    di->i_size = inode->size;
+    if (!(inode->flags & BBFS_INODE_VALID) || S_ISLNK(inode->mode) || inode->flags & BBFS_INODE_INLINE) {
+        return;
+    }
+
+    if (!bbfs_img_feature(img, BBFS_FEAT_COMPACT_INODE)) {
+        memset(&di->l_num, 0, sizeof(*di) - offsetof(struct bbfs_inode, l_num));
+        di->l_num = inode->l_num;
+        di->l_tail = inode->l_tail;
+        di->l_unwritten = inode->l_unwritten;
+        bbfs_img_put_levels(di->levels, is64 ? di->levels_hi : NULL, inode->levels, inode->l_num);
+        di->i_size_hi = is64 ? inode->size >> 32 : 0;
+        return;
+    }
+
+    struct bbfs_cinode *ci = (struct bbfs_cinode *)di;
+    memset(&ci->l_num, 0, sizeof(*ci) - offsetof(struct bbfs_cinode, l_num));
+    ci->l_num = inode->l_num;
+    ci->l_tail = inode->l_tail;
+    ci->l_unwritten = inode->l_unwritten;
+    ci->l_overflow = inode->l_overflow;
+    unsigned int nr = inode->l_num < BBFS_CINODE_LEVELS ? inode->l_num : BBFS_CINODE_LEVELS;
+    bbfs_img_put_levels(ci->levels, is64 ? ci->levels_hi : NULL, inode->levels, nr);
+    if (is64) {
+        ci->l_overflow_hi = inode->l_overflow >> 32;
+        ci->i_size_hi = inode->size >> 32;
+    }
+    if (inode->l_num > BBFS_CINODE_LEVELS) {
+        uint32_t *lo = (uint32_t *)bbfs_img_block(img, img->layout.block_begin + inode->l_overflow);
+        bbfs_img_put_levels(lo, is64 ? lo + BBFS_CINODE_LEVELS : NULL, inode->levels + BBFS_CINODE_LEVELS,
+                            inode->l_num - BBFS_CINODE_LEVELS);
+    }
+}
+
+/* Map level to blk_start, as bbfs_add_level does; the slots skipped on the way become holes. */
+int bbfs_img_add_level(struct bbfs_img *img, struct bbfs_img_inode *inode, unsigned int level, uint64_t blk_start) {
+    if (level >= BBFS_MAX_LEVELS) {
+        return -EFBIG;
+    }
+    if (bbfs_img_feature(img, BBFS_FEAT_COMPACT_INODE) && inode->l_num <= BBFS_CINODE_LEVELS &&
+        level >= BBFS_CINODE_LEVELS) {
+        uint64_t blk = bbfs_img_alloc_blocks(img, inode->ino, 0);
+        if (blk == UINT64_MAX) {
+            return -ENOSPC;
+        }
+        inode->l_overflow = blk;
+    }
+    while (inode->l_num < level) {
+        inode->levels[inode->l_num++] = BBFS_LEVEL_HOLE;
+    }
+    inode->levels[level] = blk_start;
+    inode->l_num = inode->l_num > level + 1 ? inode->l_num : level + 1;
+    return 0;
+}
+
+/* Free every level from keep up, along with any holes that would be left at the end. */
+void bbfs_img_release_levels(struct bbfs_img *img, struct bbfs_img_inode *inode, unsigned int keep) {
+    while (inode->l_num > keep || (inode->l_num && inode->levels[inode->l_num - 1] == BBFS_LEVEL_HOLE)) {
+        uint64_t nr = bbfs_img_level_blocks(inode, inode->l_num - 1);
+        inode->l_num--;
+        inode->l_tail = 0;
+        inode->l_unwritten &= ~(1u << inode->l_num);
+        if (inode->levels[inode->l_num] != BBFS_LEVEL_HOLE) {
+            bbfs_img_free_blocks(img, inode->levels[inode->l_num], nr);
+        }
+        if (bbfs_img_feature(img, BBFS_FEAT_COMPACT_INODE) && inode->l_num == BBFS_CINODE_LEVELS) {
+            bbfs_img_free_blocks(img, inode->l_overflow, 1);
+        }
+    }
+}
+
+static void bbfs_img_touch(struct bbfs_img *img, uint64_t ino, bool create) {
+    struct bbfs_inode *di = bbfs_img_inode_raw(img, ino);
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    di->i_mtime_sec = di->i_ctime_sec = ts.tv_sec;
+    di->i_mtime_nsec = di->i_ctime_nsec = ts.tv_nsec;
+    if (create) {
+        di->i_atime_sec = ts.tv_sec;
+        di->i_atime_nsec = ts.tv_nsec;
+    }
+}
+
+/* The block in the data area behind file block n, or UINT64_MAX for a hole or an unwritten level. */
+static uint64_t bbfs_img_bmap(struct bbfs_img_inode *inode, uint64_t n) {
+    unsigned int level = bbfs_ilog2(n + 1);
+    uint64_t idx = n + 1 - (1ull << level);
+
+    if (level >= inode->l_num || inode->levels[level] == BBFS_LEVEL_HOLE || inode->l_unwritten & (1u << level) ||
+        idx >= bbfs_img_level_blocks(inode, level)) {
+        return UINT64_MAX;
+    }
+    return inode->levels[level] + idx;
+}
+
+/* Give level a whole run of 1 << level blocks that holds data: new, moved out of a partial tail, or zeroed. */
+static int bbfs_img_fill_level(struct bbfs_img *img, struct bbfs_img_inode *inode, unsigned int level) {
+    if (level < inode->l_num && inode->levels[level] != BBFS_LEVEL_HOLE && !inode->l_tail &&
+        !(inode->l_unwritten & (1u << level))) {
+        return 0;
+    }
+    if (level < inode->l_num && inode->levels[level] != BBFS_LEVEL_HOLE && inode->l_tail) {
+        uint64_t blk = bbfs_img_alloc_blocks(img, inode->ino, level);
+        if (blk == UINT64_MAX) {
+            return -ENOSPC;
+        }
+        memcpy(bbfs_img_block(img, img->layout.block_begin + blk),
+               bbfs_img_block(img, img->layout.block_begin + inode->levels[level]),
+               inode->l_tail * (uint64_t)BBFS_BLOCK_SIZE);
+        bbfs_img_free_blocks(img, inode->levels[level], inode->l_tail);
+        inode->levels[level] = blk;
+        inode->l_tail = 0;
+    } else if (level >= inode->l_num || inode->levels[level] == BBFS_LEVEL_HOLE) {
+        uint64_t blk = bbfs_img_alloc_blocks(img, inode->ino, level);
+        if (blk == UINT64_MAX) {
+            return -ENOSPC;
+        }
+        int ret = bbfs_img_add_level(img, inode, level, blk);
+        if (ret) {
+            bbfs_img_free_blocks(img, blk, 1ull << level);
+            return ret;
+        }
+    }
+    if (inode->l_unwritten & (1u << level)) {
+        memset(bbfs_img_block(img, img->layout.block_begin + inode->levels[level]), 0,
+               bbfs_img_level_blocks(inode, level) * BBFS_BLOCK_SIZE);
+        inode->l_unwritten &= ~(1u << level);
+    }
+    return 0;
+}
+
+int bbfs_img_append(struct bbfs_img *img, struct bbfs_img_inode *inode, const void *buf, size_t len) {
+    const char *p = buf;
+    uint64_t pos = inode->size, end = pos + len;
+
+    if (!S_ISREG(inode->mode) || inode->flags & BBFS_INODE_INLINE) {
+        return -EOPNOTSUPP;
+    }
+    if (!bbfs_img_feature(img, BBFS_FEAT_64BIT) && end > UINT32_MAX) {
+        return -EFBIG;
+    }
+    int ret = 0;
+    while (pos < end) {
+        uint64_t n = pos / BBFS_BLOCK_SIZE;
+        ret = bbfs_img_fill_level(img, inode, bbfs_ilog2(n + 1));
+        if (ret) {
+            break;
+        }
+        uint64_t off = pos % BBFS_BLOCK_SIZE;
+        uint64_t chunk = end - pos < BBFS_BLOCK_SIZE - off ? end - pos : BBFS_BLOCK_SIZE - off;
+        memcpy(bbfs_img_block(img, img->layout.block_begin + bbfs_img_bmap(inode, n)) + off, p, chunk);
+        p += chunk;
+        pos += chunk;
+    }
+    if (pos > inode->size) {
+        inode->size = pos;
+        bbfs_img_touch(img, inode->ino, false);
+    }
+    bbfs_img_iput(img, inode);
+    return ret;
+}
+
+ssize_t bbfs_img_read(struct bbfs_img *img, struct bbfs_img_inode *inode, void *buf, size_t len, uint64_t pos) {
+    char *p = buf;
+
+    if (pos >= inode->size) {
+        return 0;
+    }
+    len = inode->size - pos < len ? inode->size - pos : len;
+    if (S_ISLNK(inode->mode) || inode->flags & BBFS_INODE_INLINE) {
+        struct bbfs_inode *di = bbfs_img_inode_raw(img, inode->ino);
+        const char *data = bbfs_img_feature(img, BBFS_FEAT_COMPACT_INODE) ? ((struct bbfs_cinode *)di)->i_data
+                                                                          : di->i_data;
+        if (bbfs_img_feature(img, BBFS_FEAT_COMPACT_INODE) && inode->size > BBFS_CINODE_INLINE) {
+            struct bbfs_cinode *ci = (struct bbfs_cinode *)di;
+            uint64_t overflow = ci->l_overflow;
+            if (bbfs_img_feature(img, BBFS_FEAT_64BIT)) {
+                overflow |= (uint64_t)ci->l_overflow_hi << 32;
+            }
+            if (overflow >= img->layout.nr_blocks) {
+                return -EIO;
+            }
+            data = bbfs_img_block(img, img->layout.block_begin + overflow);
+        }
+        memcpy(buf, data + pos, len);
+        return len;
+    }
+    for (size_t done = 0; done < len;) {
+        uint64_t n = (pos + done) / BBFS_BLOCK_SIZE, off = (pos + done) % BBFS_BLOCK_SIZE;
+        size_t chunk = len - done < BBFS_BLOCK_SIZE - off ? len - done : BBFS_BLOCK_SIZE - off;
+        uint64_t blk = bbfs_img_bmap(inode, n);
+        if (blk == UINT64_MAX) {
+            memset(p + done, 0, chunk);
+        } else {
+            memcpy(p + done, bbfs_img_block(img, img->layout.block_begin + blk) + off, chunk);
+        }
+        done += chunk;
+    }
+    return len;
+}
+
+static bool bbfs_img_packed(struct bbfs_img *img) { return bbfs_img_feature(img, BBFS_FEAT_PACKED_DIRENT); }
+
+static uint64_t bbfs_img_dir_nblocks(struct bbfs_img_inode *dir) { return (1ull << dir->l_num) - 1; }
+
+static char *bbfs_img_dir_block(struct bbfs_img *img, struct bbfs_img_inode *dir, uint64_t n) {
+    unsigned int level = bbfs_ilog2(n + 1);
+    return bbfs_img_block(img, img->layout.block_begin + dir->levels[level] + n + 1 - (1ull << level));
+}
+
+static bool bbfs_img_dx_block(char *data) { return ((struct bbfs_dx_node *)data)->magic == BBFS_DX_MAGIC; }
+
+static int bbfs_img_dir_grow(struct bbfs_img *img, struct bbfs_img_inode *dir) {
+    unsigned int level = dir->l_num;
+
+    uint64_t blk_start = bbfs_img_alloc_blocks(img, dir->ino, level);
+    if (blk_start == UINT64_MAX) {
+        return -ENOSPC;
+    }
+    for (uint64_t j = blk_start; j < blk_start + (1ull << level); j++) {
+        bbfs_dir_init_block(bbfs_img_packed(img), bbfs_img_block(img, img->layout.block_begin + j));
+    }
+    int ret = bbfs_img_add_level(img, dir, level, blk_start);
+    if (ret) {
+        bbfs_img_free_blocks(img, blk_start, 1ull << level);
+        return ret;
+    }
+    bbfs_img_iput(img, dir);
+    return 0;
+}
+
+static bool bbfs_img_dir_indexed(struct bbfs_img *img, struct bbfs_img_inode *dir) {
+    return bbfs_img_feature(img, BBFS_FEAT_DIR_INDEX) && dir->l_num &&
+           bbfs_img_dx_block(bbfs_img_dir_block(img, dir, 0));
+}
+
+struct bbfs_img_dx_path {
+    int depth;
+    struct bbfs_dx_node *node[BBFS_DX_MAX_DEPTH + 1];
+    int pos[BBFS_DX_MAX_DEPTH + 1];
+};
+
+static void bbfs_img_dx_descend(struct bbfs_img *img, struct bbfs_img_inode *dir, uint32_t hash,
+                                struct bbfs_img_dx_path *path) {
+    path->depth = 0;
+    path->node[0] = (struct bbfs_dx_node *)bbfs_img_dir_block(img, dir, 0);
+    path->pos[0] = bbfs_dx_search(path->node[0], hash);
+    if (path->node[0]->depth) {
+        path->node[1] = (struct bbfs_dx_node *)bbfs_img_dir_block(img, dir, path->node[0]->entries[path->pos[0]].block);
+        path->depth = 1;
+        path->pos[1] = bbfs_dx_search(path->node[1], hash);
+    }
+}
+
+/* Find name, following the index the way bbfs_dir_find does. */
+static int bbfs_img_dir_find(struct bbfs_img *img, struct bbfs_img_inode *dir, const char *name, unsigned int len,
+                             char **datap, struct bbfs_dir_rec *rec) {
+    bool packed = bbfs_img_packed(img);
+
+    if (!bbfs_img_dir_indexed(img, dir)) {
+        for (uint64_t n = 0; n < bbfs_img_dir_nblocks(dir); n++) {
+            char *data = bbfs_img_dir_block(img, dir, n);
+            if (bbfs_search_block(packed, data, name, len, rec)) {
+                *datap = data;
+                return 0;
+            }
+        }
+        return -ENOENT;
+    }
+
+    uint32_t hash = bbfs_name_hash(name, len);
+    struct bbfs_img_dx_path path;
+    bbfs_img_dx_descend(img, dir, hash, &path);
+    struct bbfs_dx_node *root = path.node[0];
+    struct bbfs_dx_node *node = path.node[path.depth];
+    int pos = path.pos[path.depth];
+    for (;;) {
+        char *data = bbfs_img_dir_block(img, dir, node->entries[pos].block);
+        if (bbfs_search_block(packed, data, name, len, rec)) {
+            *datap = data;
+            return 0;
+        }
+        if (pos + 1 < (int)node->count) {
+            if (node->entries[++pos].hash != hash) {
+                return -ENOENT;
+            }
+        } else if (path.depth && path.pos[0] + 1 < (int)root->count && root->entries[path.pos[0] + 1].hash == hash) {
+            node = (struct bbfs_dx_node *)bbfs_img_dir_block(img, dir, root->entries[++path.pos[0]].block);
+            pos = 0;
+        } else {
+            return -ENOENT;
+        }
+    }
+}
+
+int bbfs_img_lookup(struct bbfs_img *img, struct bbfs_img_inode *dir, const char *name, unsigned int len,
+                    uint64_t *ino) {
+    struct bbfs_dir_rec rec;
+    char *data;
+
+    if (!S_ISDIR(dir->mode)) {
+        return -ENOTDIR;
+    }
+    int ret = bbfs_img_dir_find(img, dir, name, len, &data, &rec);
+    if (!ret) {
+        *ino = rec.ino;
+    }
+    return ret;
+}
+
+static uint64_t bbfs_img_dx_new_block(struct bbfs_img *img, struct bbfs_img_inode *dir) {
+    struct bbfs_dx_node *root = (struct bbfs_dx_node *)bbfs_img_dir_block(img, dir, 0);
+    if (root->next_block >= bbfs_img_dir_nblocks(dir) && bbfs_img_dir_grow(img, dir)) {
+        return 0;
+    }
+    return root->next_block++;
+}
+
+static void bbfs_img_dx_insert(struct bbfs_dx_node *node, int pos, uint32_t hash, uint32_t block) {
+    memmove(&node->entries[pos + 1], &node->entries[pos], (node->count - pos) * sizeof(struct bbfs_dx_entry));
+    node->entries[pos].hash = hash;
+    node->entries[pos].block = block;
+    node->count++;
+}
+
+static int bbfs_img_dx_split_leaf(struct bbfs_img *img, struct bbfs_img_inode *dir, struct bbfs_img_dx_path *path,
+                                  char *leaf) {
+    bool packed = bbfs_img_packed(img);
+    char buf[BBFS_BLOCK_SIZE];
+    struct bbfs_dx_hash map[BBFS_BLOCK_SIZE / BBFS_DIRENT_LEN(1)];
+    struct bbfs_dir_rec rec;
+    int count = 0;
+
+    memcpy(buf, leaf, BBFS_BLOCK_SIZE);
+    for (int off = 0; bbfs_dir_rec(packed, buf, off, &rec); off = rec.next) {
+        if (rec.len) {
+            map[count].hash = bbfs_name_hash(rec.name, rec.len);
+            map[count++].off = off;
+        }
+    }
+    if (count < 2) {
+        return -EIO;
+    }
+    qsort(map, count, sizeof(map[0]), bbfs_dx_cmp);
+    int split = bbfs_dx_split_point(map, count);
+
+    uint64_t n = bbfs_img_dx_new_block(img, dir);
+    if (!n) {
+        return -ENOSPC;
+    }
+    char *new_leaf = bbfs_img_dir_block(img, dir, n);
+    bbfs_dir_init_block(packed, leaf);
+    bbfs_dir_init_block(packed, new_leaf);
+    for (int i = 0; i < count; i++) {
+        bbfs_dir_rec(packed, buf, map[i].off, &rec);
+        bbfs_insert_block(packed, i < split ? leaf : new_leaf, rec.name, rec.len, rec.ino, rec.type);
+    }
+    bbfs_img_dx_insert(path->node[path->depth], path->pos[path->depth] + 1, map[split].hash, n);
+    return 0;
+}
+
+static int bbfs_img_dx_split_node(struct bbfs_img *img, struct bbfs_img_inode *dir, struct bbfs_img_dx_path *path) {
+    struct bbfs_dx_node *node = path->node[1];
+    int split = node->count / 2;
+    while (split > 1 && node->entries[split].hash == node->entries[split - 1].hash) {
+        split--;
+    }
+
+    uint64_t n = bbfs_img_dx_new_block(img, dir);
+    if (!n) {
+        return -ENOSPC;
+    }
+    struct bbfs_dx_node *new_node = (struct bbfs_dx_node *)bbfs_img_dir_block(img, dir, n);
+    new_node->magic = BBFS_DX_MAGIC;
+    new_node->count = node->count - split;
+    memcpy(new_node->entries, &node->entries[split], new_node->count * sizeof(struct bbfs_dx_entry));
+    node->count = split;
+    bbfs_img_dx_insert(path->node[0], path->pos[0] + 1, new_node->entries[0].hash, n);
+    return 0;
+}
+
+static int bbfs_img_dx_deepen(struct bbfs_img *img, struct bbfs_img_inode *dir, struct bbfs_img_dx_path *path) {
+    struct bbfs_dx_node *root = path->node[0];
+    uint64_t n = bbfs_img_dx_new_block(img, dir);
+    if (!n) {
+        return -ENOSPC;
+    }
+    struct bbfs_dx_node *node = (struct bbfs_dx_node *)bbfs_img_dir_block(img, dir, n);
+    node->magic = BBFS_DX_MAGIC;
+    node->count = root->count;
+    memcpy(node->entries, root->entries, root->count * sizeof(struct bbfs_dx_entry));
+    root->depth = 1;
+    root->count = 1;
+    root->entries[0].hash = 0;
+    root->entries[0].block = n;
+    return 0;
+}
+
+static int bbfs_img_dx_add_entry(struct bbfs_img *img, struct bbfs_img_inode *dir, const char *name,
+                                 unsigned int len, struct bbfs_img_inode *inode) {
+    uint32_t hash = bbfs_name_hash(name, len);
+
+    for (;;) {
+        struct bbfs_img_dx_path path;
+        bbfs_img_dx_descend(img, dir, hash, &path);
+        struct bbfs_dx_node *root = path.node[0];
+        struct bbfs_dx_node *node = path.node[path.depth];
+        char *leaf = bbfs_img_dir_block(img, dir, node->entries[path.pos[path.depth]].block);
+        if (bbfs_insert_block(bbfs_img_packed(img), leaf, name, len, inode->ino, (inode->mode & S_IFMT) >> 12)) {
+            return 0;
+        }
+
+        int ret;
+        if (node->count < DX_LIMIT) {
+            ret = bbfs_img_dx_split_leaf(img, dir, &path, leaf);
+        } else if (!path.depth) {
+            ret = bbfs_img_dx_deepen(img, dir, &path);
+        } else if (root->count < DX_LIMIT) {
+            ret = bbfs_img_dx_split_node(img, dir, &path);
+        } else {
+            ret = -ENOSPC;
+        }
+        if (ret) {
+            return ret;
+        }
+    }
+}
+
+static int bbfs_img_dx_convert(struct bbfs_img *img, struct bbfs_img_inode *dir) {
+    int ret = bbfs_img_dir_grow(img, dir);
+    if (ret) {
+        return ret;
+    }
+    struct bbfs_dx_node *root = (struct bbfs_dx_node *)bbfs_img_dir_block(img, dir, 0);
+    memcpy(bbfs_img_dir_block(img, dir, 1), root, BBFS_BLOCK_SIZE);
+    memset(root, 0, BBFS_BLOCK_SIZE);
+    root->magic = BBFS_DX_MAGIC;
+    root->count = 1;
+    root->next_block = 2;
+    root->entries[0].hash = 0;
+    root->entries[0].block = 1;
+    return 0;
+}
+
+/* Add an entry for inode, the way bbfs_add_entry does, including when to switch to an index. */
+int bbfs_img_add_entry(struct bbfs_img *img, struct bbfs_img_inode *dir, const char *name, unsigned int len,
+                       struct bbfs_img_inode *inode) {
+    bool packed = bbfs_img_packed(img);
+    unsigned int type = (inode->mode & S_IFMT) >> 12;
+
+    if (len > NAME_MAX) {
+        return -ENAMETOOLONG;
+    }
+    if (bbfs_img_dir_indexed(img, dir)) {
+        return bbfs_img_dx_add_entry(img, dir, name, len, inode);
+    }
+    for (uint64_t n = 0; n < bbfs_img_dir_nblocks(dir); n++) {
+        if (bbfs_insert_block(packed, bbfs_img_dir_block(img, dir, n), name, len, inode->ino, type)) {
+            return 0;
+        }
+    }
+
+    if (bbfs_img_feature(img, BBFS_FEAT_DIR_INDEX) && dir->l_num == 1) {
+        int ret = bbfs_img_dx_convert(img, dir);
+        if (ret) {
+            return ret;
+        }
+        return bbfs_img_dx_add_entry(img, dir, name, len, inode);
+    }
+
+    uint64_t n = bbfs_img_dir_nblocks(dir);
+    int ret = bbfs_img_dir_grow(img, dir);
+    if (ret) {
+        return ret;
+    }
+    bbfs_insert_block(packed, bbfs_img_dir_block(img, dir, n), name, len, inode->ino, type);
+    return 0;
+}
+
+int bbfs_img_delete_entry(struct bbfs_img *img, struct bbfs_img_inode *dir, const char *name, unsigned int len) {
+    struct bbfs_dir_rec rec;
+    char *data;
+
+    int ret = bbfs_img_dir_find(img, dir, name, len, &data, &rec);
+    if (!ret) {
+        bbfs_remove_block(bbfs_img_packed(img), data, &rec);
+    }
+    return ret;
+}
+
+/* Emit every entry in block order, index nodes skipped. Stops early, returning it, when emit returns non-zero. */
+int bbfs_img_readdir(struct bbfs_img *img, struct bbfs_img_inode *dir, bbfs_img_emit_t emit, void *arg) {
+    bool packed = bbfs_img_packed(img);
+    struct bbfs_dir_rec rec;
+
+    if (!S_ISDIR(dir->mode)) {
+        return -ENOTDIR;
+    }
+    for (uint64_t n = 0; n < bbfs_img_dir_nblocks(dir); n++) {
+        char *data = bbfs_img_dir_block(img, dir, n);
+        if (bbfs_img_dx_block(data)) {
+            continue;
+        }
+        for (int off = 0; bbfs_dir_rec(packed, data, off, &rec); off = rec.next) {
+            if (!rec.len) {
+                continue;
+            }
+            int ret = emit(arg, rec.name, rec.len, rec.ino, rec.type);
+            if (ret) {
+                return ret;
+            }
+        }
+    }
+    return 0;
+}
+
+static int bbfs_img_nonempty(void *arg, const char *name, unsigned int len, uint32_t ino, unsigned int type) {
+    return 1;
+}
+
+int bbfs_img_empty_dir(struct bbfs_img *img, struct bbfs_img_inode *dir) {
+    return !bbfs_img_readdir(img, dir, bbfs_img_nonempty, NULL);
+}
+
+int bbfs_img_create(struct bbfs_img *img, struct bbfs_img_inode *dir, const char *name, unsigned int len,
+                    uint32_t mode, struct bbfs_img_inode *inode) {
+    uint64_t ino;
+
+    if (!len || len > NAME_MAX) {
+        return len ? -ENAMETOOLONG : -EINVAL;
+    }
+    int ret = bbfs_img_lookup(img, dir, name, len, &ino);
+    if (ret != -ENOENT) {
+        return ret ? ret : -EEXIST;
+    }
+    if (!S_ISREG(mode) && !S_ISDIR(mode)) {
+        return -EINVAL;
+    }
+    ino = bbfs_img_alloc_ino(img, dir->ino, mode);
+    if (ino == UINT64_MAX) {
+        return -ENOSPC;
+    }
+
+    struct bbfs_inode *di = bbfs_img_inode_raw(img, ino);
+    memset(di, 0, bbfs_img_feature(img, BBFS_FEAT_COMPACT_INODE) ? sizeof(struct bbfs_cinode) : sizeof(*di));
+    di->i_uid = getuid();
+    di->i_gid = getgid();
+    bbfs_img_touch(img, ino, true);
+    memset(inode, 0, sizeof(*inode));
+    inode->ino = ino;
+    inode->flags = BBFS_INODE_VALID;
+    inode->mode = mode;
+    inode->nlink = S_ISDIR(mode) ? 2 : 1;
+    inode->size = S_ISDIR(mode) ? sizeof(struct bbfs_inode) : 0;
+    bbfs_img_iput(img, inode);
+
+    ret = bbfs_img_add_entry(img, dir, name, len, inode);
+    if (ret) {
+        inode->flags = 0;
+        bbfs_img_iput(img, inode);
+        bbfs_img_free_ino(img, ino);
+        return ret;
+    }
+    if (S_ISDIR(mode)) {
+        dir->nlink++;
+    }
+    bbfs_img_touch(img, dir->ino, false);
+    bbfs_img_iput(img, dir);
+    return 0;
+}
+
+/* Remove name from dir, freeing the inode along with its blocks once the last link is gone. */
+int bbfs_img_unlink(struct bbfs_img *img, struct bbfs_img_inode *dir, const char *name, unsigned int len) {
+    struct bbfs_img_inode inode;
+    uint64_t ino;
+
+    int ret = bbfs_img_lookup(img, dir, name, len, &ino);
+    if (!ret) {
+        ret = bbfs_img_iget(img, ino, &inode);
+    }
+    if (ret) {
+        return ret;
+    }
+    bool isdir = S_ISDIR(inode.mode);
+    if (isdir && !bbfs_img_empty_dir(img, &inode)) {
+        return -ENOTEMPTY;
+    }
+    ret = bbfs_img_delete_entry(img, dir, name, len);
+    if (ret) {
+        return ret;
+    }
+    if (isdir) {
+        inode.nlink = 0;
+        dir->nlink--;
+    } else if (inode.nlink) {
+        inode.nlink--;
+    }
+    bbfs_img_touch(img, dir->ino, false);
+    bbfs_img_iput(img, dir);
+    if (inode.nlink) {
+        bbfs_img_iput(img, &inode);
+        return 0;
+    }
+
+    if (bbfs_img_feature(img, BBFS_FEAT_COMPACT_INODE) && S_ISLNK(inode.mode) && inode.size > BBFS_CINODE_INLINE) {
+        struct bbfs_cinode *ci = bbfs_img_inode_raw(img, ino);
+        uint64_t overflow = ci->l_overflow;
+        if (bbfs_img_feature(img, BBFS_FEAT_64BIT)) {
+            overflow |= (uint64_t)ci->l_overflow_hi << 32;
+        }
+        bbfs_img_free_blocks(img, overflow, 1);
+    } else if (!S_ISLNK(inode.mode) && !(inode.flags & BBFS_INODE_INLINE)) {
+        bbfs_img_release_levels(img, &inode, 0);
+    }
+    inode.flags = 0;
+    bbfs_img_iput(img, &inode);
+    bbfs_img_free_ino(img, ino);
+    return 0;
+}
@@ -0,0 +1,97 @@
+#ifndef _LIBBBFS_H
+#define _LIBBBFS_H
+
+#include <linux/limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fs.h"
+
+/*
+ * libbbfs works on a bbfs image file or an unmounted device in user space, for mkfs, fsck, tests and the simulator.
+ * The image is mapped whole and changed in place, without going through the journal, so images with a journal that
+ * still needs replaying are refused for writing. Errors are negative errno values, as in the kernel.
+ */
+
+#define BBFS_IMG_WRITE 0x1
+/* Open a block device exclusively, which fails while it is mounted. */
+#define BBFS_IMG_EXCL 0x2
+
+/* Where each area starts, in blocks from the start of the device. Block numbers in inodes count from block_begin. */
+struct bbfs_layout {
+    uint64_t journal_begin, imap_begin, bmap_begin, inode_begin, block_begin, block_end;
+    uint64_t nr_inodes, nr_blocks;
+};
+
+struct bbfs_img_group {
+    uint64_t ino_start, nr_inodes, i_next, free_inodes;
+    uint64_t blk_start, nr_blocks;
+    struct bbfs_buddy *buddy;
+};
+
+struct bbfs_img {
+    int fd, flags;
+    char *map;
+    size_t size;
+    struct bbfs_sb *sb;
+    struct bbfs_layout layout;
+    uint64_t region_inodes;
+    /* The allocator, once bbfs_img_load_maps has built it from the on-disk bitmaps. */
+    uint64_t nr_groups, group_inodes, group_blocks;
+    struct bbfs_img_group *groups;
+    uint64_t dir_group;
+};
+
+/* The fields of an inode that the library interprets. Inline data and symlink targets stay in the inode table. */
+struct bbfs_img_inode {
+    uint64_t ino;
+    uint32_t flags, mode, nlink;
+    uint64_t size;
+    uint32_t l_num, l_tail, l_unwritten;
+    uint64_t l_overflow;
+    uint64_t levels[BBFS_MAX_LEVELS];
+};
+
+typedef int (*bbfs_img_emit_t)(void *arg, const char *name, unsigned int len, uint32_t ino, unsigned int type);
+
+void bbfs_layout(const struct bbfs_sb *sb, struct bbfs_layout *layout);
+
+int bbfs_img_open(struct bbfs_img *img, const char *path, int flags);
+int bbfs_img_close(struct bbfs_img *img);
+int bbfs_img_journal_dirty(struct bbfs_img *img);
+
+static inline char *bbfs_img_block(struct bbfs_img *img, uint64_t blk) { return img->map + blk * BBFS_BLOCK_SIZE; }
+
+void *bbfs_img_inode_raw(struct bbfs_img *img, uint64_t ino);
+int bbfs_img_ino_uninit(struct bbfs_img *img, uint64_t ino);
+uint64_t bbfs_img_map_entries(struct bbfs_img *img);
+int bbfs_img_test_map(struct bbfs_img *img, uint64_t begin, uint64_t i);
+void bbfs_img_set_map(struct bbfs_img *img, uint64_t begin, uint64_t i, int val);
+
+int bbfs_img_load_maps(struct bbfs_img *img);
+uint64_t bbfs_img_alloc_blocks(struct bbfs_img *img, uint64_t ino, unsigned int level);
+void bbfs_img_free_blocks(struct bbfs_img *img, uint64_t blk_start, uint64_t nr);
+uint64_t bbfs_img_alloc_ino(struct bbfs_img *img, uint64_t dir_ino, uint32_t mode);
+void bbfs_img_free_ino(struct bbfs_img *img, uint64_t ino);
+
+int bbfs_img_iget(struct bbfs_img *img, uint64_t ino, struct bbfs_img_inode *inode);
+void bbfs_img_iput(struct bbfs_img *img, struct bbfs_img_inode *inode);
+int bbfs_img_add_level(struct bbfs_img *img, struct bbfs_img_inode *inode, unsigned int level, uint64_t blk_start);
+void bbfs_img_release_levels(struct bbfs_img *img, struct bbfs_img_inode *inode, unsigned int keep);
+int bbfs_img_append(struct bbfs_img *img, struct bbfs_img_inode *inode, const void *buf, size_t len);
+ssize_t bbfs_img_read(struct bbfs_img *img, struct bbfs_img_inode *inode, void *buf, size_t len, uint64_t pos);
+
+int bbfs_img_lookup(struct bbfs_img *img, struct bbfs_img_inode *dir, const char *name, unsigned int len,
+                    uint64_t *ino);
+int bbfs_img_add_entry(struct bbfs_img *img, struct bbfs_img_inode *dir, const char *name, unsigned int len,
+                       struct bbfs_img_inode *inode);
+int bbfs_img_delete_entry(struct bbfs_img *img, struct bbfs_img_inode *dir, const char *name, unsigned int len);
+int bbfs_img_readdir(struct bbfs_img *img, struct bbfs_img_inode *dir, bbfs_img_emit_t emit, void *arg);
+int bbfs_img_empty_dir(struct bbfs_img *img, struct bbfs_img_inode *dir);
+
+int bbfs_img_create(struct bbfs_img *img, struct bbfs_img_inode *dir, const char *name, unsigned int len,
+                    uint32_t mode, struct bbfs_img_inode *inode);
+int bbfs_img_unlink(struct bbfs_img *img, struct bbfs_img_inode *dir, const char *name, unsigned int len);
+
+#endif
@@ -1,21 +1,161 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
 #include <linux/stat.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
-#include "fs.h"
+#include "libbbfs.h"
+
+static const struct {
+    const char *name;
+    uint32_t flag;
+} features[] = {
+    {"packed_bitmap", BBFS_FEAT_PACKED_BITMAP},
+    {"dir_index", BBFS_FEAT_DIR_INDEX},
+    {"packed_dirent", BBFS_FEAT_PACKED_DIRENT},
+    {"inline_data", BBFS_FEAT_INLINE_DATA},
+    {"compact_inode", BBFS_FEAT_COMPACT_INODE},
+    {"journal", BBFS_FEAT_JOURNAL},
+    {"partial_tail", BBFS_FEAT_PARTIAL_TAIL},
+    {"sparse", BBFS_FEAT_SPARSE},
+    {"unwritten", BBFS_FEAT_UNWRITTEN},
+    {"64bit", BBFS_FEAT_64BIT},
+    {"lazy_itable", BBFS_FEAT_LAZY_ITABLE},
+};
+
+static int parse_features(char *list, uint32_t *flags) {
+    for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+        unsigned long i;
+        for (i = 0; i < sizeof(features) / sizeof(features[0]); i++) {
+            if (!strcmp(name, features[i].name)) {
+                *flags |= features[i].flag;
+                break;
+            }
+        }
+        if (i == sizeof(features) / sizeof(features[0])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#define ZERO_CHUNK (1ul << 20)
+#define MAX_THREADS 16
+
+static void *zero_buf;
+
+struct zero_job {
+    pthread_t thread;
+    int fd;
+    off_t start, end;
+    int ret;
+};
+
+static void *zero_worker(void *arg) {
+    struct zero_job *job = arg;
+    for (off_t pos = job->start; pos < job->end;) {
+        size_t len = job->end - pos < (off_t)ZERO_CHUNK ? job->end - pos : ZERO_CHUNK;
+        ssize_t n = pwrite(job->fd, zero_buf, len, pos);
+        if (n <= 0) {
+            job->ret = -1;
+            break;
+        }
+        pos += n;
+    }
+    return NULL;
+}
+
+/*
+ * Zero [start, start + len). Block devices try BLKZEROOUT and image files try punching a hole, both of which skip the
+ * data transfer. Otherwise the range is split between threads that write it in 1 MiB chunks.
+ */
+static int zero_range(int fd, int dfd, int blkdev, off_t start, off_t len) {
+    if (!len) {
+        return 0;
+    }
+    if (blkdev) {
+        uint64_t range[2] = {start, len};
+        if (!ioctl(fd, BLKZEROOUT, range)) {
+            return 0;
+        }
+    } else if (!fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, len)) {
+        return 0;
+    }
+
+    long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    long chunks = (len + ZERO_CHUNK - 1) / ZERO_CHUNK;
+    nr_threads = nr_threads < 1 ? 1 : nr_threads > MAX_THREADS ? MAX_THREADS : nr_threads;
+    nr_threads = nr_threads > chunks ? chunks : nr_threads;
+    off_t per_thread = (chunks + nr_threads - 1) / nr_threads * ZERO_CHUNK;
+    struct zero_job jobs[MAX_THREADS] = {};
+    long started;
+    for (started = 0; started < nr_threads; started++) {
+        struct zero_job *job = &jobs[started];
+        job->fd = dfd;
+        job->start = start + started * per_thread;
+        job->end = job->start + per_thread < start + len ? job->start + per_thread : start + len;
+        if (pthread_create(&job->thread, NULL, zero_worker, job)) {
+            break;
+        }
+    }
+    int ret = started ? 0 : -1;
+    for (long i = 0; i < started; i++) {
+        pthread_join(jobs[i].thread, NULL);
+        ret |= jobs[i].ret;
+    }
+    /* Whatever a failed thread creation left over is done here. */
+    if (!ret && started < nr_threads) {
+        struct zero_job rest = {.fd = dfd, .start = jobs[started].start, .end = start + len};
+        zero_worker(&rest);
+        ret = rest.ret;
+    }
+    return ret;
+}
+
+static int write_block(int fd, const void *buf, int page_size, off_t blk) {
+    return pwrite(fd, buf, page_size, blk * page_size) == page_size ? 0 : -1;
+}
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
+    uint32_t flags = 0;
+    unsigned long group_blocks = 1ul << 18;
+    unsigned long nr_journal = 0;
+    int nodiscard = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "O:g:J:K")) != -1) {
+        if (opt == 'O') {
+            if (parse_features(optarg, &flags)) {
+                return -1;
+            }
+        } else if (opt == 'g') {
+            group_blocks = strtoul(optarg, NULL, 0);
+            if (group_blocks < 64 || group_blocks > (1ul << 31) || (group_blocks & (group_blocks - 1))) {
+                return -1;
+            }
+        } else if (opt == 'J') {
+            nr_journal = strtoul(optarg, NULL, 0);
+            if (nr_journal < 128) {
+                return -1;
+            }
+        } else if (opt == 'K') {
+            nodiscard = 1;
+        } else {
+            return -1;
+        }
+    }
+    if (optind != argc - 1) {
         return -1;
     }
 
-    int fd = open(argv[1], O_RDWR);
+    int fd = open(argv[optind], O_RDWR);
     if (fd == -1) {
         return -1;
     }
@@ -26,7 +166,8 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    if ((stat_buf.st_mode & S_IFMT) == S_IFBLK) {
+    int blkdev = (stat_buf.st_mode & S_IFMT) == S_IFBLK;
+    if (blkdev) {
         if (ioctl(fd, BLKGETSIZE64, &stat_buf.st_size)) {
             close(fd);
             return -1;
@@ -34,11 +175,70 @@ int main(int argc, char **argv) {
     }
 
     int page_size = getpagesize();
-    unsigned long nr_imap = (stat_buf.st_size - sizeof(struct bbfs_sb)) / (page_size + sizeof(uint32_t)) / 17 /
-                            (page_size / sizeof(uint32_t));
-    unsigned long nr_bmap = nr_imap * 15;
-    unsigned long nr_inodes = nr_imap * (page_size / sizeof(uint32_t));
-    unsigned long nr_blocks = nr_bmap * (page_size / sizeof(uint32_t));
+    int compact = !!(flags & BBFS_FEAT_COMPACT_INODE);
+    /* The journal defaults to 1/64 of the device, between 128 and 4096 blocks. */
+    if (!(flags & BBFS_FEAT_JOURNAL)) {
+        nr_journal = 0;
+    } else if (!nr_journal) {
+        nr_journal = stat_buf.st_size / page_size / 64;
+        nr_journal = nr_journal < 128 ? 128 : nr_journal > 4096 ? 4096 : nr_journal;
+    }
+    off_t avail = stat_buf.st_size - sizeof(struct bbfs_sb) - nr_journal * page_size;
+    unsigned long nr_imap, nr_bmap, nr_inodes, nr_blocks;
+    if (flags & BBFS_FEAT_PACKED_BITMAP) {
+        /* Every inode brings 15 data blocks and either a whole inode block or 1/16 of one. */
+        unsigned long nr_pages = avail / page_size;
+        unsigned long bits = page_size * 8;
+        nr_inodes = compact ? nr_pages * BBFS_INODES_PER_BLOCK / 241 : nr_pages / 16;
+        nr_imap = (nr_inodes + bits - 1) / bits;
+        nr_bmap = (nr_inodes * 15 + bits - 1) / bits;
+        nr_pages -= nr_imap + nr_bmap;
+        nr_inodes = compact ? nr_pages * BBFS_INODES_PER_BLOCK / 241 : nr_pages / 16;
+        nr_blocks = nr_inodes * 15;
+    } else if (compact) {
+        unsigned long words = page_size / sizeof(uint32_t);
+        nr_imap = avail / page_size / (16 + words / BBFS_INODES_PER_BLOCK + 15 * words);
+        nr_bmap = nr_imap * 15;
+        nr_inodes = nr_imap * words;
+        nr_blocks = nr_bmap * words;
+    } else {
+        nr_imap = avail / (page_size + sizeof(uint32_t)) / 17 / (page_size / sizeof(uint32_t));
+        nr_bmap = nr_imap * 15;
+        nr_inodes = nr_imap * (page_size / sizeof(uint32_t));
+        nr_blocks = nr_bmap * (page_size / sizeof(uint32_t));
+    }
+
+    /* Directory entries hold 32-bit inode numbers, so only the block count can actually use the upper halves. */
+    if (nr_inodes > UINT32_MAX) {
+        nr_inodes = UINT32_MAX;
+    }
+    if (!(flags & BBFS_FEAT_64BIT) && nr_blocks > UINT32_MAX) {
+        close(fd);
+        return -1;
+    }
+
+    unsigned long nr_groups = (nr_blocks + group_blocks - 1) / group_blocks;
+    unsigned long group_inodes = nr_groups > 1 ? nr_inodes / nr_groups / 64 * 64 : nr_inodes;
+    if (!group_inodes) {
+        nr_groups = 1;
+        group_inodes = nr_inodes;
+    }
+    if (nr_groups == 1) {
+        group_blocks = nr_blocks;
+    }
+    nr_inodes = nr_groups * group_inodes;
+
+    unsigned long nr_inode_blocks = nr_inodes;
+    if (compact) {
+        nr_inode_blocks = (nr_inodes + BBFS_INODES_PER_BLOCK - 1) / BBFS_INODES_PER_BLOCK;
+    }
+    unsigned long region_blocks = 0, nr_regions = 0;
+    if (flags & BBFS_FEAT_LAZY_ITABLE) {
+        /* At least 1 MiB per region, so that the zeroed first one takes the first creates without stalling them. */
+        region_blocks = (nr_inode_blocks + BBFS_ITABLE_MAX_REGIONS - 1) / BBFS_ITABLE_MAX_REGIONS;
+        region_blocks = region_blocks < 256 ? 256 : region_blocks;
+        nr_regions = (nr_inode_blocks + region_blocks - 1) / region_blocks;
+    }
 
     struct bbfs_sb sb = {
         .magic = BBFS_MAGIC,
@@ -47,39 +247,84 @@ int main(int argc, char **argv) {
         .nr_bmap = nr_bmap,
         .nr_inodes = nr_inodes,
         .nr_blocks = nr_blocks,
+        .features = flags,
+        .nr_groups = nr_groups,
+        .group_inodes = group_inodes,
+        .group_blocks = group_blocks,
+        .nr_journal = nr_journal,
+        .nr_inodes_hi = nr_inodes >> 32,
+        .nr_blocks_hi = nr_blocks >> 32,
+        .itable_region_blocks = region_blocks,
+        .itable_regions = nr_regions,
     };
-    if (write(fd, &sb, page_size) < 0) {
+    /* Region 0 holds the root inode and is always zeroed; the rest are left for the kernel. */
+    for (unsigned long r = 1; r < nr_regions; r++) {
+        sb.itable_uninit[r / 32] |= 1u << (r % 32);
+    }
+
+    struct bbfs_layout layout;
+    bbfs_layout(&sb, &layout);
+    unsigned long zero_end = layout.inode_begin + (nr_regions ? region_blocks : nr_inode_blocks);
+
+    zero_buf = aligned_alloc(page_size, ZERO_CHUNK);
+    if (!zero_buf) {
+        close(fd);
+        return -1;
+    }
+    memset(zero_buf, 0, ZERO_CHUNK);
+    /* Wipe any previous superblock first, so that a run interrupted from here on leaves nothing mountable. */
+    if (write_block(fd, zero_buf, page_size, 0) || fsync(fd)) {
+        free(zero_buf);
         close(fd);
         return -1;
     }
 
-    struct bbfs_imap_block imap_blk = {};
-    imap_blk.blocks[0] = 1;
-    if (write(fd, &imap_blk, page_size) < 0) {
+    /* The data area is never read before it is written, so a fresh device can forget all of it. */
+    if (blkdev && !nodiscard) {
+        uint64_t range[2] = {0, stat_buf.st_size};
+        ioctl(fd, BLKDISCARD, range);
+    }
+
+    /* Bypass the page cache for the bulk zeroing where the device allows it. */
+    int dfd = blkdev ? open(argv[optind], O_RDWR | O_DIRECT) : -1;
+    int ret = zero_range(fd, dfd != -1 ? dfd : fd, blkdev, (off_t)layout.journal_begin * page_size,
+                         (off_t)(zero_end - layout.journal_begin) * page_size);
+    if (dfd != -1) {
+        close(dfd);
+    }
+    free(zero_buf);
+    if (ret) {
         close(fd);
         return -1;
     }
 
-    imap_blk.blocks[0] = 0;
-    for (unsigned long i = 1; i < nr_imap; i++) {
-        if (write(fd, &imap_blk, page_size) < 0) {
+    if (nr_journal) {
+        struct bbfs_journal_sb jsb = {
+            .magic = BBFS_JOURNAL_MAGIC,
+            .nr_blocks = nr_journal,
+            .seq = 1,
+        };
+        if (write_block(fd, &jsb, page_size, layout.journal_begin)) {
             close(fd);
             return -1;
         }
     }
 
-    struct bbfs_bmap_block bmap_blk = {};
-    for (unsigned long i = 0; i < nr_bmap; i++) {
-        if (write(fd, &bmap_blk, page_size) < 0) {
-            close(fd);
-            return -1;
-        }
+    struct bbfs_imap_block imap_blk = {};
+    if (flags & BBFS_FEAT_PACKED_BITMAP) {
+        ((uint8_t *)imap_blk.blocks)[0] = 1;
+    } else {
+        imap_blk.blocks[0] = 1;
+    }
+    if (write_block(fd, &imap_blk, page_size, layout.imap_begin)) {
+        close(fd);
+        return -1;
     }
 
     struct timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
     struct bbfs_inode root_inode = {
-        .valid = 1,
+        .i_flags = BBFS_INODE_VALID,
         .i_mode = S_IFDIR | 0755,
         .i_uid = getuid(),
         .i_gid = getgid(),
@@ -92,19 +337,20 @@ int main(int argc, char **argv) {
         .i_mtime_nsec = ts.tv_nsec,
         .i_nlink = 2,
     };
-    if (write(fd, &root_inode, page_size) < 0) {
+    /* The compact inode shares the header layout, so its first 256 bytes are written from root_inode as is. */
+    if (compact) {
+        memset((char *)&root_inode + sizeof(struct bbfs_cinode), 0, sizeof(root_inode) - sizeof(struct bbfs_cinode));
+    }
+    if (write_block(fd, &root_inode, page_size, layout.inode_begin)) {
         close(fd);
         return -1;
     }
 
-    struct bbfs_inode zero_inode = {};
-    for (int i = 1; i < sb.nr_inodes; i++) {
-        if (write(fd, &zero_inode, page_size) < 0) {
-            close(fd);
-            return -1;
-        }
+    /* The superblock goes last, once everything it describes is on disk. */
+    if (fsync(fd) || write_block(fd, &sb, page_size, 0) || fsync(fd)) {
+        close(fd);
+        return -1;
     }
-
     close(fd);
     return 0;
 }
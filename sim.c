@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libbbfs.h"
+
+/*
+ * Replays a trace against an unmounted image through libbbfs, so that allocator and directory changes can be timed
+ * without a kernel. Each line is an operation on a path from the root, '#' starts a comment:
+ *
+ *     mkdir /a
+ *     create /a/f
+ *     append /a/f 65536
+ *     lookup /a/f
+ *     readdir /a
+ *     unlink /a/f
+ */
+
+enum {
+    OP_MKDIR,
+    OP_CREATE,
+    OP_LOOKUP,
+    OP_UNLINK,
+    OP_APPEND,
+    OP_READDIR,
+    NR_OPS,
+};
+
+static const char *op_names[NR_OPS] = {"mkdir", "create", "lookup", "unlink", "append", "readdir"};
+
+struct op_stats {
+    unsigned long count, errors;
+    uint64_t ns, max_ns;
+};
+
+static struct bbfs_img img;
+static int verbose;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-v] image trace|-\n", prog);
+    fprintf(stderr, "  -v: report every failed operation\n");
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Walk to the directory holding the last component of path, which is left in name and len. */
+static int resolve_parent(const char *path, struct bbfs_img_inode *dir, const char **name, unsigned int *len) {
+    int ret = bbfs_img_iget(&img, 0, dir);
+
+    while (!ret) {
+        while (*path == '/') {
+            path++;
+        }
+        const char *end = strchrnul(path, '/');
+        *name = path;
+        *len = end - path;
+        if (!*end || !end[strspn(end, "/")]) {
+            return 0;
+        }
+        uint64_t ino;
+        ret = bbfs_img_lookup(&img, dir, path, end - path, &ino);
+        if (!ret) {
+            ret = bbfs_img_iget(&img, ino, dir);
+        }
+        path = end;
+    }
+    return ret;
+}
+
+static int resolve(const char *path, struct bbfs_img_inode *inode) {
+    const char *name;
+    unsigned int len;
+    uint64_t ino;
+
+    int ret = resolve_parent(path, inode, &name, &len);
+    if (ret || !len) {
+        return ret;
+    }
+    ret = bbfs_img_lookup(&img, inode, name, len, &ino);
+    return ret ? ret : bbfs_img_iget(&img, ino, inode);
+}
+
+static int count_entry(void *arg, const char *name, unsigned int len, uint32_t ino, unsigned int type) {
+    (*(unsigned long *)arg)++;
+    return 0;
+}
+
+static int run_op(int op, const char *path, uint64_t bytes) {
+    static char buf[1 << 20];
+    struct bbfs_img_inode dir, inode;
+    const char *name;
+    unsigned int len;
+    unsigned long entries = 0;
+    int ret;
+
+    switch (op) {
+    case OP_MKDIR:
+    case OP_CREATE:
+    case OP_UNLINK:
+        ret = resolve_parent(path, &dir, &name, &len);
+        if (ret) {
+            return ret;
+        }
+        if (op == OP_UNLINK) {
+            return bbfs_img_unlink(&img, &dir, name, len);
+        }
+        return bbfs_img_create(&img, &dir, name, len, op == OP_MKDIR ? S_IFDIR | 0755 : S_IFREG | 0644, &inode);
+    case OP_LOOKUP:
+        return resolve(path, &inode);
+    case OP_APPEND:
+        ret = resolve(path, &inode);
+        while (!ret && bytes) {
+            size_t chunk = bytes < sizeof(buf) ? bytes : sizeof(buf);
+            ret = bbfs_img_append(&img, &inode, buf, chunk);
+            bytes -= chunk;
+        }
+        return ret;
+    case OP_READDIR:
+        ret = resolve(path, &inode);
+        return ret ? ret : bbfs_img_readdir(&img, &inode, count_entry, &entries);
+    }
+    return -EINVAL;
+}
+
+static uint64_t count_map(uint64_t begin, uint64_t nr) {
+    uint64_t used = 0;
+    for (uint64_t i = 0; i < nr; i++) {
+        used += bbfs_img_test_map(&img, begin, i);
+    }
+    return used;
+}
+
+int main(int argc, char **argv) {
+    struct op_stats stats[NR_OPS] = {0};
+    char line[PATH_MAX + 64];
+    unsigned long lineno = 0;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *trace = strcmp(argv[optind + 1], "-") ? fopen(argv[optind + 1], "r") : stdin;
+    if (!trace) {
+        perror("fopen():");
+        return EXIT_FAILURE;
+    }
+    ret = bbfs_img_open(&img, argv[optind], BBFS_IMG_WRITE | BBFS_IMG_EXCL);
+    if (!ret) {
+        ret = bbfs_img_load_maps(&img);
+    }
+    if (ret) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+        return EXIT_FAILURE;
+    }
+
+    uint64_t start = now_ns();
+    while (fgets(line, sizeof(line), trace)) {
+        char op_name[16], path[PATH_MAX];
+        unsigned long long bytes = 0;
+        int op;
+
+        lineno++;
+        line[strcspn(line, "#")] = '\0';
+        int fields = sscanf(line, "%15s %4095s %llu", op_name, path, &bytes);
+        if (fields <= 0) {
+            continue;
+        }
+        for (op = 0; op < NR_OPS && strcmp(op_name, op_names[op]); op++) {
+        }
+        if (op == NR_OPS || fields < 2 || (op == OP_APPEND) != (fields == 3)) {
+            fprintf(stderr, "line %lu: bad operation\n", lineno);
+            return EXIT_FAILURE;
+        }
+
+        uint64_t t = now_ns();
+        ret = run_op(op, path, bytes);
+        t = now_ns() - t;
+        stats[op].count++;
+        stats[op].ns += t;
+        stats[op].max_ns = t > stats[op].max_ns ? t : stats[op].max_ns;
+        if (ret) {
+            stats[op].errors++;
+            if (verbose) {
+                fprintf(stderr, "line %lu: %s %s: %s\n", lineno, op_name, path, strerror(-ret));
+            }
+        }
+    }
+    uint64_t total = now_ns() - start;
+
+    printf("%-8s %10s %8s %12s %10s %12s\n", "op", "count", "errors", "total ms", "ns/op", "max ns");
+    for (int op = 0; op < NR_OPS; op++) {
+        if (stats[op].count) {
+            printf("%-8s %10lu %8lu %12.3f %10llu %12llu\n", op_names[op], stats[op].count, stats[op].errors,
+                   stats[op].ns / 1e6, (unsigned long long)(stats[op].ns / stats[op].count),
+                   (unsigned long long)stats[op].max_ns);
+        }
+    }
+    printf("%lu lines in %.3f ms, %llu/%llu inodes, %llu/%llu blocks used\n", lineno, total / 1e6,
+           (unsigned long long)count_map(img.layout.imap_begin, img.layout.nr_inodes),
+           (unsigned long long)img.layout.nr_inodes,
+           (unsigned long long)count_map(img.layout.bmap_begin, img.layout.nr_blocks),
+           (unsigned long long)img.layout.nr_blocks);
+
+    ret = bbfs_img_close(&img);
+    if (ret) {
+        fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
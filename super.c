@@ -6,6 +6,8 @@
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/statfs.h>
 
@@ -29,77 +31,156 @@ static struct inode *bbfs_alloc_inode(struct super_block *sb) {
     if (!ci) {
         return NULL;
     }
+    ci->i_flags = 0;
+    ci->l_num = 0;
+    ci->l_overflow = 0;
+    ci->l_resv = 0;
+    ci->l_resv_zero = 0;
+    ci->l_tail = 0;
+    ci->l_unwritten = 0;
+    ci->i_data = NULL;
+    mutex_init(&ci->alloc_lock);
+    mutex_init(&ci->convert_lock);
     inode_init_once(&ci->vfs_inode);
     return &ci->vfs_inode;
 }
 
-static void bbfs_destroy_inode(struct inode *inode) {
+static void bbfs_free_inode(struct inode *inode) {
     struct bbfs_inode_info *ci = BBFS_INODE(inode);
+    kfree(ci->i_data);
     kmem_cache_free(bbfs_inode_cache, ci);
 }
 
-static int bbfs_write_inode(struct inode *inode, struct writeback_control *wbc) {
+static void bbfs_evict_inode(struct inode *inode) {
     struct super_block *sb = inode->i_sb;
     struct bbfs_sb_info *sbi = BBFS_SB(sb);
     struct bbfs_inode_info *ci = BBFS_INODE(inode);
-    ci->disk_inode.i_mode = inode->i_mode;
-    ci->disk_inode.i_uid = i_uid_read(inode);
-    ci->disk_inode.i_gid = i_gid_read(inode);
-    ci->disk_inode.i_size = inode->i_size;
-    ci->disk_inode.i_nlink = inode->i_nlink;
-
-    ci->disk_inode.i_ctime_sec = inode_get_ctime_sec(inode);
-    ci->disk_inode.i_ctime_nsec = inode_get_ctime_nsec(inode);
-    ci->disk_inode.i_atime_sec = inode_get_atime_sec(inode);
-    ci->disk_inode.i_atime_nsec = inode_get_atime_nsec(inode);
-    ci->disk_inode.i_mtime_sec = inode_get_mtime_sec(inode);
-    ci->disk_inode.i_mtime_nsec = inode_get_mtime_nsec(inode);
-
-    struct buffer_head *bh = sb_bread(sb, sbi->inode_begin + inode->i_ino);
-    if (!bh) {
-        return -EIO;
+
+    truncate_inode_pages_final(&inode->i_data);
+    if (S_ISREG(inode->i_mode)) {
+        bbfs_release_reservation(inode);
+        if (inode->i_nlink && !is_bad_inode(inode)) {
+            bbfs_trim_tail(inode);
+        }
     }
-    memcpy(bh->b_data, ci, PAGE_SIZE);
-    mark_buffer_dirty(bh);
-    brelse(bh);
-    return 0;
+    if (!inode->i_nlink && !is_bad_inode(inode)) {
+        int err = bbfs_journal_start(sb);
+        if (S_ISLNK(inode->i_mode)) {
+            if (sbi->disk_sb.features & BBFS_FEAT_COMPACT_INODE && inode->i_size > BBFS_CINODE_INLINE) {
+                bbfs_journal_forget(sb, sbi->block_begin + ci->l_overflow, 1);
+                bbfs_free_block(sb, ci->l_overflow, 0);
+            }
+        } else if (!(ci->i_flags & BBFS_INODE_INLINE)) {
+            bbfs_release_levels(inode, 0);
+        }
+        bbfs_free_ino(sb, inode->i_ino);
+        if (!err) {
+            bbfs_journal_stop(sb);
+        }
+    }
+    invalidate_inode_buffers(inode);
+    clear_inode(inode);
 }
 
 static void bbfs_put_super(struct super_block *sb) {
     struct bbfs_sb_info *sbi = sb->s_fs_info;
     if (sbi) {
+        bbfs_itable_stop(sb);
+        if (sbi->journal) {
+            bbfs_journal_destroy(sb);
+        } else {
+            bbfs_sync_bitmaps(sb, 1);
+        }
+        bbfs_flush_discards(sbi);
+        bbfs_destroy_bitmaps(sbi);
         kfree(sbi);
     }
 }
 
 static int bbfs_sync_fs(struct super_block *sb, int wait) {
     struct bbfs_sb_info *sbi = sb->s_fs_info;
+    /* With a journal the bitmaps reach their home blocks at checkpoints; committing is enough to make them durable. */
+    if (sbi->journal) {
+        return wait ? bbfs_journal_commit(sb) : 0;
+    }
+    int ret = bbfs_sync_bitmaps(sb, wait);
+    if (ret) {
+        return ret;
+    }
+
     struct buffer_head *bh = sb_bread(sb, 0);
     if (!bh) {
         return -EIO;
     }
+    /* Region initialization writes the superblock too; a stale copy here could mark a live region uninitialized. */
+    mutex_lock(&sbi->itable_lock);
     memcpy(bh->b_data, sbi, PAGE_SIZE);
     mark_buffer_dirty(bh);
     if (wait) {
         sync_dirty_buffer(bh);
     }
+    mutex_unlock(&sbi->itable_lock);
     brelse(bh);
     return 0;
 }
 
+static int bbfs_show_options(struct seq_file *seq, struct dentry *root) {
+    struct bbfs_sb_info *sbi = root->d_sb->s_fs_info;
+    if (sbi->mount_opts & BBFS_MOUNT_DISCARD) {
+        seq_puts(seq, ",discard");
+    }
+    return 0;
+}
+
 static struct super_operations bbfs_sops = {
     .put_super = bbfs_put_super,
     .alloc_inode = bbfs_alloc_inode,
-    .destroy_inode = bbfs_destroy_inode,
+    .free_inode = bbfs_free_inode,
+    .dirty_inode = bbfs_dirty_inode,
     .write_inode = bbfs_write_inode,
+    .evict_inode = bbfs_evict_inode,
     .sync_fs = bbfs_sync_fs,
+    .show_options = bbfs_show_options,
 };
 
+enum { Opt_discard, Opt_nodiscard, Opt_err };
+
+static const match_table_t bbfs_tokens = {
+    {Opt_discard, "discard"},
+    {Opt_nodiscard, "nodiscard"},
+    {Opt_err, NULL},
+};
+
+static int bbfs_parse_options(struct super_block *sb, char *options) {
+    struct bbfs_sb_info *sbi = sb->s_fs_info;
+    char *p;
+
+    while ((p = strsep(&options, ",")) != NULL) {
+        substring_t args[MAX_OPT_ARGS];
+        if (!*p) {
+            continue;
+        }
+        int token = match_token(p, bbfs_tokens, args);
+        if (token == Opt_discard) {
+            sbi->mount_opts |= BBFS_MOUNT_DISCARD;
+        } else if (token == Opt_nodiscard) {
+            sbi->mount_opts &= ~BBFS_MOUNT_DISCARD;
+        } else {
+            pr_err("bbfs: unknown mount option \"%s\"\n", p);
+            return -EINVAL;
+        }
+    }
+    if (sbi->mount_opts & BBFS_MOUNT_DISCARD && !bdev_max_discard_sectors(sb->s_bdev)) {
+        pr_warn("bbfs: the device does not support discard, ignoring the discard option\n");
+        sbi->mount_opts &= ~BBFS_MOUNT_DISCARD;
+    }
+    return 0;
+}
+
 int bbfs_fill_super(struct super_block *sb, void *data, int silent) {
     sb->s_magic = BBFS_MAGIC;
     sb_set_blocksize(sb, PAGE_SIZE);
     sb->s_time_gran = 1;
-    sb->s_maxbytes = MAX_LFS_FILESIZE;
     sb->s_op = &bbfs_sops;
 
     struct buffer_head *bh = sb_bread(sb, 0);
@@ -112,34 +193,103 @@ int bbfs_fill_super(struct super_block *sb, void *data, int silent) {
         return -ENOMEM;
     }
     sb->s_fs_info = sbi;
+    sbi->sb = sb;
+    bbfs_init_discard(sbi);
+    mutex_init(&sbi->itable_lock);
     memcpy(&sbi->disk_sb, bh->b_data, sizeof(struct bbfs_sb));
+    sbi->nr_inodes = sbi->disk_sb.nr_inodes;
+    sbi->nr_blocks = sbi->disk_sb.nr_blocks;
+    /* Without 64bit i_size is a 32-bit field; with it, the levels still stop short of 2^32 blocks per file. */
+    sb->s_maxbytes = U32_MAX;
+    if (sbi->disk_sb.features & BBFS_FEAT_64BIT) {
+        sbi->nr_inodes |= (unsigned long)sbi->disk_sb.nr_inodes_hi << 32;
+        sbi->nr_blocks |= (unsigned long)sbi->disk_sb.nr_blocks_hi << 32;
+        sb->s_maxbytes = min_t(loff_t, MAX_LFS_FILESIZE, ((1ull << BBFS_MAX_LEVELS) - 1) << PAGE_SHIFT);
+    }
     sbi->sb_begin = 0;
-    sbi->sb_end = sbi->imap_begin = sbi->sb_begin + sbi->disk_sb.nr_sb;
+    sbi->sb_end = sbi->journal_begin = sbi->sb_begin + sbi->disk_sb.nr_sb;
+    sbi->journal_end = sbi->imap_begin = sbi->journal_begin;
+    if (sbi->disk_sb.features & BBFS_FEAT_JOURNAL) {
+        sbi->journal_end = sbi->imap_begin = sbi->journal_begin + sbi->disk_sb.nr_journal;
+    }
     sbi->imap_end = sbi->bmap_begin = sbi->imap_begin + sbi->disk_sb.nr_imap;
     sbi->bmap_end = sbi->inode_begin = sbi->bmap_begin + sbi->disk_sb.nr_bmap;
-    sbi->inode_end = sbi->block_begin = sbi->inode_begin + sbi->disk_sb.nr_inodes;
-    sbi->block_end = sbi->block_begin + sbi->disk_sb.nr_blocks;
+    if (sbi->disk_sb.features & BBFS_FEAT_COMPACT_INODE) {
+        sbi->inode_end = sbi->inode_begin + DIV_ROUND_UP(sbi->nr_inodes, BBFS_INODES_PER_BLOCK);
+    } else {
+        sbi->inode_end = sbi->inode_begin + sbi->nr_inodes;
+    }
+    sbi->block_begin = sbi->inode_end;
+    sbi->block_end = sbi->block_begin + sbi->nr_blocks;
     brelse(bh);
 
-    if (sbi->disk_sb.magic != sb->s_magic) {
+    if (sbi->disk_sb.magic != sb->s_magic || sbi->disk_sb.features & ~BBFS_FEAT_ALL) {
         kfree(sbi);
         return -EINVAL;
     }
+    if (sbi->disk_sb.features & BBFS_FEAT_LAZY_ITABLE && sbi->disk_sb.itable_regions) {
+        uint64_t region_blocks = sbi->disk_sb.itable_region_blocks;
+        if (sbi->disk_sb.itable_regions > BBFS_ITABLE_MAX_REGIONS || !region_blocks ||
+            region_blocks * sbi->disk_sb.itable_regions < sbi->inode_end - sbi->inode_begin ||
+            region_blocks * (sbi->disk_sb.itable_regions - 1) >= sbi->inode_end - sbi->inode_begin) {
+            kfree(sbi);
+            return -EINVAL;
+        }
+        sbi->itable_region_inodes = region_blocks;
+        if (sbi->disk_sb.features & BBFS_FEAT_COMPACT_INODE) {
+            sbi->itable_region_inodes *= BBFS_INODES_PER_BLOCK;
+        }
+    } else {
+        memset(sbi->disk_sb.itable_uninit, 0, sizeof(sbi->disk_sb.itable_uninit));
+        sbi->disk_sb.itable_regions = 0;
+    }
+
+    int ret = bbfs_parse_options(sb, data);
+    if (!ret) {
+        ret = bbfs_journal_load(sb);
+    }
+    if (ret) {
+        kfree(sbi);
+        return ret;
+    }
+    ret = bbfs_load_bitmaps(sb);
+    if (ret) {
+        bbfs_journal_destroy(sb);
+        kfree(sbi);
+        return ret;
+    }
+    ret = bbfs_journal_finish_load(sb);
+    if (ret) {
+        bbfs_journal_destroy(sb);
+        bbfs_destroy_bitmaps(sbi);
+        kfree(sbi);
+        return ret;
+    }
 
     struct inode *root_inode = bbfs_iget(sb, 0);
     if (IS_ERR(root_inode)) {
+        bbfs_journal_destroy(sb);
+        bbfs_destroy_bitmaps(sbi);
         kfree(sbi);
         return PTR_ERR(root_inode);
     }
 
     sb->s_root = d_make_root(root_inode);
     if (!sb->s_root) {
-        iput(root_inode);
+        bbfs_journal_destroy(sb);
+        bbfs_destroy_bitmaps(sbi);
         kfree(sbi);
         return -ENOMEM;
     }
 
+    /* A failure here only leaves the zeroing to the allocator, so the mount goes on. */
+    ret = bbfs_itable_start(sb);
+    if (ret) {
+        pr_warn("bbfs: could not start inode table zeroing: %d\n", ret);
+    }
+
     pr_info("sb    [%6lld, %6lld)\n", sbi->sb_begin, sbi->sb_end);
+    pr_info("jrnl  [%6lld, %6lld)\n", sbi->journal_begin, sbi->journal_end);
     pr_info("imap  [%6lld, %6lld)\n", sbi->imap_begin, sbi->imap_end);
     pr_info("bmap  [%6lld, %6lld)\n", sbi->bmap_begin, sbi->bmap_end);
     pr_info("inode [%6lld, %6lld)\n", sbi->inode_begin, sbi->inode_end);